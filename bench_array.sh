@@ -0,0 +1,15 @@
+# Associative and indexed arrays at a million keys, next to bash running
+# the same loops. Each insert line fills an array from scratch; the lookup
+# lines fill it and then read every key back, so lookups cost the
+# difference between the two.
+#
+#     mysh bench_array.sh [keys]
+n=${1:-1000000}
+assoc='declare -A m; for k in $(seq '$n'); do m[k$k]=$k; done'
+assoc_get='for k in $(seq '$n'); do v=${m[k$k]}; done'
+index='declare -a a; for k in $(seq '$n'); do a[$k]=$k; done'
+index_get='for k in $(seq '$n'); do v=${a[$k]}; done'
+bench -n 3 -w 1 "$assoc" "bash -c '$assoc'"
+bench -n 3 -w 1 "$assoc; $assoc_get" "bash -c '$assoc; $assoc_get'"
+bench -n 3 -w 1 "$index" "bash -c '$index'"
+bench -n 3 -w 1 "$index; $index_get" "bash -c '$index; $index_get'"
@@ -0,0 +1,10 @@
+# while read over a million-line file, read straight from the file, where
+# read takes blocks and seeks back, and through a pipe, where the loop
+# owns a buffered reader; bash runs the same loops for comparison.
+#
+#     mysh bench_read.sh [file] [lines]
+f=${1:-/tmp/mysh_bench_read}
+test -s $f || seq ${2:-1000000} > $f
+bench -n 5 -w 1 "while read line; do :; done < $f" "bash -c 'while read line; do :; done < $f'"
+bench -n 5 -w 1 "cat $f | while read line; do :; done" "bash -c 'cat $f | while read line; do :; done'"
+bench -n 5 -w 1 "while read -r a b; do :; done < $f" "bash -c 'while read -r a b; do :; done < $f'"
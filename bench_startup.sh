@@ -0,0 +1,5 @@
+# Time-to-exit of mysh -c true, in microseconds, next to /bin/true as the
+# floor any program pays to be forked and executed.
+#
+#     mysh bench_startup.sh [path to mysh]
+bench -n 1000 -w 50 "${1:-./mysh} -c true" /bin/true
@@ -0,0 +1,68 @@
+// Times mysh_run() against system() on the same command line.
+//
+//     make bench_system
+//     ./bench_system 1000 'echo hello; true'
+//
+// Both sides have their standard output thrown away: system() through a
+// redirection on stdout, mysh_run() through an output callback that only
+// counts bytes, which is what a service capturing output would pay for.
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "mysh.h"
+
+double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+void count_bytes(void *arg, const char *data, size_t len) {
+    (void)data;
+    *(size_t *)arg += len;
+}
+
+int main(int argc, char **argv) {
+    int runs = argc > 1 ? atoi(argv[1]) : 1000;
+    const char *cmd = argc > 2 ? argv[2] : "echo hello; /bin/true";
+    if (runs <= 0) {
+        fprintf(stderr, "usage: %s [runs] [command]\n", argv[0]);
+        return 2;
+    }
+
+    struct mysh_ctx *ctx = mysh_open();
+    if (ctx == NULL) {
+        fprintf(stderr, "bench_system: cannot open a mysh context\n");
+        return 1;
+    }
+    size_t bytes = 0;
+    struct mysh_opts opts = {count_bytes, &bytes};
+
+    // Discard system()'s output without paying for a redirection in /bin/sh
+    fflush(stdout);
+    int out = dup(STDOUT_FILENO), devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    double start = now();
+    for (int i = 0; i < runs; i++) {
+        if (system(cmd) == -1) break;
+    }
+    double sys_time = now() - start;
+    dup2(out, STDOUT_FILENO);
+    close(devnull);
+    close(out);
+
+    start = now();
+    for (int i = 0; i < runs; i++) {
+        if (mysh_run(ctx, cmd, &opts) < 0) break;
+    }
+    double mysh_time = now() - start;
+    mysh_close(ctx);
+
+    printf("%s\n", cmd);
+    printf("  system():   %9.1f us per run\n", sys_time / runs * 1e6);
+    printf("  mysh_run(): %9.1f us per run (%zu bytes of output)\n", mysh_time / runs * 1e6, bytes);
+    printf("  %.2fx faster\n", mysh_time > 0 ? sys_time / mysh_time : 0.0);
+    return 0;
+}
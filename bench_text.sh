@@ -0,0 +1,16 @@
+# The in-process wc, head, tail and grep -F next to coreutils, on a file
+# of seq output: 400 million lines, about 3.8 GB, unless told otherwise.
+# The file is written once and kept for later runs. grep's output goes
+# through a pipe: GNU grep stops at its first match when it sees that its
+# output is /dev/null, which bench's output is.
+#
+#     mysh bench_text.sh [file] [lines]
+f=${1:-/tmp/mysh_bench_text}
+test -s $f || seq ${2:-400000000} > $f
+bench -n 5 -w 1 "wc -l $f" "/usr/bin/wc -l $f"
+bench -n 5 -w 1 "wc $f" "/usr/bin/wc $f"
+bench -n 5 -w 1 "grep -F 99999999 $f | cat" "/usr/bin/grep -F 99999999 $f | cat"
+bench -n 5 -w 1 "cat $f | wc -l" "cat $f | /usr/bin/wc -l"
+bench -n 20 -w 2 "head -n 100 $f" "/usr/bin/head -n 100 $f"
+bench -n 20 -w 2 "tail -n 100 $f" "/usr/bin/tail -n 100 $f"
+bench -n 5 -w 1 "cat $f | head -n 100" "cat $f | /usr/bin/head -n 100"
@@ -0,0 +1,78 @@
+// Interface between mysh and the programs around it: the shared objects
+// its load builtin opens, and programs that link the shell in as a library
+// to run command lines without starting /bin/sh.
+#ifndef MYSH_H
+#define MYSH_H
+
+#include <stddef.h>
+
+// Marks what the library exports; the rest of it is hidden.
+#define MYSH_API __attribute__((visibility("default")))
+
+// Bumped whenever struct mysh_builtin or its calling convention changes.
+#define MYSH_PLUGIN_ABI 1
+
+// A builtin a plugin provides. run is called in the shell process with
+// argv[0] set to the name and argv[argc] NULL, after the command's
+// redirections have been applied to stdin, stdout and stderr. It returns
+// the command's exit status. argv belongs to the shell and only lives for
+// the call.
+struct mysh_builtin {
+    const char *name;
+    int (*run)(int argc, char **argv);
+};
+
+// A plugin exports both of these:
+//
+//     const int mysh_plugin_abi = MYSH_PLUGIN_ABI;
+//     const struct mysh_builtin mysh_builtins[] = {
+//         {"hello", hello},
+//         {NULL, NULL}
+//     };
+//
+// and is built with something like: cc -shared -fPIC -o hello.so hello.c
+
+// The library. `make libmysh.a` builds it from the shell's own source,
+// without its main() and with every symbol but the three functions below
+// made local, so the shell's internals cannot clash with the program's.
+// Link programs with libmysh.a -lpthread (and -ldl before glibc 2.34).
+//
+// A context holds what the shell keeps between commands: the command path
+// cache, compiled patterns and arithmetic, loaded builtins. The shell's
+// state is process-wide, so there is one context per process. None of
+// this is thread-safe: the context must be used from one thread at a
+// time, and while mysh_run() runs, other threads see what it does to the
+// process:
+//
+//  - with an output callback, file descriptor 1 is a pipe to it, so
+//    anything another thread writes to standard output goes there too;
+//  - cd changes the working directory of the whole process, and
+//    redirections on builtins move descriptors 0 to 2, until the run
+//    ends and puts them back.
+struct mysh_ctx;
+
+// Called with each piece of a command's standard output as it is written.
+// It runs on a thread of the library's, while mysh_run() waits; it has
+// always been called for the last piece by the time mysh_run() returns.
+typedef void (*mysh_output_fn)(void *arg, const char *data, size_t len);
+
+struct mysh_opts {
+    mysh_output_fn output; // NULL to leave standard output alone
+    void *arg;             // Passed to output
+};
+
+// Returns the context, or NULL if it is already open.
+MYSH_API struct mysh_ctx *mysh_open(void);
+
+// Runs cmdline as the shell would run a line of a script, and returns its
+// exit status, or -1 if it could not be started. External commands are
+// forked and executed directly. Every run starts from the state the
+// context was opened with, as a ( ... ) subshell does: variables, cd and
+// exit do not outlive it, and exit never ends the calling program. opts
+// may be NULL. Background commands are left for the caller to reap, and
+// with an output callback they must not keep standard output open.
+MYSH_API int mysh_run(struct mysh_ctx *ctx, const char *cmdline, const struct mysh_opts *opts);
+
+MYSH_API void mysh_close(struct mysh_ctx *ctx);
+
+#endif
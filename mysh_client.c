@@ -0,0 +1,96 @@
+// Thin client for mysh --server: sends a command line together with this
+// process's stdin, stdout, stderr and working directory to the daemon and
+// exits with the status the command ended with.
+//
+//     cc -O2 -o mysh_client mysh_client.c
+//     mysh --server /tmp/mysh.sock &
+//     mysh_client /tmp/mysh.sock 'echo hello | wc -c'
+//
+// The socket may also come from $MYSH_SOCKET, with the command line as the
+// only argument. Words after the socket are joined with spaces.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define MAX_LINE (64 * 1024) // As the server accepts
+
+int main(int argc, char **argv) {
+    const char *path = getenv("MYSH_SOCKET");
+    int first = 1;
+    if (argc > 2 || path == NULL) {
+        path = argv[1];
+        first = 2;
+    }
+    if (argc <= first) {
+        fprintf(stderr, "usage: mysh_client [socket] command...\n");
+        return 2;
+    }
+
+    static char line[MAX_LINE];
+    size_t len = 0;
+    for (int i = first; i < argc; i++) {
+        size_t n = strlen(argv[i]);
+        if (len + n + 1 > sizeof(line)) {
+            fprintf(stderr, "mysh_client: command line too long\n");
+            return 2;
+        }
+        if (i > first) line[len++] = ' ';
+        memcpy(line + len, argv[i], n);
+        len += n;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "mysh_client: %s: socket path too long\n", path);
+        return 2;
+    }
+    strcpy(addr.sun_path, path);
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "mysh_client: %s: %s\n", path, strerror(errno));
+        return 2;
+    }
+
+    // The request: the line, with our standard descriptors and directory
+    int fds[4] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, open(".", O_PATH | O_DIRECTORY | O_CLOEXEC)};
+    size_t nfds = fds[3] >= 0 ? 4 : 3;
+    union {
+        struct cmsghdr h;
+        char buf[CMSG_SPACE(4 * sizeof(int))];
+    } ctl;
+    memset(&ctl, 0, sizeof(ctl));
+    struct iovec iov = {line, len};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(cm), fds, nfds * sizeof(int));
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) < 0) {
+        fprintf(stderr, "mysh_client: %s\n", strerror(errno));
+        return 2;
+    }
+
+    int status;
+    ssize_t n;
+    while ((n = recv(sock, &status, sizeof(status), 0)) < 0 && errno == EINTR)
+        ;
+    if (n != sizeof(status)) {
+        fprintf(stderr, "mysh_client: no reply from the server\n");
+        return 2;
+    }
+    return status;
+}
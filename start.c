@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,261 +8,8305 @@
 #include <dirent.h>
 #include <fnmatch.h>
 #include <fcntl.h>
-#include <glob.h>
 #include <ctype.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include "mysh.h"
+
+#ifdef MYSH_LIBRARY
+// Everything below is internal to the library; only what mysh.h marks
+// MYSH_API is left for the program it is linked into.
+#pragma GCC visibility push(hidden)
+#endif
 
 #define MAX_LINE 1024
 #define MAX_ARGS 128
 #define TOKEN_DELIM " \t\r\n\a"
 
-int last_exit_status = 0;
+int last_exit_status = 0;
+int in_pipeline_stage = 0; // Set in forked command children
+int stage_builtin = 0; // The running builtin is a whole pipeline stage by itself
+int command_mode = 0; // Running the line given to mysh -c
+int interactive = 0; // Reading commands from a terminal
+FILE *script_input; // Where command lines come from: stdin or the batch file
+int run_in_background = 0; // The current command ended with '&'
+
+
+struct argv_builder;
+
+// Descriptors saved while redirections apply to something that runs in
+// the shell process itself.
+struct saved_fds {
+    int fd[3];
+};
+
+// Outcome of parsing what has been read so far
+enum { PARSE_OK, PARSE_INCOMPLETE, PARSE_ERROR };
+
+// Function prototypes
+void loop();
+char *read_line();
+char *read_continuation(void);
+int run_tokens(char **toks, int *state);
+int in_list(const char *word, const char *const *list);
+int run_script(void);
+char **split_line(char *);
+int execute(char **args);
+int execute_list(char **args);
+int launch(char **args, int tail);
+int execute_builtin(char **args);
+int cd(char **args);
+int pwd(char **args);
+int mysh_which(char **args);
+int mysh_exit(char **args);
+void shell_exit(int status);
+int needs_redirection(char **args);
+int setup_redirection(char **args);
+void glob_push(struct argv_builder *out, char *word, char *pattern);
+void expand_words(char ***args);
+void expand_word(char *word, struct argv_builder *out, int flags);
+char *param_expand(char *expr);
+int find_brace_end(const char *word, int open);
+int find_subst_end(const char *word, int open);
+int find_backtick_end(const char *word, int open);
+int find_commands_end(const char *s, int open);
+int needs_expansion(const char *word);
+int param_name_len(const char *s);
+int starts_expansion(const char *s);
+char *lookup_param(const char *name);
+char *expand_text(char *text);
+char *expand_pattern(char *text);
+int mysh_echo(char **args);
+int mysh_export(char **args);
+int mysh_unset(char **args);
+int single_command_execution(char **args);
+int find_builtin(char *name);
+struct func;
+int run_builtin(int index, struct func *f, char **args);
+int call_function(struct func *f, char **args);
+int redirect_push(char **args, struct saved_fds *saved);
+void fds_save(struct saved_fds *saved);
+void redirect_pop(struct saved_fds *saved);
+int wait_status(int status);
+struct func *func_lookup(const char *name);
+int redirect_op(const char *word, int *fd);
+int redirect_kind(const char *word, int *fd);
+const char *operator_word(const char *w);
+int is_pipe(const char *word);
+int has_pipe(char **args);
+char **stage_words(char **stage);
+struct pattern;
+struct pattern *pattern_compile(const char *src);
+int pattern_match(struct pattern *p, const char *s, size_t len);
+int has_glob_meta(const char *s);
+int mysh_cat(char **args);
+int copy_fd(int in, int out);
+void exec_stage(char **args);
+int external_fallback(char **args);
+int mysh_wc(char **args);
+int mysh_head(char **args);
+int mysh_tail(char **args);
+int mysh_grep(char **args);
+int mysh_read(char **args);
+int mysh_mapfile(char **args);
+int mysh_hash(char **args);
+void exec_command(char **args);
+int assign_word(char *word);
+int expand_array_word(char *word, struct argv_builder *out, int split);
+int is_assignment_arg(char **args, int i);
+int is_heredoc_body(char **args, int i);
+int mysh_declare(char **args);
+int mysh_break(char **args);
+int mysh_return(char **args);
+int mysh_local(char **args);
+int mysh_true(char **args);
+int mysh_false(char **args);
+int mysh_source(char **args);
+int mysh_exec(char **args);
+int mysh_load(char **args);
+int mysh_bench(char **args);
+int builtin_call(int index, char **args);
+int uses_exec(int n, int one);
+int stdin_private(int n, int one, int forked);
+struct line_reader *line_reader_own(void);
+void line_reader_release(struct line_reader *outer);
+void last_stage_run(int i, char **args, int in, int tail);
+struct sourced_script;
+struct sourced_script *mysh_script(const char *name);
+int run_frame(struct sourced_script *s, char **args);
+
+// List of builtin commands, followed by their corresponding functions.
+char *builtin_str[] = {
+    "cd",
+    "pwd",
+    "which",
+    "exit",
+    "cat",
+    "wc",
+    "head",
+    "tail",
+    "grep",
+    "read",
+    "mapfile",
+    "readarray",
+    "echo",
+    "export",
+    "unset",
+    "hash",
+    "declare",
+    "typeset",
+    "break",
+    "continue",
+    "return",
+    "local",
+    "true",
+    "false",
+    ":",
+    "source",
+    ".",
+    "exec",
+    "load",
+    "bench"
+};
+
+int (*builtin_func[]) (char **) = {
+    &cd,
+    &pwd,
+    &mysh_which,
+    &mysh_exit,
+    &mysh_cat,
+    &mysh_wc,
+    &mysh_head,
+    &mysh_tail,
+    &mysh_grep,
+    &mysh_read,
+    &mysh_mapfile,
+    &mysh_mapfile,
+    &mysh_echo,
+    &mysh_export,
+    &mysh_unset,
+    &mysh_hash,
+    &mysh_declare,
+    &mysh_declare,
+    &mysh_break,
+    &mysh_break,
+    &mysh_return,
+    &mysh_local,
+    &mysh_true,
+    &mysh_false,
+    &mysh_true,
+    &mysh_source,
+    &mysh_source,
+    &mysh_exec,
+    &mysh_load,
+    &mysh_bench
+};
+
+int num_builtins() {
+  return sizeof(builtin_str) / sizeof(char *);
+}
+
+// A perfect hash over builtin_str: BUILTIN_SEED was searched for so that
+// builtin_slot() gives every name above a slot of its own, and
+// builtin_slots maps the slot back to the name's index. The block from
+// BUILTIN_SEED to the end of the table is generated: after adding or
+// renaming a builtin, build with -DMYSH_GEN_BUILTINS and paste what the
+// program prints over it. `make check-builtins` fails while it is stale,
+// and so does the build when the number of builtins changed. A table that
+// is stale anyway still works: builtins_init() files the names it misses
+// in the runtime table.
+#define BUILTIN_SLOTS 64
+#define BUILTIN_SEED 0x25bbu
+#define BUILTIN_COUNT 30
+
+const signed char builtin_slots[BUILTIN_SLOTS] = {
+    23, -1, -1, -1, 14, -1, -1, 21, -1, -1, -1, -1, 12, -1, 0, 20,
+    26, 24, 6, -1, -1, 19, 15, -1, 9, 18, -1, 29, 2, 28, -1, 10,
+    4, 16, 11, -1, 27, -1, -1, -1, -1, -1, -1, -1, 25, -1, 1, 7,
+    -1, 17, 3, 5, -1, -1, 13, -1, -1, -1, -1, 22, -1, -1, -1, 8
+};
+
+_Static_assert(sizeof(builtin_str) / sizeof(*builtin_str) == BUILTIN_COUNT,
+               "builtin_slots is out of date: regenerate it with -DMYSH_GEN_BUILTINS");
+
+
+// Bump allocator for the words of one command line. Everything split_line()
+// and the expansions produce is freed in one go once the line has run.
+#define ARENA_CHUNK (64 * 1024)
+
+struct arena_chunk {
+    struct arena_chunk *prev;
+    size_t size, used;
+    char data[];
+};
+
+struct arena {
+    struct arena_chunk *top;
+};
+
+struct arena line_arena;
+
+void *arena_alloc(struct arena *a, size_t n) {
+    n = (n + 7) & ~(size_t)7; // Keep pointer arrays aligned
+    if (a->top == NULL || a->top->size - a->top->used < n) {
+        size_t size = n > ARENA_CHUNK ? n : ARENA_CHUNK;
+        struct arena_chunk *c = malloc(sizeof(*c) + size);
+        if (!c) {
+            fprintf(stderr, "mysh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        c->prev = a->top;
+        c->size = size;
+        c->used = 0;
+        a->top = c;
+    }
+    void *p = a->top->data + a->top->used;
+    a->top->used += n;
+    return p;
+}
+
+char *arena_strndup(struct arena *a, const char *s, size_t n) {
+    char *p = arena_alloc(a, n + 1);
+    memcpy(p, s, n);
+    p[n] = '\0';
+    return p;
+}
+
+// A position in an arena. Releasing to it frees everything allocated since,
+// so nested users can each clean up after themselves.
+struct arena_mark {
+    struct arena_chunk *chunk;
+    size_t used;
+};
+
+struct arena_mark arena_mark(struct arena *a) {
+    struct arena_mark m = {a->top, a->top ? a->top->used : 0};
+    return m;
+}
+
+void arena_release(struct arena *a, struct arena_mark m) {
+    while (a->top && a->top != m.chunk) {
+        struct arena_chunk *c = a->top;
+        a->top = c->prev;
+        free(c);
+    }
+    if (a->top) a->top->used = m.used;
+}
+
+// Frees everything but the oldest chunk, which is kept for the next line.
+void arena_reset(struct arena *a) {
+    while (a->top && a->top->prev) {
+        struct arena_chunk *c = a->top;
+        a->top = c->prev;
+        free(c);
+    }
+    if (a->top) a->top->used = 0;
+}
+
+
+// Growable argument vector used while expansions rebuild args.
+struct argv_builder {
+    char **v;
+    int n, cap;
+};
+
+void argv_init(struct argv_builder *b) {
+    b->cap = MAX_ARGS;
+    b->n = 0;
+    b->v = malloc(b->cap * sizeof(char *));
+    if (!b->v) {
+        fprintf(stderr, "mysh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    b->v[0] = NULL;
+}
+
+void argv_push(struct argv_builder *b, char *word) {
+    if (b->n + 1 >= b->cap) {
+        b->cap = b->cap ? b->cap * 2 : MAX_ARGS;
+        b->v = realloc(b->v, b->cap * sizeof(char *));
+        if (!b->v) {
+            fprintf(stderr, "mysh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    b->v[b->n++] = word;
+    b->v[b->n] = NULL;
+}
+
+// Growable byte buffer for building one word.
+struct strbuf {
+    char *data;
+    size_t len, cap;
+};
+
+void strbuf_add(struct strbuf *sb, const char *data, size_t len) {
+    if (sb->len + len + 1 > sb->cap) {
+        while (sb->len + len + 1 > sb->cap) sb->cap = sb->cap ? sb->cap * 2 : 128;
+        sb->data = realloc(sb->data, sb->cap);
+        if (!sb->data) {
+            fprintf(stderr, "mysh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(sb->data + sb->len, data, len);
+    sb->len += len;
+    sb->data[sb->len] = '\0';
+}
+
+uint64_t hash_bytes(const char *s, size_t len) {
+    uint64_t h = 1469598103934665603ULL; // FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+
+// Variable names are interned: each distinct name is stored once, so the
+// variable table can hold plain pointers and compare them directly.
+struct intern_table {
+    const char **slots;
+    size_t cap, count; // cap is a power of two
+};
+
+struct intern_table names;
+
+const char *intern_name(const char *s, size_t len) {
+    if (names.count * 2 >= names.cap) {
+        size_t cap = names.cap ? names.cap * 2 : 256;
+        const char **slots = calloc(cap, sizeof(char *));
+        if (!slots) {
+            fprintf(stderr, "mysh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < names.cap; i++) {
+            if (names.slots[i] == NULL) continue;
+            size_t j = hash_bytes(names.slots[i], strlen(names.slots[i])) & (cap - 1);
+            while (slots[j]) j = (j + 1) & (cap - 1);
+            slots[j] = names.slots[i];
+        }
+        free(names.slots);
+        names.slots = slots;
+        names.cap = cap;
+    }
+
+    size_t i = hash_bytes(s, len) & (names.cap - 1);
+    for (; names.slots[i]; i = (i + 1) & (names.cap - 1)) {
+        if (strncmp(names.slots[i], s, len) == 0 && names.slots[i][len] == '\0') return names.slots[i];
+    }
+    char *copy = strndup(s, len);
+    if (!copy) {
+        fprintf(stderr, "mysh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    names.slots[i] = copy;
+    names.count++;
+    return copy;
+}
+
+
+// Shell variables: an open-addressing table with linear probing, so a
+// lookup is one hash and usually a single cache line. Unset shifts later
+// entries of the probe run back instead of leaving tombstones, so the table
+// never degrades however many variables come and go.
+#define VAR_EXPORT 0x1
+
+struct var {
+    const char *name; // Interned; NULL marks an empty slot
+    uint32_t hash;
+    int flags;
+    char *value;
+    struct shell_array *array; // Set for array variables, whose value is NULL
+    int env_index;    // Position of NAME=value in shell_envp, or -1
+    int snap;         // Subshell whose undo log last recorded it
+};
+
+struct var_table {
+    struct var *slots;
+    size_t cap, count; // cap is a power of two
+};
+
+struct var_table shell_vars;
+
+// The environment handed to execve(), kept ready to use at all times. Each
+// exported variable with a value owns one "NAME=value" entry; assignment,
+// export and unset patch that one entry instead of rebuilding the array, so
+// starting a command costs nothing per environment variable. environ points
+// at it once vars_load() has run.
+char **shell_envp;
+int envp_count, envp_cap;
+
+char **vars_environ; // The environment the variables are imported from
+int vars_loaded;
+void vars_load(void);
+
+void path_cache_clear(void);
+
+struct shell_array;
+int array_store(struct shell_array *a, char *sub, const char *value);
+void array_free(struct shell_array *a);
+struct shell_array *array_copy(struct shell_array *a);
+int64_t param_arith(char *text, int *ok);
+int64_t arith_value(char *text, int *ok);
+
+char **positional;      // $1 .. $n
+int npositional;
+char *shell_name = "mysh"; // $0
+pid_t shell_pid;        // $$
+pid_t last_bg_pid = -1; // $!
+
+struct var *var_slot(const char *name, size_t len, uint32_t hash) {
+    if (!vars_loaded) vars_load();
+    if (shell_vars.cap == 0) return NULL;
+    size_t mask = shell_vars.cap - 1;
+    for (size_t i = hash & mask; shell_vars.slots[i].name; i = (i + 1) & mask) {
+        struct var *v = &shell_vars.slots[i];
+        if (v->hash == hash && strncmp(v->name, name, len) == 0 && v->name[len] == '\0') return v;
+    }
+    return NULL;
+}
+
+struct var *var_find(const char *name) {
+    size_t len = strlen(name);
+    return var_slot(name, len, (uint32_t)hash_bytes(name, len));
+}
+
+void var_grow(void) {
+    size_t cap = shell_vars.cap ? shell_vars.cap * 2 : 64;
+    struct var *slots = calloc(cap, sizeof(struct var));
+    if (!slots) {
+        fprintf(stderr, "mysh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < shell_vars.cap; i++) {
+        struct var *v = &shell_vars.slots[i];
+        if (v->name == NULL) continue;
+        size_t j = v->hash & (cap - 1);
+        while (slots[j].name) j = (j + 1) & (cap - 1);
+        slots[j] = *v;
+    }
+    free(shell_vars.slots);
+    shell_vars.slots = slots;
+    shell_vars.cap = cap;
+}
+
+// Subshells run in the shell process (see exec_subshell()). While one
+// runs, the first change to each variable logs what the variable was
+// before, so leaving the subshell puts back just what it touched.
+struct var_undo {
+    const char *name; // Interned
+    int existed;
+    char *value;
+    int flags;
+    struct shell_array *array;
+};
+
+struct var_undo *var_log;
+int var_log_count, var_log_cap;
+int snapshot_id; // Innermost running subshell, or 0
+
+void var_touch(struct var *v, int existed) {
+    if (snapshot_id == 0 || v->snap == snapshot_id) return;
+    v->snap = snapshot_id;
+    if (var_log_count == var_log_cap) {
+        var_log_cap = var_log_cap ? var_log_cap * 2 : 64;
+        var_log = realloc(var_log, var_log_cap * sizeof(struct var_undo));
+        if (!var_log) {
+            fprintf(stderr, "mysh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    struct var_undo *u = &var_log[var_log_count++];
+    u->name = v->name;
+    u->existed = existed;
+    u->value = existed && v->value ? strdup(v->value) : NULL;
+    u->flags = existed ? v->flags : 0;
+    u->array = existed && v->array ? array_copy(v->array) : NULL;
+}
+
+// Returns the variable's slot, creating an unset one if needed.
+struct var *var_intern(const char *name) {
+    size_t len = strlen(name);
+    uint32_t hash = (uint32_t)hash_bytes(name, len);
+    struct var *v = var_slot(name, len, hash);
+    if (v) return v;
+
+    if ((shell_vars.count + 1) * 4 > shell_vars.cap * 3) var_grow(); // Load factor <= 3/4
+    size_t mask = shell_vars.cap - 1;
+    size_t i = hash & mask;
+    while (shell_vars.slots[i].name) i = (i + 1) & mask;
+    v = &shell_vars.slots[i];
+    v->name = intern_name(name, len);
+    v->hash = hash;
+    v->flags = 0;
+    v->value = NULL;
+    v->array = NULL;
+    v->env_index = -1;
+    v->snap = 0;
+    shell_vars.count++;
+    var_touch(v, 0);
+    return v;
+}
+
+// Adds or replaces v's entry in shell_envp.
+void envp_put(struct var *v) {
+    size_t namelen = strlen(v->name), vallen = strlen(v->value);
+    char *entry = malloc(namelen + vallen + 2);
+    if (!entry) {
+        fprintf(stderr, "mysh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(entry, v->name, namelen);
+    entry[namelen] = '=';
+    memcpy(entry + namelen + 1, v->value, vallen + 1);
+
+    if (v->env_index >= 0) {
+        free(shell_envp[v->env_index]);
+        shell_envp[v->env_index] = entry;
+        return;
+    }
+    if (envp_count + 1 >= envp_cap) {
+        envp_cap = envp_cap ? envp_cap * 2 : 64;
+        shell_envp = realloc(shell_envp, envp_cap * sizeof(char *));
+        if (!shell_envp) {
+            fprintf(stderr, "mysh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    v->env_index = envp_count;
+    shell_envp[envp_count++] = entry;
+    shell_envp[envp_count] = NULL;
+    environ = shell_envp; // Keep libc (and anything using getenv) in step
+}
+
+// Removes v's entry from shell_envp by moving the last entry into its place.
+void envp_drop(struct var *v) {
+    if (v->env_index < 0) return;
+    int hole = v->env_index;
+    free(shell_envp[hole]);
+    v->env_index = -1;
+    envp_count--;
+    if (hole != envp_count) {
+        char *moved = shell_envp[envp_count];
+        shell_envp[hole] = moved;
+        size_t namelen = strchr(moved, '=') - moved;
+        struct var *m = var_slot(moved, namelen, (uint32_t)hash_bytes(moved, namelen));
+        if (m) m->env_index = hole;
+    }
+    shell_envp[envp_count] = NULL;
+}
+
+char *var_get(const char *name) {
+    struct var *v = var_find(name);
+    return v ? v->value : NULL;
+}
+
+void var_set(const char *name, const char *value) {
+    struct var *v = var_intern(name);
+    var_touch(v, 1);
+    if (v->array) {
+        array_store(v->array, "0", value); // Like NAME[0]=value
+        return;
+    }
+    char *copy = strdup(value);
+    if (!copy) {
+        fprintf(stderr, "mysh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    free(v->value);
+    v->value = copy;
+    if (v->flags & VAR_EXPORT) envp_put(v);
+    if (strcmp(v->name, "PATH") == 0) path_cache_clear();
+}
+
+void var_export(const char *name) {
+    struct var *v = var_intern(name);
+    var_touch(v, 1);
+    v->flags |= VAR_EXPORT;
+    if (v->value) envp_put(v);
+}
+
+void var_unset(const char *name) {
+    struct var *v = var_find(name);
+    if (v == NULL) return;
+    var_touch(v, 1);
+    envp_drop(v);
+    free(v->value);
+    array_free(v->array);
+    if (strcmp(v->name, "PATH") == 0) path_cache_clear();
+
+    // Backward-shift deletion: pull later members of the probe run into
+    // the hole whenever their home slot is at or before it.
+    size_t mask = shell_vars.cap - 1;
+    size_t hole = v - shell_vars.slots;
+    for (size_t j = (hole + 1) & mask; shell_vars.slots[j].name; j = (j + 1) & mask) {
+        size_t home = shell_vars.slots[j].hash & mask;
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            shell_vars.slots[hole] = shell_vars.slots[j];
+            hole = j;
+        }
+    }
+    shell_vars.slots[hole].name = NULL;
+    shell_vars.slots[hole].value = NULL;
+    shell_vars.slots[hole].array = NULL;
+    shell_vars.count--;
+}
+
+// Imports the environment as exported shell variables. The import waits
+// for the first variable lookup, which a one-shot command may never make;
+// until then environ is still the environment as it came.
+void vars_init(char **envp) {
+    shell_pid = getpid();
+    vars_environ = envp;
+}
+
+void vars_load(void) {
+    if (vars_loaded) return;
+    vars_loaded = 1;
+    char **envp = vars_environ;
+    for (int i = 0; envp && envp[i]; i++) {
+        char *eq = strchr(envp[i], '=');
+        if (eq == NULL || eq == envp[i]) continue;
+        char *name = strndup(envp[i], eq - envp[i]);
+        if (!name) {
+            fprintf(stderr, "mysh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        struct var *v = var_intern(name);
+        free(v->value);
+        v->value = strdup(eq + 1);
+        v->flags |= VAR_EXPORT;
+        envp_put(v);
+        free(name);
+    }
+    if (shell_envp == NULL) {
+        envp_cap = 64;
+        shell_envp = calloc(envp_cap, sizeof(char *));
+        if (!shell_envp) {
+            fprintf(stderr, "mysh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    environ = shell_envp;
+}
+
+// True if s[0..len) is a valid variable name.
+int is_name(const char *s, size_t len) {
+    if (len == 0 || !(isalpha((unsigned char)s[0]) || s[0] == '_')) return 0;
+    for (size_t i = 1; i < len; i++) {
+        if (!isalnum((unsigned char)s[i]) && s[i] != '_') return 0;
+    }
+    return 1;
+}
+
+// Length of the NAME, NAME[sub] or NAME+ part in front of an assignment
+// word's '=', or 0 if word is not an assignment.
+size_t assignment_lhs(const char *word) {
+    size_t i = 0;
+    if (!isalpha((unsigned char)word[0]) && word[0] != '_') return 0;
+    while (isalnum((unsigned char)word[i]) || word[i] == '_') i++;
+    if (word[i] == '[') {
+        int depth = 0;
+        for (; word[i] != '\0'; i++) {
+            if (word[i] == '[') depth++;
+            else if (word[i] == ']' && --depth == 0) break;
+        }
+        if (word[i] != ']') return 0;
+        i++;
+    }
+    if (word[i] == '+') i++;
+    return word[i] == '=' ? i : 0;
+}
+
+// True if word has the form NAME=value (or one of the array and += forms).
+int is_assignment(const char *word) {
+    return assignment_lhs(word) > 0;
+}
+
+// True for a plain NAME=value, the only form that can prefix a command.
+int is_scalar_assignment(const char *word) {
+    size_t lhs = assignment_lhs(word);
+    return lhs > 0 && is_name(word, lhs) && word[lhs + 1] != '(';
+}
+
+// Saved state of a variable a command prefix (FOO=1 cmd) overrides while a
+// builtin runs in the shell itself.
+struct saved_var {
+    const char *name;
+    char *value; // NULL if it was unset
+    int flags;
+};
+
+// Applies the leading NAME=value words of args as exported variables and
+// returns how many there were. If saved is not NULL the previous state of
+// each variable is recorded there for restore_prefix(). In a forked child
+// nothing needs saving: the child's copy of the table and envp diverges
+// from the shell's page by page as it is written.
+int apply_prefix(char **args, struct saved_var *saved) {
+    int n = 0;
+    for (; args[n] != NULL && is_assignment(args[n]); n++) {
+        if (!is_scalar_assignment(args[n])) {
+            assign_word(args[n]); // Array forms and += are not undone
+            if (saved) saved[n].name = NULL;
+            continue;
+        }
+        char *eq = strchr(args[n], '=');
+        *eq = '\0';
+        if (saved) {
+            struct var *v = var_intern(args[n]);
+            saved[n].name = v->name;
+            saved[n].value = v->value ? strdup(v->value) : NULL;
+            saved[n].flags = v->flags;
+        }
+        var_set(args[n], eq + 1);
+        var_export(args[n]);
+        *eq = '=';
+    }
+    return n;
+}
+
+// Undoes apply_prefix(), latest assignment first.
+void restore_prefix(struct saved_var *saved, int n) {
+    while (n-- > 0) {
+        if (saved[n].name == NULL) continue;
+        if (saved[n].value == NULL && !(saved[n].flags & VAR_EXPORT)) {
+            var_unset(saved[n].name);
+            continue;
+        }
+        if (saved[n].value == NULL) {
+            // Exported but never given a value: keep the flag, drop the value
+            struct var *v = var_find(saved[n].name);
+            var_touch(v, 1);
+            envp_drop(v);
+            free(v->value);
+            v->value = NULL;
+            continue;
+        }
+        var_set(saved[n].name, saved[n].value);
+        free(saved[n].value);
+        struct var *v = var_find(saved[n].name);
+        if (!(saved[n].flags & VAR_EXPORT)) {
+            envp_drop(v);
+            v->flags &= ~VAR_EXPORT;
+        }
+    }
+}
+
+
+// Descriptors the shell keeps open for itself live at SHELL_FD_BASE and
+// above with close-on-exec set, out of the way of the numbers a script
+// picks for exec 3>file. Redirections may not name them.
+#define SHELL_FD_BASE 10
+
+// Moves fd to SHELL_FD_BASE or above. Returns the new descriptor, or fd
+// itself if it could not be moved.
+int fd_move_high(int fd) {
+    if (fd < 0 || fd >= SHELL_FD_BASE) return fd;
+    int high = fcntl(fd, F_DUPFD_CLOEXEC, SHELL_FD_BASE);
+    if (high < 0) return fd;
+    close(fd);
+    return high;
+}
+
+// True if fd is one of the shell's own.
+int fd_private(int fd) {
+    int flags = fd >= SHELL_FD_BASE ? fcntl(fd, F_GETFD) : -1;
+    return flags >= 0 && (flags & FD_CLOEXEC);
+}
+
+// The working directory is tracked by the shell: its logical path, which
+// $PWD shows and pwd prints without a system call, and an O_PATH
+// descriptor that relative names are opened against. Neither is limited in
+// length; a path too long for the kernel is walked a component at a time.
+struct cwd {
+    char *path; // NULL in a save slot that holds nothing yet
+    int fd;     // -1 if the directory could not be opened
+};
+
+struct cwd cwd = {NULL, -1};
+struct cwd *cwd_saved; // Where cd leaves the directory a subshell or in-process script returns to
+
+int cwd_dirfd(void) {
+    return cwd.fd >= 0 ? cwd.fd : AT_FDCWD;
+}
+
+// openat() for a path of any length.
+int open_long(int dirfd, const char *path, int flags, mode_t mode) {
+    int fd = openat(dirfd, path, flags, mode);
+    if (fd >= 0 || errno != ENAMETOOLONG) return fd;
+
+    int dir = -1; // Directory reached so far, if not dirfd
+    if (path[0] == '/') dir = open("/", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    for (const char *p = path;;) {
+        while (*p == '/') p++;
+        size_t len = strcspn(p, "/");
+        const char *next = p + len + strspn(p + len, "/");
+        char *comp = strndup(*p ? p : ".", *p ? len : 1);
+        if (!comp) {
+            fprintf(stderr, "mysh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        int last = *next == '\0';
+        fd = openat(dir >= 0 ? dir : dirfd, comp, last ? flags : O_PATH | O_DIRECTORY | O_CLOEXEC, mode);
+        int err = errno;
+        free(comp);
+        if (dir >= 0) close(dir);
+        if (fd < 0 || last) {
+            errno = err;
+            return fd;
+        }
+        dir = fd;
+        p = next;
+    }
+}
+
+// Rewrites an absolute path without "." and ".." components or repeated
+// slashes, working on the text alone as cd -L does.
+void path_clean(char *path) {
+    char *out = path;
+    for (char *p = path; *p;) {
+        while (*p == '/') p++;
+        size_t len = strcspn(p, "/");
+        if (len == 0) break;
+        if (len == 1 && p[0] == '.') {
+            // Nothing to add
+        } else if (len == 2 && p[0] == '.' && p[1] == '.') {
+            while (out > path && *--out != '/')
+                ;
+        } else {
+            *out++ = '/';
+            memmove(out, p, len);
+            out += len;
+        }
+        p += len;
+    }
+    if (out == path) *out++ = '/';
+    *out = '\0';
+}
+
+// Takes the working directory from $PWD when that names the current
+// directory, as it does when another shell started this one. mysh -c
+// leaves this until cd or pwd needs it.
+void cwd_init(void) {
+    char *pwd = var_get("PWD");
+    struct stat a, b;
+    if (pwd && pwd[0] == '/' && stat(pwd, &a) == 0 && stat(".", &b) == 0 &&
+        a.st_dev == b.st_dev && a.st_ino == b.st_ino) {
+        cwd.path = strdup(pwd);
+        if (cwd.path) path_clean(cwd.path);
+        if (cwd.path && strcmp(cwd.path, pwd) != 0) {
+            free(cwd.path);
+            cwd.path = NULL;
+        }
+    }
+    if (cwd.path == NULL) cwd.path = getcwd(NULL, 0);
+    if (cwd.path == NULL) cwd.path = strdup(pwd && pwd[0] == '/' ? pwd : "/");
+    if (cwd.path == NULL) {
+        fprintf(stderr, "mysh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    cwd.fd = fd_move_high(open(".", O_PATH | O_DIRECTORY | O_CLOEXEC));
+    var_set("PWD", cwd.path);
+    var_export("PWD");
+}
+
+// Makes fd, which path names, the working directory. The old one goes to
+// cwd_saved if that still has room, and is dropped otherwise.
+void cwd_replace(char *path, int fd) {
+    if (cwd.path == NULL) cwd_init();
+    var_set("OLDPWD", cwd.path);
+    if (cwd_saved && cwd_saved->path == NULL) {
+        *cwd_saved = cwd;
+    } else {
+        free(cwd.path);
+        if (cwd.fd >= 0) close(cwd.fd);
+    }
+    cwd.path = path;
+    cwd.fd = fd_move_high(fd);
+    var_set("PWD", path);
+}
+
+// Returns to the directory kept in saved, if cd left one there.
+void cwd_restore(struct cwd *saved) {
+    if (saved->path == NULL) return;
+    if (saved->fd >= 0 ? fchdir(saved->fd) != 0 : chdir(saved->path) != 0) perror("mysh: cd");
+    free(cwd.path);
+    if (cwd.fd >= 0) close(cwd.fd);
+    cwd = *saved;
+    saved->path = NULL;
+}
+
+
+// Command lookup cache: maps a command name to the full path PATH resolved
+// it to, so repeated commands skip the directory search. Cleared whenever
+// PATH changes and by `hash -r`.
+#define PATH_CACHE_SIZE 128
+
+struct path_entry {
+    char *name;
+    char *path;
+    struct path_entry *next;
+};
+
+struct path_entry *path_cache[PATH_CACHE_SIZE];
+
+void path_cache_clear(void) {
+    for (int i = 0; i < PATH_CACHE_SIZE; i++) {
+        while (path_cache[i]) {
+            struct path_entry *e = path_cache[i];
+            path_cache[i] = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+        }
+    }
+}
+
+// Searches PATH for a regular file called name that access() allows with
+// mode. Returns a malloc'd path, or NULL with errno set.
+char *path_find(const char *name, int mode) {
+    const char *path = var_get("PATH");
+    if (path == NULL) path = "/usr/local/bin:/usr/bin:/bin";
+    size_t namelen = strlen(name);
+    int err = ENOENT;
+
+    for (const char *dir = path; ; ) {
+        const char *end = strchr(dir, ':');
+        size_t dirlen = end ? (size_t)(end - dir) : strlen(dir);
+        char *full = malloc(dirlen + namelen + 3);
+        if (!full) return NULL;
+        if (dirlen == 0) strcpy(full, "./"); // An empty entry means the current directory
+        else {
+            memcpy(full, dir, dirlen);
+            full[dirlen] = '/';
+            full[dirlen + 1] = '\0';
+        }
+        strcat(full, name);
+
+        struct stat st;
+        if (stat(full, &st) == 0 && S_ISREG(st.st_mode)) {
+            if (access(full, mode) == 0) return full;
+            err = EACCES;
+        }
+        free(full);
+        if (end == NULL) break;
+        dir = end + 1;
+    }
+    errno = err;
+    return NULL;
+}
+
+// Searches PATH for an executable called name.
+char *path_search(const char *name) {
+    return path_find(name, X_OK);
+}
+
+// Returns the cached path for name, searching PATH on a miss.
+const char *path_lookup(const char *name) {
+    uint64_t h = hash_bytes(name, strlen(name));
+    struct path_entry **bucket = &path_cache[h % PATH_CACHE_SIZE];
+    for (struct path_entry *e = *bucket; e; e = e->next) {
+        if (strcmp(e->name, name) == 0) return e->path;
+    }
+
+    char *full = path_search(name);
+    if (full == NULL) return NULL;
+    struct path_entry *e = malloc(sizeof(*e));
+    if (e) e->name = strdup(name);
+    if (!e || !e->name) {
+        fprintf(stderr, "mysh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    e->path = full;
+    e->next = *bucket;
+    *bucket = e;
+    return full;
+}
+
+// Resolves the command a stage will run in the shell itself, before it
+// forks, so the result stays in the cache for the next command. Stages
+// with their own PATH= prefix are left to the child.
+void path_prime(char **args) {
+    int i = 0;
+    for (; args[i] != NULL && is_assignment(args[i]); i++) {
+        if (strncmp(args[i], "PATH=", 5) == 0) return;
+    }
+    if (args[i] == NULL || strchr(args[i], '/') || strchr("<>|&", args[i][0]) || needs_expansion(args[i])) return;
+    if (find_builtin(args[i]) < 0) path_lookup(args[i]);
+}
+
+// Replaces the current process with the command in args, handing it the
+// shell's envp directly. Only returns on failure, with errno set.
+void exec_command(char **args) {
+    if (strchr(args[0], '/')) {
+        execve(args[0], args, environ);
+        return;
+    }
+    const char *path = path_lookup(args[0]);
+    if (path == NULL) return;
+    execve(path, args, environ);
+    if (errno == ENOENT) {
+        // The cached binary went away; look again before giving up
+        char *fresh = path_search(args[0]);
+        if (fresh) execve(fresh, args, environ);
+    }
+}
+
+
+// Lexer. Input arrives in pieces of any size (a line from getline(), a
+// chunk of a mapped script) and the lexer keeps its state from one piece to
+// the next, so a quoted string, a $( ... ) or a here-document may span
+// lines and a piece may end anywhere, even after a backslash. Every byte is
+// looked at once. Words keep their quotes for the expansions to interpret.
+// A "\n" word ends each input line that is complete.
+//
+// Bytes are classified by a table; what a class means depends on the
+// state and on the innermost open context: $( (, ${ {, " or `.
+enum lex_class {
+    LC_WORD, LC_BLANK, LC_NEWLINE, LC_OP, LC_SQUOTE, LC_DQUOTE,
+    LC_BACKSLASH, LC_DOLLAR, LC_BACKTICK, LC_OPEN, LC_CLOSE, LC_HASH
+};
+
+const unsigned char lex_classes[256] = {
+    [' '] = LC_BLANK, ['\t'] = LC_BLANK, ['\r'] = LC_BLANK, ['\v'] = LC_BLANK, ['\f'] = LC_BLANK,
+    ['\n'] = LC_NEWLINE,
+    [';'] = LC_OP, ['&'] = LC_OP, ['|'] = LC_OP, ['<'] = LC_OP, ['>'] = LC_OP,
+    ['\''] = LC_SQUOTE, ['"'] = LC_DQUOTE, ['\\'] = LC_BACKSLASH, ['$'] = LC_DOLLAR,
+    ['`'] = LC_BACKTICK, ['('] = LC_OPEN, ['{'] = LC_OPEN, [')'] = LC_CLOSE, ['}'] = LC_CLOSE,
+    ['#'] = LC_HASH,
+};
+
+enum lex_state {
+    LX_START,   // Between words
+    LX_WORD,    // In a word, possibly inside open contexts
+    LX_SQUOTE,  // In '...'
+    LX_ESCAPE,  // After a backslash
+    LX_DOLLAR,  // After a '$' that may open $( or ${
+    LX_OP,      // In an operator that may still grow (& to &&, < to <<-)
+    LX_COMMENT, // From an unquoted '#' to the end of the line
+    LX_HEREDOC  // In the body of a here-document
+};
+
+#define LEX_DEPTH 64
+#define HEREDOC_LITERAL '\001' // First byte of a body that is not expanded
+
+struct heredoc {
+    int word;    // Index of the delimiter word, replaced by the body
+    char *delim; // Delimiter with its quotes removed
+    int strip;   // <<- : leading tabs are removed from each line
+    int quoted;  // Delimiter was quoted: the body is taken literally
+};
+
+// A point where the input so far forms whole lines.
+struct lex_line {
+    int end;     // Words output up to here
+    size_t next; // Input offset just past the newline
+};
+
+struct lexer {
+    int state;
+    char ctx[LEX_DEPTH]; // Open contexts, innermost last
+    size_t ctx_start[LEX_DEPTH]; // Where each one's opening byte is in word
+    int depth;
+    struct strbuf word;  // Word or operator being built
+    size_t op_start;     // LX_OP: the operator after an fd number in word
+    int want_delim;      // The next word is a here-document delimiter
+    struct heredoc *docs;
+    int ndocs, cur_doc, docs_cap;
+    struct strbuf body, line; // LX_HEREDOC: the body so far, its current line
+    struct arena *arena; // Text of the words
+    struct argv_builder *out;
+    size_t offset;       // Input consumed so far
+    size_t line_end;     // Offset where the last complete line ended
+    int record;          // Keep lines[] for the caller
+    struct lex_line *lines;
+    int nlines, lines_cap;
+};
+
+void lexer_init(struct lexer *lx, struct arena *a, struct argv_builder *out) {
+    memset(lx, 0, sizeof(*lx));
+    lx->arena = a;
+    lx->out = out;
+}
+
+void lexer_free(struct lexer *lx) {
+    for (int i = lx->cur_doc; i < lx->ndocs; i++) free(lx->docs[i].delim);
+    free(lx->docs);
+    free(lx->word.data);
+    free(lx->body.data);
+    free(lx->line.data);
+    free(lx->lines);
+}
+
+// True when the input so far ends with a complete line.
+int lexer_complete(struct lexer *lx) {
+    return lx->line_end == lx->offset;
+}
+
+int lex_top(struct lexer *lx) {
+    return lx->depth ? lx->ctx[lx->depth - 1] : 0;
+}
+
+void lex_push(struct lexer *lx, char c) {
+    if (lx->depth == LEX_DEPTH) return; // Deeper nesting is not tracked
+    lx->ctx_start[lx->depth] = lx->word.len;
+    lx->ctx[lx->depth++] = c;
+}
+
+// Tells a ')' that ends a case pattern inside $(...) from one that closes
+// the innermost '('. Only text that mentions case needs the full scan.
+int lex_case_pattern(struct lexer *lx) {
+    size_t open = lx->ctx_start[lx->depth - 1];
+    int in_subst = 0;
+    for (int k = 0; k < lx->depth; k++) {
+        size_t at = lx->ctx_start[k];
+        if (lx->ctx[k] == '(' && at > 0 && lx->word.data[at - 1] == '$') in_subst = 1;
+    }
+    if (!in_subst || !memmem(lx->word.data + open, lx->word.len - open, "case", 4)) return 0;
+    strbuf_add(&lx->word, ")", 1);
+    int end = find_commands_end(lx->word.data, open);
+    lx->word.data[--lx->word.len] = '\0';
+    return end != (int)lx->word.len;
+}
+
+void lex_record(struct lexer *lx) {
+    lx->line_end = lx->offset;
+    if (!lx->record) return;
+    if (lx->nlines == lx->lines_cap) {
+        lx->lines_cap = lx->lines_cap ? lx->lines_cap * 2 : 1024;
+        lx->lines = realloc(lx->lines, lx->lines_cap * sizeof(struct lex_line));
+        if (!lx->lines) {
+            fprintf(stderr, "mysh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    lx->lines[lx->nlines].end = lx->out->n;
+    lx->lines[lx->nlines].next = lx->offset;
+    lx->nlines++;
+}
+
+// Notes a here-document whose delimiter is the word just output.
+void lex_heredoc(struct lexer *lx, int strip) {
+    if (lx->ndocs == lx->docs_cap) {
+        lx->docs_cap = lx->docs_cap ? lx->docs_cap * 2 : 4;
+        lx->docs = realloc(lx->docs, lx->docs_cap * sizeof(struct heredoc));
+        if (!lx->docs) {
+            fprintf(stderr, "mysh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    struct heredoc *d = &lx->docs[lx->ndocs++];
+    const char *w = lx->out->v[lx->out->n - 1];
+    d->word = lx->out->n - 1;
+    d->strip = strip;
+    d->quoted = 0;
+    d->delim = malloc(strlen(w) + 1);
+    if (!d->delim) {
+        fprintf(stderr, "mysh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    size_t n = 0;
+    for (; *w; w++) {
+        if (*w == '\'' || *w == '"' || (*w == '\\' && w[1])) {
+            d->quoted = 1;
+            if (*w != '\\') continue;
+            w++;
+        }
+        d->delim[n++] = *w;
+    }
+    d->delim[n] = '\0';
+}
+
+// Ends the word being built, if there is one.
+void lex_word_end(struct lexer *lx) {
+    lx->state = LX_START;
+    if (lx->word.len == 0) return;
+    argv_push(lx->out, arena_strndup(lx->arena, lx->word.data, lx->word.len));
+    lx->word.len = 0;
+    if (lx->want_delim) {
+        lex_heredoc(lx, lx->want_delim == 2);
+        lx->want_delim = 0;
+    }
+}
+
+#define REDIRECT_FD_DIGITS 9 // Longer numbers before < or > are words of their own
+
+// Starts an operator at c. Digits right before < or > name its descriptor.
+void lex_op_start(struct lexer *lx, char c) {
+    int fd_prefix = lx->state == LX_WORD && (c == '<' || c == '>') && lx->word.len <= REDIRECT_FD_DIGITS;
+    for (size_t k = 0; fd_prefix && k < lx->word.len; k++) fd_prefix = isdigit((unsigned char)lx->word.data[k]);
+    if (!fd_prefix) lex_word_end(lx);
+    lx->op_start = lx->word.len;
+    strbuf_add(&lx->word, &c, 1);
+    lx->state = LX_OP;
+}
+
+// True if the operator op (n bytes) followed by c is still an operator.
+int lex_op_grows(const char *op, size_t n, char c) {
+    if (n == 1) return (op[0] == c) || (op[0] == '>' && c == '&');
+    return n == 2 && op[0] == '<' && op[1] == '<' && c == '-';
+}
+
+void lex_op_end(struct lexer *lx) {
+    const char *op = lx->word.data + lx->op_start;
+    int heredoc = strcmp(op, "<<") == 0 ? 1 : strcmp(op, "<<-") == 0 ? 2 : 0;
+    lx->want_delim = 0;
+    lex_word_end(lx);
+    lx->want_delim = heredoc;
+}
+
+// An unquoted newline: the line is complete unless here-documents follow.
+void lex_newline(struct lexer *lx) {
+    lex_word_end(lx);
+    lx->want_delim = 0;
+    argv_push(lx->out, "\n");
+    if (lx->ndocs > 0) {
+        lx->state = LX_HEREDOC;
+        return;
+    }
+    lex_record(lx);
+}
+
+// Gives the current here-document its body and moves on to the next.
+void lex_doc_end(struct lexer *lx) {
+    struct heredoc *d = &lx->docs[lx->cur_doc++];
+    char *body = arena_alloc(lx->arena, lx->body.len + 2);
+    size_t n = 0;
+    if (d->quoted) body[n++] = HEREDOC_LITERAL;
+    if (lx->body.len) memcpy(body + n, lx->body.data, lx->body.len);
+    body[n + lx->body.len] = '\0';
+    lx->out->v[d->word] = body;
+    free(d->delim);
+    lx->body.len = 0;
+
+    if (lx->cur_doc == lx->ndocs) {
+        lx->ndocs = lx->cur_doc = 0;
+        lx->state = LX_START;
+        lex_record(lx);
+    }
+}
+
+// A whole line of a here-document body is in lx->line.
+void lex_doc_line(struct lexer *lx) {
+    struct heredoc *d = &lx->docs[lx->cur_doc];
+    const char *p = lx->line.data ? lx->line.data : "";
+    if (d->strip) {
+        while (*p == '\t') p++;
+    }
+    if (strcmp(p, d->delim) == 0) {
+        lx->line.len = 0;
+        lex_doc_end(lx);
+        return;
+    }
+    strbuf_add(&lx->body, p, lx->line.len - (p - (lx->line.data ? lx->line.data : "")));
+    strbuf_add(&lx->body, "\n", 1);
+    lx->line.len = 0;
+}
+
+void lexer_feed(struct lexer *lx, const char *buf, size_t len) {
+    size_t base = lx->offset;
+    for (size_t i = 0; i < len; i++) {
+        char c = buf[i];
+        const char *nl, *q;
+
+        switch (lx->state) {
+        case LX_COMMENT:
+            nl = memchr(buf + i, '\n', len - i);
+            if (nl == NULL) {
+                i = len;
+                continue;
+            }
+            i = nl - buf;
+            lx->offset = base + i + 1;
+            lex_newline(lx);
+            continue;
+        case LX_HEREDOC:
+            nl = memchr(buf + i, '\n', len - i);
+            strbuf_add(&lx->line, buf + i, (nl ? (size_t)(nl - buf) : len) - i);
+            if (nl == NULL) {
+                i = len;
+                continue;
+            }
+            i = nl - buf;
+            lx->offset = base + i + 1;
+            lex_doc_line(lx);
+            continue;
+        case LX_SQUOTE:
+            q = memchr(buf + i, '\'', len - i);
+            strbuf_add(&lx->word, buf + i, (q ? (size_t)(q - buf) + 1 : len) - i);
+            if (q == NULL) {
+                i = len;
+                continue;
+            }
+            i = q - buf;
+            lx->state = LX_WORD;
+            continue;
+        case LX_ESCAPE:
+            if (c == '\n') {
+                // Line continuation: the backslash and newline vanish
+                lx->state = lx->word.len == 0 && lx->depth == 0 ? LX_START : LX_WORD;
+                continue;
+            }
+            strbuf_add(&lx->word, "\\", 1);
+            strbuf_add(&lx->word, &c, 1);
+            lx->state = LX_WORD;
+            continue;
+        case LX_DOLLAR:
+            lx->state = LX_WORD;
+            if (c == '(' || c == '{') {
+                lex_push(lx, c);
+                strbuf_add(&lx->word, &c, 1);
+                continue;
+            }
+            break; // An ordinary byte after all
+        case LX_OP:
+            if (lex_op_grows(lx->word.data + lx->op_start, lx->word.len - lx->op_start, c)) {
+                strbuf_add(&lx->word, &c, 1);
+                continue;
+            }
+            lex_op_end(lx);
+            break; // c starts whatever follows the operator
+        }
+
+        // LX_START or LX_WORD
+        int top = lex_top(lx);
+        switch (lex_classes[(unsigned char)c]) {
+        case LC_WORD: {
+            // Plain bytes: copy the whole run at once
+            size_t end = i + 1;
+            while (end < len && lex_classes[(unsigned char)buf[end]] == LC_WORD) end++;
+            strbuf_add(&lx->word, buf + i, end - i);
+            lx->state = LX_WORD;
+            i = end - 1;
+            continue;
+        }
+        case LC_BLANK:
+            if (top) break;
+            lex_word_end(lx);
+            continue;
+        case LC_NEWLINE:
+            if (top) break;
+            lx->offset = base + i + 1;
+            lex_newline(lx);
+            continue;
+        case LC_OP:
+            if (top) break;
+            lex_op_start(lx, c);
+            continue;
+        case LC_HASH:
+            if (lx->state != LX_START) break;
+            lx->state = LX_COMMENT;
+            continue;
+        case LC_SQUOTE:
+            if (top == '"' || top == '`') break;
+            strbuf_add(&lx->word, &c, 1);
+            lx->state = LX_SQUOTE;
+            continue;
+        case LC_DQUOTE:
+            if (top == '"') lx->depth--;
+            else if (top != '`') lex_push(lx, '"');
+            break;
+        case LC_BACKTICK:
+            if (top == '`') lx->depth--;
+            else lex_push(lx, '`');
+            break;
+        case LC_BACKSLASH:
+            lx->state = LX_ESCAPE;
+            continue;
+        case LC_DOLLAR:
+            strbuf_add(&lx->word, &c, 1);
+            lx->state = top == '`' ? LX_WORD : LX_DOLLAR;
+            continue;
+        case LC_OPEN:
+            if (top == '(' || top == '{') {
+                lex_push(lx, c);
+            } else if (!top && c == '(' && lx->word.len > 1 &&
+                       assignment_lhs(lx->word.data) == lx->word.len - 1) {
+                lex_push(lx, c); // NAME=( ... ) is one word
+            } else if (!top && c == '(') {
+                lex_word_end(lx);
+                argv_push(lx->out, "(");
+                continue;
+            }
+            break;
+        case LC_CLOSE:
+            if (top == '(' && lex_case_pattern(lx)) break; // Kept as part of the word
+            if (top == '(' || top == '{') {
+                lx->depth--;
+            } else if (!top && c == ')') {
+                lex_word_end(lx);
+                argv_push(lx->out, ")");
+                continue;
+            }
+            break;
+        }
+        strbuf_add(&lx->word, &c, 1);
+        lx->state = LX_WORD;
+    }
+    lx->offset = base + len;
+}
+
+// Ends the input. A word, operator or here-document still open is taken
+// as it stands; an open quote or substitution is left for the caller to
+// notice through lexer_complete().
+void lexer_finish(struct lexer *lx) {
+    if (lx->state == LX_ESCAPE) {
+        strbuf_add(&lx->word, "\\", 1);
+        lx->state = LX_WORD;
+    }
+    if (lx->state == LX_DOLLAR) lx->state = LX_WORD;
+    if (lx->state == LX_OP) lex_op_end(lx);
+    if (lx->state == LX_COMMENT) lx->state = LX_START;
+    if (lx->state == LX_WORD && lx->depth == 0) lex_word_end(lx);
+    if (lx->state == LX_START && lx->ndocs > 0) lx->state = LX_HEREDOC; // No newline after <<WORD
+    if (lx->state == LX_HEREDOC && lx->line.len > 0) lex_doc_line(lx);
+    while (lx->state == LX_HEREDOC) {
+        fprintf(stderr, "mysh: warning: here-document delimited by end-of-file (wanted `%s')\n",
+                lx->docs[lx->cur_doc].delim);
+        lex_doc_end(lx);
+    }
+    if (lx->state == LX_START && lx->depth == 0 && !lexer_complete(lx)) lex_record(lx);
+}
+
+// Splits a whole string into words, in the line arena.
+char **split_line(char *line) {
+    struct argv_builder out = {NULL, 0, 0};
+    struct lexer lx;
+    argv_init(&out);
+    lexer_init(&lx, &line_arena, &out);
+    lexer_feed(&lx, line, strlen(line));
+    lexer_finish(&lx);
+    if (!lexer_complete(&lx)) lex_word_end(&lx); // Keep an unterminated word as it is
+    lexer_free(&lx);
+    return out.v;
+}
+
+// Compound commands still open in a stream of tokens, followed a few tokens
+// at a time. A block read a line at a time is parsed once, when nesting_open
+// says the last closer has come, rather than again after every line. It only
+// has to be right about well-formed input: when unsure it reports nothing
+// open, and the parser, run early, asks for more lines or gives the error.
+enum { NEST_IF, NEST_LOOP, NEST_CASE, NEST_BRACE, NEST_PAREN };
+enum { CASE_SUBJECT, CASE_IN, CASE_PATTERN, CASE_BODY };
+
+struct nesting {
+    unsigned char kind[LEX_DEPTH], stage[LEX_DEPTH];
+    int depth;
+    int cmd_pos;  // Next word starts a command, so may be a keyword
+    int fn;       // 1 after a word that may name a function, 2 after its "("
+    int fn_kw;    // After "function": the next word is the name
+    int dangling; // Last word was &&, || or |, so the command goes on
+};
+
+void nesting_init(struct nesting *ns) {
+    memset(ns, 0, sizeof(*ns));
+    ns->cmd_pos = 1;
+}
+
+int nesting_open(struct nesting *ns) {
+    return ns->depth > 0 || ns->dangling;
+}
+
+void nesting_push(struct nesting *ns, int kind, int stage) {
+    if (ns->depth == LEX_DEPTH) {
+        ns->depth = 0; // Too deep to follow: let the parser see it
+        return;
+    }
+    ns->kind[ns->depth] = kind;
+    ns->stage[ns->depth++] = stage;
+}
+
+void nesting_pop(struct nesting *ns, int kind) {
+    if (ns->depth > 0 && ns->kind[ns->depth - 1] == kind) ns->depth--;
+    else ns->depth = 0; // Out of place: the parser reports it
+}
+
+// Follows toks[from] up to toks[to].
+void nesting_feed(struct nesting *ns, char **toks, int from, int to) {
+    for (int i = from; i < to; i++) {
+        const char *t = toks[i];
+        int top = ns->depth > 0 ? ns->kind[ns->depth - 1] : -1;
+        unsigned char *stage = ns->depth > 0 ? &ns->stage[ns->depth - 1] : NULL;
+        int fn = ns->fn;
+        ns->fn = 0;
+        if (strcmp(t, "\n") != 0) {
+            ns->dangling = in_list(t, (const char *const[]){"&&", "||", "|", NULL});
+        }
+
+        if (top == NEST_CASE && *stage != CASE_BODY) {
+            // Between "case" and the first ")", and between ";;" and the next
+            if (strcmp(t, "\n") == 0) continue;
+            if (*stage == CASE_SUBJECT) *stage = CASE_IN;
+            else if (*stage == CASE_IN && strcmp(t, "in") == 0) *stage = CASE_PATTERN;
+            else if (*stage == CASE_IN) ns->depth = 0;
+            else if (strcmp(t, "esac") == 0) nesting_pop(ns, NEST_CASE), ns->cmd_pos = 0;
+            else if (strcmp(t, ")") == 0) *stage = CASE_BODY, ns->cmd_pos = 1;
+            continue;
+        }
+        if (strcmp(t, ";;") == 0) {
+            if (top == NEST_CASE) *stage = CASE_PATTERN;
+            else ns->depth = 0;
+            continue;
+        }
+        if (in_list(t, (const char *const[]){"\n", ";", "&", "&&", "||", "|", NULL})) {
+            ns->cmd_pos = 1;
+            continue;
+        }
+        if (strcmp(t, "(") == 0) {
+            if (fn == 1) ns->fn = 2;
+            else if (ns->cmd_pos) nesting_push(ns, NEST_PAREN, 0);
+            continue;
+        }
+        if (strcmp(t, ")") == 0) {
+            if (fn == 2) ns->cmd_pos = 1; // The function body comes next
+            else if (top == NEST_PAREN) nesting_pop(ns, NEST_PAREN), ns->cmd_pos = 0;
+            continue;
+        }
+        if (ns->fn_kw) {
+            ns->fn_kw = 0;
+            ns->fn = 1;
+            ns->cmd_pos = 1;
+            continue;
+        }
+        if (!ns->cmd_pos) continue;
+
+        // A command word: a keyword, or the name of a command or function
+        if (strcmp(t, "if") == 0) nesting_push(ns, NEST_IF, 0);
+        else if (strcmp(t, "while") == 0 || strcmp(t, "until") == 0) nesting_push(ns, NEST_LOOP, 0);
+        else if (strcmp(t, "for") == 0) nesting_push(ns, NEST_LOOP, 0), ns->cmd_pos = 0;
+        else if (strcmp(t, "case") == 0) nesting_push(ns, NEST_CASE, CASE_SUBJECT);
+        else if (strcmp(t, "{") == 0) nesting_push(ns, NEST_BRACE, 0);
+        else if (strcmp(t, "function") == 0) ns->fn_kw = 1;
+        else if (!in_list(t, (const char *const[]){"then", "do", "else", "elif", "!", NULL})) {
+            ns->cmd_pos = 0;
+            if (strcmp(t, "fi") == 0) nesting_pop(ns, NEST_IF);
+            else if (strcmp(t, "done") == 0) nesting_pop(ns, NEST_LOOP);
+            else if (strcmp(t, "}") == 0) nesting_pop(ns, NEST_BRACE);
+            else if (strcmp(t, "esac") == 0) nesting_pop(ns, NEST_CASE);
+            else ns->fn = 1;
+        }
+    }
+}
+
+void loop(void) {
+    char *line;
+    int status;
+
+    do {
+        // Reap finished background commands
+        while (waitpid(-1, NULL, WNOHANG) > 0)
+            ;
+
+        //printf("> ");
+        line = read_line();
+
+        // A quoted string, a here-document, an if, a loop or a function may
+        // go on over several lines: keep reading until what we have lexes
+        // and parses as a whole
+        struct argv_builder toks = {NULL, 0, 0};
+        struct lexer lx;
+        argv_init(&toks);
+        lexer_init(&lx, &line_arena, &toks);
+        struct nesting ns;
+        nesting_init(&ns);
+        int state = PARSE_INCOMPLETE, scanned = 0;
+        status = 1;
+        while (line != NULL) {
+            size_t len = strlen(line);
+            lexer_feed(&lx, line, len);
+            if (len == 0 || line[len - 1] != '\n') lexer_finish(&lx); // Last line has no newline
+            free(line);
+            nesting_feed(&ns, toks.v, scanned, toks.n);
+            scanned = toks.n;
+            if (lexer_complete(&lx) && !nesting_open(&ns)) {
+                status = run_tokens(toks.v, &state);
+                if (!status || state != PARSE_INCOMPLETE) break;
+            }
+            line = read_continuation();
+            if (line == NULL) {
+                // End of input completes a here-document, nothing else
+                int was_parsed = lexer_complete(&lx) && !nesting_open(&ns);
+                lexer_finish(&lx);
+                if (!was_parsed && lexer_complete(&lx)) {
+                    status = run_tokens(toks.v, &state);
+                    if (!status || state != PARSE_INCOMPLETE) break;
+                }
+                fprintf(stderr, "mysh: syntax error: unexpected end of file\n");
+                exit(2);
+            }
+        }
+
+        lexer_free(&lx);
+        free(toks.v);
+        arena_reset(&line_arena); // Every word of these lines lived here
+    } while (status);
+}
+
+// Reads the next line of a command that is not finished yet. Returns NULL
+// at end of input.
+char *read_continuation(void) {
+    char *line = NULL;
+    size_t bufsize = 0;
+    if (getline(&line, &bufsize, script_input) == -1) {
+        free(line);
+        return NULL;
+    }
+    return line;
+}
+
+
+char *read_line(void) {
+    
+    char *line = NULL;
+    size_t bufsize = 0; // have getline allocate a buffer for us
+    ssize_t linelen = getline(&line, &bufsize, script_input);
+
+    if (linelen == -1) {
+        if (feof(script_input)) {
+            fprintf(stderr, "End of file reached. Exiting.\n");
+            exit(last_exit_status); // At end of input, exit as the last command did
+        } else {
+            perror("getline");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    //fprintf(stderr, "Debug: read_line: %s", line); // Print the line read from stdin
+    return line;
+}
+
+
+
+// Compound commands. Whatever a command spans (a loop body, a function, an
+// if over several lines) is parsed once into a pool of nodes that refer to
+// each other by index, with their words in one shared vector. A loop body
+// is therefore tokenized once however often it runs, and building the tree
+// costs no malloc per node.
+enum node_type {
+    NODE_CMD,       // Simple command, or a pipeline of them: words
+    NODE_PIPE,      // Pipeline with a compound stage: a = first stage, chained by next
+    NODE_AND,       // a && b
+    NODE_OR,        // a || b
+    NODE_NOT,       // ! a
+    NODE_THEN,      // then a: runs a if the last command succeeded
+    NODE_ELSE,      // else a: runs a if it failed
+    NODE_IF,        // if a; then b; else c (a list, or a NODE_IF for elif)
+    NODE_WHILE,     // while a; do b; done
+    NODE_UNTIL,     // until a; do b; done
+    NODE_FOR,       // for words[0] in words[1..]; do b; done (c = 1 if "in" given)
+    NODE_CASE,      // case words[0] in a; a chains NODE_CASE_ITEMs
+    NODE_CASE_ITEM, // words = patterns, b = body
+    NODE_FUNC,      // words[0]() a
+    NODE_GROUP,     // { a; }
+    NODE_SUBSHELL   // ( a ); c = 1 if a runs exec and so needs a child
+};
+
+struct node {
+    int type;
+    int background;    // Followed by '&'
+    int a, b, c;       // Child nodes, or -1
+    int next;          // Next node of the same list, or -1
+    int word, nwords;  // Range of ast_words; a NODE_CMD range ends with NULL
+    int redir, nredir; // Redirections after a compound command
+};
+
+// True if c of a node of this type is a child node rather than a flag.
+int node_c_is_child(int type) {
+    return type != NODE_FOR && type != NODE_SUBSHELL;
+}
+
+struct node *ast_nodes;
+int ast_count, ast_cap;
+char **ast_words;
+int ast_nwords, ast_wcap;
+struct arena ast_arena; // Text of the words
+
+// Functions, by name. Their bodies stay in the node pool for good.
+struct func {
+    const char *name; // Interned
+    int body;
+    struct func *next;
+};
+
+#define FUNC_TABLE_SIZE 64
+struct func *func_table[FUNC_TABLE_SIZE];
+int tree_pins; // Bumped when nodes must outlive the command that parsed them
+
+// What a subshell run in the shell process must put back when it ends,
+// beyond the variables in var_log. It is taken at no cost up front: the
+// working directory is only kept by the first cd, and functions defined
+// inside go in front of the saved bucket heads, shadowing the old ones.
+struct snapshot {
+    int id, log_start, nlocals, loop_depth;
+    struct cwd cwd; // The directory to return to, once cd leaves it
+    struct cwd *outer_cwd;
+    struct saved_fds fds; // Standard descriptors, once exec redirects them
+    struct saved_fds *outer_fds;
+    struct func *funcs[FUNC_TABLE_SIZE];
+    pid_t last_bg_pid;
+    struct snapshot *outer;
+};
+
+struct snapshot *snapshot; // Innermost running subshell
+struct saved_fds *exec_fds; // Where exec saves what it redirects, if it must
+
+// Set while the command about to run is the last thing the shell will do,
+// so an external command can take over the shell's process instead of
+// being forked. Each command consumes it and hands it on only to what runs
+// last inside itself.
+int exec_tail;
+
+// Set while the node about to run has just been given stdin to itself, as
+// a pipeline stage or by a redirection of its own. A loop given it so owns
+// the pipe, and its read builtins may buffer ahead on it.
+int stdin_fresh;
+
+// break, continue and return unwind through exec_list() until the loop or
+// function they target picks them up; exit in a script run in process
+// unwinds to the frame running it.
+enum { JUMP_NONE, JUMP_BREAK, JUMP_CONTINUE, JUMP_RETURN, JUMP_EXIT };
+int jump_kind = JUMP_NONE, jump_count;
+int loop_depth, func_depth;
+int source_depth, frame_depth; // Sourced files and in-process scripts running
+int unwind_depth; // In-process scripts and subshells that exit unwinds to
+
+// A forked child has no in-process subshell or script to unwind to: exit
+// and exec there act on the child itself.
+void child_reset(void) {
+    in_pipeline_stage = 1;
+    stage_builtin = 0;
+    unwind_depth = 0;
+    snapshot = NULL;
+    snapshot_id = 0;
+    exec_fds = NULL;
+    cwd_saved = NULL;
+}
+int status_before_builtin; // What $? was before the running builtin reset it
+int subst_status = -1; // Status of the last command substitution in the words being expanded
+int expand_error; // An expansion failed: the command it was for must not run
+
+// Call after expanding a command's words. Returns 1, with the status set,
+// if an expansion failed and the command must not run.
+int expand_failed(void) {
+    if (!expand_error) return 0;
+    expand_error = 0;
+    last_exit_status = 1;
+    return 1;
+}
+
+// Variables made local by the running functions, innermost last
+struct saved_var *locals;
+int nlocals, locals_cap;
+
+// Adds a node to the pool and returns its index. The pool may move, so a
+// parse result goes into a local before it is stored in a node: in
+// ast_nodes[n].a = parse_list(...) the address is taken before the call.
+int node_new(int type) {
+    if (ast_count == ast_cap) {
+        ast_cap = ast_cap ? ast_cap * 2 : 256;
+        ast_nodes = realloc(ast_nodes, ast_cap * sizeof(struct node));
+        if (!ast_nodes) {
+            fprintf(stderr, "mysh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    struct node *n = &ast_nodes[ast_count];
+    n->type = type;
+    n->background = 0;
+    n->a = n->b = n->c = n->next = -1;
+    n->word = n->redir = ast_nwords;
+    n->nwords = n->nredir = 0;
+    return ast_count++;
+}
+
+// Appends a copy of w (or a NULL terminator) to ast_words. Operators are
+// stored as their interned pointers; see operator_word().
+int word_push(const char *w) {
+    if (ast_nwords == ast_wcap) {
+        ast_wcap = ast_wcap ? ast_wcap * 2 : 1024;
+        ast_words = realloc(ast_words, ast_wcap * sizeof(char *));
+        if (!ast_words) {
+            fprintf(stderr, "mysh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    const char *op = operator_word(w);
+    if (op != w) ast_words[ast_nwords] = (char *)op;
+    else ast_words[ast_nwords] = w ? arena_strndup(&ast_arena, w, strlen(w)) : NULL;
+    return ast_nwords++;
+}
+
+struct func *func_lookup(const char *name) {
+    struct func *f = func_table[hash_bytes(name, strlen(name)) % FUNC_TABLE_SIZE];
+    while (f && strcmp(f->name, name) != 0) f = f->next;
+    return f;
+}
+
+void func_define(const char *name, int body) {
+    size_t b = hash_bytes(name, strlen(name)) % FUNC_TABLE_SIZE;
+    struct func *f = func_lookup(name);
+    for (struct func *o = snapshot ? snapshot->funcs[b] : NULL; f && o; o = o->next) {
+        if (o == f) f = NULL; // Defined outside the running subshell: shadow it
+    }
+    if (f == NULL) {
+        struct func **bucket = &func_table[b];
+        f = malloc(sizeof(*f));
+        if (!f) {
+            fprintf(stderr, "mysh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        f->name = intern_name(name, strlen(name));
+        f->next = *bucket;
+        *bucket = f;
+    }
+    f->body = body;
+    tree_pins++;
+}
+
+
+// Recursive-descent parser over the words the lexer produced. A "\n"
+// word marks the end of an input line.
+
+struct parser {
+    char **toks;
+    int pos;
+    int state;
+    int quiet; // Leave syntax errors to be reported when the text runs
+};
+
+int parse_list(struct parser *ps, const char *const *terms);
+int parse_and_or(struct parser *ps);
+int parse_pipeline(struct parser *ps);
+int parse_command(struct parser *ps);
+
+char *peek(struct parser *ps) {
+    return ps->toks[ps->pos];
+}
+
+int at(struct parser *ps, const char *word) {
+    return ps->toks[ps->pos] != NULL && strcmp(ps->toks[ps->pos], word) == 0;
+}
+
+void skip_newlines(struct parser *ps) {
+    while (at(ps, "\n")) ps->pos++;
+}
+
+int in_list(const char *word, const char *const *list) {
+    for (; list && *list; list++) {
+        if (strcmp(word, *list) == 0) return 1;
+    }
+    return 0;
+}
+
+const char *const closers[] = {"elif", "fi", "do", "done", "esac", "}", ")", ";;", NULL};
+const char *const openers[] = {"if", "while", "until", "for", "case", "{", "(", "!", "function", NULL};
+
+int ends_command(const char *word) {
+    return in_list(word, (const char *const[]){";", "&", "&&", "||", ";;", ")", "\n", NULL});
+}
+
+// Reports the word at the parser's position, or notes that the input ended
+// early and more lines are needed. Returns -1 for the callers to pass up.
+int parse_fail(struct parser *ps) {
+    if (ps->state != PARSE_OK) return -1;
+    if (peek(ps) == NULL) {
+        ps->state = PARSE_INCOMPLETE;
+        return -1;
+    }
+    if (!ps->quiet) {
+        fprintf(stderr, "mysh: syntax error near unexpected token `%s'\n",
+                at(ps, "\n") ? "newline" : peek(ps));
+    }
+    ps->state = PARSE_ERROR;
+    return -1;
+}
+
+int expect(struct parser *ps, const char *word) {
+    if (ps->state != PARSE_OK) return 0;
+    if (!at(ps, word)) return parse_fail(ps), 0;
+    ps->pos++;
+    return 1;
+}
+
+// Parses commands up to one of terms (not consumed) or, at the top level
+// (terms == NULL), to the end of the input. Returns the first node of the
+// list, or -1 if it is empty or on failure.
+int parse_list(struct parser *ps, const char *const *terms) {
+    int first = -1, last = -1;
+    for (;;) {
+        while (at(ps, "\n") || at(ps, ";")) ps->pos++;
+        char *w = peek(ps);
+        if (w == NULL) {
+            if (terms) return parse_fail(ps); // Inside a construct: read on
+            return first;
+        }
+        if (in_list(w, terms)) return first;
+        if (in_list(w, closers)) return parse_fail(ps);
+
+        int n = parse_and_or(ps);
+        if (n < 0) return -1;
+        if (at(ps, "&")) {
+            ast_nodes[n].background = 1;
+            ps->pos++;
+        } else if (at(ps, ";") || at(ps, "\n")) {
+            ps->pos++;
+        } else if (peek(ps) != NULL && !in_list(peek(ps), terms)) {
+            return parse_fail(ps);
+        }
+        if (last >= 0) ast_nodes[last].next = n;
+        else first = n;
+        last = n;
+    }
+}
+
+int parse_and_or(struct parser *ps) {
+    int left = parse_pipeline(ps);
+    while (left >= 0 && (at(ps, "&&") || at(ps, "||"))) {
+        int type = at(ps, "&&") ? NODE_AND : NODE_OR;
+        ps->pos++;
+        skip_newlines(ps);
+        int right = parse_pipeline(ps);
+        if (right < 0) return -1;
+        int n = node_new(type);
+        ast_nodes[n].a = left;
+        ast_nodes[n].b = right;
+        left = n;
+    }
+    return left;
+}
+
+int parse_pipeline(struct parser *ps) {
+    if (at(ps, "!")) {
+        ps->pos++;
+        int inner = parse_pipeline(ps);
+        if (inner < 0) return -1;
+        int n = node_new(NODE_NOT);
+        ast_nodes[n].a = inner;
+        return n;
+    }
+    int first = parse_command(ps);
+    if (first < 0 || !at(ps, "|")) return first;
+
+    // Simple stages were already joined into one NODE_CMD; this pipeline
+    // has a compound stage, so each stage becomes its own node.
+    int n = node_new(NODE_PIPE), last = first;
+    ast_nodes[n].a = first;
+    while (at(ps, "|")) {
+        ps->pos++;
+        skip_newlines(ps);
+        int stage = parse_command(ps);
+        if (stage < 0) return -1;
+        ast_nodes[last].next = stage;
+        last = stage;
+    }
+    return n;
+}
+
+// Collects the words of a simple command. Pipes into further simple
+// commands stay inside it, so launch() runs the whole pipeline.
+int parse_simple(struct parser *ps) {
+    int n = node_new(NODE_CMD);
+    int count = 0;
+    while (peek(ps) != NULL && !ends_command(peek(ps))) {
+        if (at(ps, "|")) {
+            int k = ps->pos + 1;
+            while (ps->toks[k] && strcmp(ps->toks[k], "\n") == 0) k++;
+            if (ps->toks[k] == NULL) {
+                ps->pos = k;
+                return parse_fail(ps);
+            }
+            if (count == 0 || in_list(ps->toks[k], openers)) break; // A compound stage follows
+            word_push("|");
+            ps->pos = k;
+            count++;
+            continue;
+        }
+        if (at(ps, "(")) return parse_fail(ps);
+        word_push(peek(ps));
+        ps->pos++;
+        count++;
+    }
+    if (count == 0) return parse_fail(ps);
+    word_push(NULL);
+    ast_nodes[n].nwords = count + 1;
+    return n;
+}
+
+// Parses the words after if or elif, through the closing fi.
+int parse_if_tail(struct parser *ps) {
+    int n = node_new(NODE_IF);
+    int cond = parse_list(ps, (const char *const[]){"then", NULL});
+    if (!expect(ps, "then")) return -1;
+    int body = parse_list(ps, (const char *const[]){"elif", "else", "fi", NULL});
+    if (ps->state != PARSE_OK) return -1;
+    int other = -1;
+    if (at(ps, "elif")) {
+        ps->pos++;
+        other = parse_if_tail(ps);
+        if (other < 0) return -1;
+    } else if (at(ps, "else")) {
+        ps->pos++;
+        other = parse_list(ps, (const char *const[]){"fi", NULL});
+        if (!expect(ps, "fi")) return -1;
+    } else if (!expect(ps, "fi")) {
+        return -1;
+    }
+    ast_nodes[n].a = cond;
+    ast_nodes[n].b = body;
+    ast_nodes[n].c = other;
+    return n;
+}
+
+int parse_compound(struct parser *ps) {
+    char *w = peek(ps);
+    int n;
+    if (strcmp(w, "if") == 0) {
+        ps->pos++;
+        return parse_if_tail(ps);
+    }
+    if (strcmp(w, "while") == 0 || strcmp(w, "until") == 0) {
+        n = node_new(w[0] == 'w' ? NODE_WHILE : NODE_UNTIL);
+        ps->pos++;
+        int cond = parse_list(ps, (const char *const[]){"do", NULL});
+        if (!expect(ps, "do")) return -1;
+        int body = parse_list(ps, (const char *const[]){"done", NULL});
+        if (!expect(ps, "done")) return -1;
+        ast_nodes[n].a = cond;
+        ast_nodes[n].b = body;
+        return n;
+    }
+    if (strcmp(w, "for") == 0) {
+        n = node_new(NODE_FOR);
+        ps->pos++;
+        if (peek(ps) == NULL || !is_name(peek(ps), strlen(peek(ps)))) return parse_fail(ps);
+        word_push(peek(ps));
+        ps->pos++;
+        int count = 1;
+        skip_newlines(ps);
+        if (at(ps, "in")) {
+            ps->pos++;
+            ast_nodes[n].c = 1;
+            while (peek(ps) != NULL && !at(ps, ";") && !at(ps, "\n")) {
+                word_push(peek(ps));
+                ps->pos++;
+                count++;
+            }
+        }
+        word_push(NULL);
+        ast_nodes[n].nwords = count + 1;
+        while (at(ps, ";") || at(ps, "\n")) ps->pos++;
+        if (!expect(ps, "do")) return -1;
+        int body = parse_list(ps, (const char *const[]){"done", NULL});
+        if (!expect(ps, "done")) return -1;
+        ast_nodes[n].b = body;
+        return n;
+    }
+    if (strcmp(w, "case") == 0) {
+        n = node_new(NODE_CASE);
+        ps->pos++;
+        if (peek(ps) == NULL || ends_command(peek(ps))) return parse_fail(ps);
+        word_push(peek(ps));
+        ps->pos++;
+        ast_nodes[n].nwords = 1;
+        skip_newlines(ps);
+        if (!expect(ps, "in")) return -1;
+        int last = -1;
+        for (;;) {
+            skip_newlines(ps);
+            if (at(ps, "esac")) {
+                ps->pos++;
+                return n;
+            }
+            // Patterns: [(]pat [| pat]...)
+            int item = node_new(NODE_CASE_ITEM);
+            int count = 0;
+            if (at(ps, "(")) ps->pos++;
+            for (;;) {
+                char *p = peek(ps);
+                if (p == NULL || (ends_command(p) && strcmp(p, ")") != 0) || strcmp(p, "(") == 0) {
+                    return parse_fail(ps);
+                }
+                ps->pos++;
+                if (strcmp(p, ")") == 0) break;
+                if (strcmp(p, "|") == 0) continue;
+                word_push(p);
+                count++;
+            }
+            if (count == 0) return parse_fail(ps);
+            ast_nodes[item].nwords = count;
+            int body = parse_list(ps, (const char *const[]){";;", "esac", NULL});
+            ast_nodes[item].b = body;
+            if (ps->state != PARSE_OK) return -1;
+            if (at(ps, ";;")) ps->pos++;
+            if (last >= 0) ast_nodes[last].next = item;
+            else ast_nodes[n].a = item;
+            last = item;
+        }
+    }
+    if (strcmp(w, "(") == 0) {
+        n = node_new(NODE_SUBSHELL);
+        ps->pos++;
+        int body = parse_list(ps, (const char *const[]){")", NULL});
+        ast_nodes[n].a = body;
+        if (body < 0 && ps->state == PARSE_OK) return parse_fail(ps); // ( ) is not a command
+        if (!expect(ps, ")")) return -1;
+        ast_nodes[n].c = uses_exec(ast_nodes[n].a, 0);
+        return n;
+    }
+    // { list; }
+    n = node_new(NODE_GROUP);
+    ps->pos++;
+    int body = parse_list(ps, (const char *const[]){"}", NULL});
+    ast_nodes[n].a = body;
+    if (!expect(ps, "}")) return -1;
+    return n;
+}
+
+// Parses a function definition: name() body, name () body or
+// function name [()] body. The body is any compound command.
+int parse_function(struct parser *ps) {
+    if (at(ps, "function")) {
+        ps->pos++;
+        if (peek(ps) == NULL) return parse_fail(ps);
+    }
+    char *w = peek(ps);
+    if (!is_name(w, strlen(w))) return parse_fail(ps);
+    int n = node_new(NODE_FUNC);
+    word_push(w);
+    ast_nodes[n].nwords = 1;
+    ps->pos++;
+    if (at(ps, "(")) {
+        ps->pos++;
+        if (!expect(ps, ")")) return -1;
+    }
+    skip_newlines(ps);
+
+    if (peek(ps) == NULL || !in_list(peek(ps), openers) || at(ps, "!") || at(ps, "function")) {
+        return parse_fail(ps);
+    }
+    int body = parse_command(ps);
+    if (body < 0) return -1;
+    ast_nodes[n].a = body;
+    return n;
+}
+
+int is_function_start(struct parser *ps) {
+    char *w = peek(ps);
+    if (strcmp(w, "function") == 0) return 1;
+    return ps->toks[ps->pos + 1] && strcmp(ps->toks[ps->pos + 1], "(") == 0 &&
+           ps->toks[ps->pos + 2] && strcmp(ps->toks[ps->pos + 2], ")") == 0 && is_name(w, strlen(w));
+}
+
+int parse_command(struct parser *ps) {
+    char *w = peek(ps);
+    if (w == NULL || ends_command(w)) return parse_fail(ps);
+
+    if (strcmp(w, "then") == 0 || strcmp(w, "else") == 0) {
+        int n = node_new(w[0] == 't' ? NODE_THEN : NODE_ELSE);
+        ps->pos++;
+        int body = parse_pipeline(ps);
+        ast_nodes[n].a = body;
+        return body < 0 ? -1 : n;
+    }
+    if (is_function_start(ps)) return parse_function(ps);
+    if (!in_list(w, openers) || strcmp(w, "!") == 0 || strcmp(w, "function") == 0) return parse_simple(ps);
+
+    int n = parse_compound(ps);
+    if (n < 0) return -1;
+    // Redirections after done, fi, esac or } apply to the whole command
+    int fd, count = 0;
+    ast_nodes[n].redir = ast_nwords;
+    while (peek(ps) != NULL && redirect_kind(peek(ps), &fd)) {
+        word_push(peek(ps));
+        ps->pos++;
+        if (peek(ps) == NULL || ends_command(peek(ps))) return parse_fail(ps);
+        word_push(peek(ps));
+        ps->pos++;
+        count += 2;
+    }
+    if (count) {
+        word_push(NULL);
+        ast_nodes[n].nredir = count + 1;
+    }
+    return n;
+}
+
+
+// Copies words[first, first + n) out of the tree and expands them.
+char **node_words(int first, int n, int split) {
+    char **words = malloc((n + 1) * sizeof(char *));
+    if (!words) {
+        fprintf(stderr, "mysh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(words, ast_words + first, n * sizeof(char *));
+    words[n] = NULL;
+    if (split) expand_words(&words);
+    return words;
+}
+
+int exec_node(int i);
+
+int exec_list(int n) {
+    int status = 1, tail = exec_tail;
+    for (; n >= 0 && status && jump_kind == JUMP_NONE; n = ast_nodes[n].next) {
+        exec_tail = tail && ast_nodes[n].next < 0;
+        status = exec_node(n);
+    }
+    exec_tail = 0;
+    return status;
+}
+
+// Called after each pass through a loop body. Returns 1 if the loop
+// should stop.
+int loop_should_stop(void) {
+    if (jump_kind == JUMP_BREAK || jump_kind == JUMP_CONTINUE) {
+        if (--jump_count > 0) return 1; // Aimed at an enclosing loop
+        int stop = jump_kind == JUMP_BREAK;
+        jump_kind = JUMP_NONE;
+        return stop;
+    }
+    return jump_kind == JUMP_RETURN || jump_kind == JUMP_EXIT;
+}
+
+int snapshots_taken;
+
+// Starts a subshell in the shell process. Nothing is copied here; see
+// var_touch() and struct snapshot for how changes are undone. exit, break
+// and return inside end the subshell, as they would end a child.
+void snapshot_begin(struct snapshot *s) {
+    s->id = ++snapshots_taken;
+    s->log_start = var_log_count;
+    s->nlocals = nlocals;
+    s->loop_depth = loop_depth;
+    s->cwd.path = NULL;
+    s->outer_cwd = cwd_saved;
+    cwd_saved = &s->cwd;
+    s->fds.fd[0] = s->fds.fd[1] = s->fds.fd[2] = -1;
+    s->outer_fds = exec_fds;
+    memcpy(s->funcs, func_table, sizeof(func_table));
+    s->last_bg_pid = last_bg_pid;
+    s->outer = snapshot;
+    snapshot = s;
+    snapshot_id = s->id;
+    exec_fds = &s->fds;
+    loop_depth = 0; // A child would have no loop to break out of
+    unwind_depth++;
+}
+
+// Puts the shell back as it was at snapshot_begin(s).
+void snapshot_end(struct snapshot *s) {
+    unwind_depth--;
+    jump_kind = JUMP_NONE;
+    loop_depth = s->loop_depth;
+    redirect_pop(&s->fds);
+    exec_fds = s->outer_fds;
+    snapshot_id = 0; // Undoing is not itself logged
+    int path = 0;
+    while (var_log_count > s->log_start) {
+        struct var_undo *u = &var_log[--var_log_count];
+        path |= strcmp(u->name, "PATH") == 0;
+        if (!u->existed) {
+            var_unset(u->name);
+            continue;
+        }
+        struct var *v = var_intern(u->name);
+        free(v->value);
+        array_free(v->array);
+        v->value = u->value;
+        v->array = u->array;
+        v->flags = u->flags;
+        if ((v->flags & VAR_EXPORT) && v->value) envp_put(v);
+        else envp_drop(v);
+    }
+    if (path) path_cache_clear();
+    while (nlocals > s->nlocals) free(locals[--nlocals].value);
+
+    for (int i = 0; i < FUNC_TABLE_SIZE; i++) {
+        while (func_table[i] != s->funcs[i]) {
+            struct func *f = func_table[i];
+            func_table[i] = f->next;
+            free(f);
+        }
+    }
+    cwd_restore(&s->cwd);
+    cwd_saved = s->outer_cwd;
+    last_bg_pid = s->last_bg_pid;
+    snapshot = s->outer;
+    snapshot_id = snapshot ? snapshot->id : 0;
+}
+
+// True if list n (or, with one set, just node n) may run exec directly,
+// which needs a process of its own to replace. Pipelines, background jobs
+// and nested subshells are not counted: they see to their own process.
+int uses_exec(int n, int one) {
+    for (; n >= 0; n = one ? -1 : ast_nodes[n].next) {
+        struct node *nd = &ast_nodes[n];
+        if (nd->background || nd->type == NODE_PIPE || nd->type == NODE_FUNC || nd->type == NODE_SUBSHELL) {
+            continue;
+        }
+        if (nd->type == NODE_CMD) {
+            int k = nd->word, pipeline = 0;
+            while (ast_words[k] && is_assignment(ast_words[k])) k++;
+            for (int j = k; ast_words[j]; j++) pipeline |= is_pipe(ast_words[j]);
+            if (!pipeline && ast_words[k] && strcmp(ast_words[k], "exec") == 0) return 1;
+            continue;
+        }
+        if (uses_exec(nd->a, 0) || uses_exec(nd->b, 0)) return 1;
+        if (node_c_is_child(nd->type) && uses_exec(nd->c, 0)) return 1;
+    }
+    return 0;
+}
+
+// True if word may run a command of its own: a command substitution, or a
+// <( ) process substitution, which would share the shell's stdin.
+int runs_substitution(const char *word) {
+    if (strchr(word, '`') || strstr(word, "<(")) return 1;
+    for (const char *p = strstr(word, "$("); p; p = strstr(p + 2, "$(")) {
+        if (p[2] != '(') return 1;
+    }
+    return 0;
+}
+
+// True if one of the n redirections in ast_words from r replaces stdin.
+int redirects_stdin(int r, int n) {
+    int fd;
+    for (int k = r; k < r + n - 1; k += 2) {
+        if (redirect_op(ast_words[k], &fd) && fd == STDIN_FILENO) return 1;
+    }
+    return 0;
+}
+
+// True if nothing in list n (or, with one set, just node n) takes input
+// from the shell's stdin but the read and mapfile builtins, run in the
+// shell process itself. A loop over such a body may let read buffer ahead
+// on its pipe. Commands the shell does not know are taken to read stdin;
+// with forked set, so are read and mapfile, as they would run in a child.
+int stdin_private(int n, int one, int forked) {
+    static const char *quiet[] = {"echo", "printf", "test", "[", "export", "unset", "declare",
+                                  "typeset", "local", "break", "continue", "return", "true",
+                                  "false", ":", "cd", "pwd", "hash", "which", NULL};
+    for (; n >= 0; n = one ? -1 : ast_nodes[n].next) {
+        struct node *nd = &ast_nodes[n];
+        if (nd->type == NODE_FUNC) continue;
+        for (int k = nd->word; k < nd->word + nd->nwords; k++) {
+            if (ast_words[k] && runs_substitution(ast_words[k])) return 0;
+        }
+        for (int k = nd->redir; k < nd->redir + nd->nredir; k++) {
+            if (ast_words[k] && runs_substitution(ast_words[k])) return 0;
+        }
+        if (redirects_stdin(nd->redir, nd->nredir)) continue;
+        int child = forked || nd->background;
+        if (nd->type == NODE_CMD) {
+            // Only the first command of a pipeline reads the shell's stdin
+            int k = nd->word, own_input = 0, pipeline = 0, fd;
+            while (ast_words[k] && is_assignment(ast_words[k])) k++;
+            for (int j = k; ast_words[j] && !is_pipe(ast_words[j]); j++) {
+                if (redirect_op(ast_words[j], &fd) && fd == STDIN_FILENO) own_input = 1;
+            }
+            for (int j = k; ast_words[j]; j++) pipeline |= is_pipe(ast_words[j]);
+            if (own_input || ast_words[k] == NULL) continue;
+            const char *name = ast_words[k];
+            int known = 0;
+            for (int q = 0; quiet[q]; q++) known |= strcmp(name, quiet[q]) == 0;
+            if (!child && !pipeline) {
+                known |= strcmp(name, "read") == 0 || strcmp(name, "mapfile") == 0 ||
+                         strcmp(name, "readarray") == 0;
+            }
+            if (!known) return 0;
+            continue;
+        }
+        if (nd->type == NODE_PIPE) {
+            if (!stdin_private(nd->a, 1, 1)) return 0;
+            continue;
+        }
+        if (nd->type == NODE_SUBSHELL) {
+            if (!stdin_private(nd->a, 0, child || nd->c == 1)) return 0;
+            continue;
+        }
+        if (!stdin_private(nd->a, 0, child) || !stdin_private(nd->b, 0, child)) return 0;
+        if (node_c_is_child(nd->type) && !stdin_private(nd->c, 0, child)) return 0;
+    }
+    return 1;
+}
+
+// ( list ): runs list in a snapshot of the shell instead of a child
+// process, so a subshell of builtins costs no fork and one that runs
+// programs costs only theirs. Only a list that runs exec gets a child.
+int exec_subshell(struct node *n, int tail) {
+    if (n->c == 1) {
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            child_reset();
+            exec_tail = 1;
+            exec_list(n->a);
+            fflush(stdout);
+            _exit(last_exit_status);
+        }
+        int status;
+        if (pid < 0) perror("mysh");
+        else if (waitpid(pid, &status, 0) > 0) last_exit_status = wait_status(status);
+        return 1;
+    }
+    struct snapshot s;
+    snapshot_begin(&s);
+    exec_tail = tail;
+    exec_list(n->a);
+    snapshot_end(&s);
+    return 1;
+}
+
+// Runs the last stage of a pipeline, node i or else the simple command
+// args, in the shell itself with its stdin read from in, which is closed.
+// args are expanded only then. It runs in a snapshot, so it changes no more
+// than the child it saves.
+void last_stage_run(int i, char **args, int in, int tail) {
+    struct snapshot s;
+    int saved_in = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, SHELL_FD_BASE);
+    dup2(in, STDIN_FILENO);
+    close(in);
+    snapshot_begin(&s);
+    exec_tail = tail;
+    stdin_fresh = !args;
+    if (args) {
+        char **words = stage_words(args);
+        exec_tail = tail; // Expanding the words may have run commands
+        if (!expand_failed() && words[0]) execute(words);
+        exec_tail = 0;
+        free(words);
+    } else {
+        exec_node(i);
+    }
+    snapshot_end(&s);
+    fflush(stdout);
+    dup2(saved_in, STDIN_FILENO);
+    close(saved_in);
+}
+
+int exec_pipe(struct node *n, int tail) {
+    pid_t pids[MAX_ARGS];
+    int nstages = 0, prev_read = -1;
+
+    fflush(stdout);
+    int in_shell = -1;
+    for (int s = n->a; s >= 0 && nstages < MAX_ARGS; s = ast_nodes[s].next) {
+        if (ast_nodes[s].next < 0 && prev_read != -1 && !uses_exec(s, 1)) {
+            in_shell = s;
+            break;
+        }
+        int pipefd[2] = {-1, -1};
+        if (ast_nodes[s].next >= 0 && pipe(pipefd) == -1) {
+            perror("pipe");
+            break;
+        }
+        pids[nstages] = fork();
+        if (pids[nstages] == 0) {
+            if (prev_read != -1) {
+                dup2(prev_read, STDIN_FILENO);
+                close(prev_read);
+            }
+            if (pipefd[1] != -1) {
+                close(pipefd[0]);
+                dup2(pipefd[1], STDOUT_FILENO);
+                close(pipefd[1]);
+            }
+            child_reset();
+            if (ast_nodes[s].type == NODE_CMD) {
+                char **words = node_words(ast_nodes[s].word, ast_nodes[s].nwords - 1, 1);
+                if (expand_failed()) _exit(last_exit_status);
+                exec_stage(words);
+            }
+            stdin_fresh = prev_read != -1;
+            exec_node(s);
+            fflush(stdout);
+            _exit(last_exit_status);
+        } else if (pids[nstages] < 0) {
+            perror("mysh");
+        }
+        if (prev_read != -1) close(prev_read);
+        if (pipefd[1] != -1) close(pipefd[1]);
+        prev_read = pipefd[0];
+        nstages++;
+    }
+    if (in_shell >= 0) last_stage_run(in_shell, NULL, prev_read, tail);
+    else if (prev_read != -1) close(prev_read);
+
+    for (int s = 0; s < nstages; s++) {
+        int status;
+        if (pids[s] > 0 && waitpid(pids[s], &status, 0) > 0 && s == nstages - 1 && in_shell < 0) {
+            last_exit_status = wait_status(status);
+        }
+    }
+    return 1;
+}
+
+// Runs the compound command n itself, once any redirections are in place.
+// With tail set nothing runs after it, which it passes on to what it runs
+// last.
+int exec_compound(struct node *n, int tail) {
+    int status = 1, fresh = stdin_fresh;
+    stdin_fresh = 0;
+    switch (n->type) {
+    case NODE_PIPE:
+        return exec_pipe(n, tail);
+    case NODE_AND:
+    case NODE_OR:
+        status = exec_node(n->a);
+        if (status && jump_kind == JUMP_NONE && (last_exit_status == 0) == (n->type == NODE_AND)) {
+            exec_tail = tail;
+            status = exec_node(n->b);
+        }
+        return status;
+    case NODE_NOT:
+        status = exec_node(n->a);
+        last_exit_status = !last_exit_status;
+        return status;
+    case NODE_THEN:
+    case NODE_ELSE:
+        exec_tail = tail;
+        if ((last_exit_status == 0) == (n->type == NODE_THEN)) status = exec_node(n->a);
+        exec_tail = 0;
+        return status;
+    case NODE_IF:
+        last_exit_status = 0;
+        status = exec_list(n->a);
+        if (!status || jump_kind != JUMP_NONE) return status;
+        exec_tail = tail;
+        if (last_exit_status == 0) return exec_list(n->b);
+        last_exit_status = 0;
+        return exec_list(n->c);
+    case NODE_WHILE:
+    case NODE_UNTIL: {
+        int body_status = 0;
+        struct line_reader *outer = NULL;
+        if (fresh && stdin_private(n->a, 0, 0) && stdin_private(n->b, 0, 0)) outer = line_reader_own();
+        loop_depth++;
+        for (;;) {
+            status = exec_list(n->a);
+            if (!status || loop_should_stop()) break;
+            if ((last_exit_status == 0) != (n->type == NODE_WHILE)) break;
+            last_exit_status = 0;
+            status = exec_list(n->b);
+            body_status = last_exit_status;
+            if (!status || loop_should_stop()) break;
+        }
+        loop_depth--;
+        line_reader_release(outer);
+        if (jump_kind != JUMP_RETURN && jump_kind != JUMP_EXIT) last_exit_status = body_status;
+        return status;
+    }
+    case NODE_FOR: {
+        struct arena_mark mark = arena_mark(&line_arena);
+        char *name = ast_words[n->word];
+        char **items;
+        int failed = 0;
+        if (n->c == 1) {
+            items = node_words(n->word + 1, n->nwords - 2, 1);
+            failed = expand_failed();
+            if (failed) items[0] = NULL;
+        } else {
+            // No "in": loop over the positional parameters
+            items = malloc((npositional + 1) * sizeof(char *));
+            if (!items) {
+                fprintf(stderr, "mysh: allocation error\n");
+                exit(EXIT_FAILURE);
+            }
+            memcpy(items, positional, npositional * sizeof(char *));
+            items[npositional] = NULL;
+        }
+        last_exit_status = failed;
+        loop_depth++;
+        for (int k = 0; items[k] != NULL; k++) {
+            var_set(name, items[k]);
+            status = exec_list(n->b);
+            if (!status || loop_should_stop()) break;
+        }
+        loop_depth--;
+        free(items);
+        arena_release(&line_arena, mark);
+        return status;
+    }
+    case NODE_CASE: {
+        struct arena_mark mark = arena_mark(&line_arena);
+        expand_error = 0;
+        char *subject = expand_text(ast_words[n->word]);
+        size_t len = strlen(subject);
+        if (expand_failed()) {
+            arena_release(&line_arena, mark);
+            return status;
+        }
+        last_exit_status = 0;
+        for (int item = n->a; item >= 0; item = ast_nodes[item].next) {
+            struct node it = ast_nodes[item];
+            int matched = 0, failed = 0;
+            for (int k = 0; k < it.nwords && !matched && !failed; k++) {
+                char *pat = expand_pattern(ast_words[it.word + k]);
+                failed = expand_failed();
+                if (!failed) matched = pattern_match(pattern_compile(pat), subject, len);
+            }
+            if (failed) break;
+            if (matched) {
+                exec_tail = tail;
+                status = exec_list(it.b);
+                break;
+            }
+        }
+        arena_release(&line_arena, mark);
+        return status;
+    }
+    case NODE_FUNC:
+        func_define(ast_words[n->word], n->a);
+        last_exit_status = 0;
+        return 1;
+    case NODE_GROUP:
+        exec_tail = tail;
+        return exec_list(n->a);
+    case NODE_SUBSHELL:
+        return exec_subshell(n, tail);
+    }
+    return 1;
+}
+
+// Runs node i: a simple command, or a compound one with its redirections
+// applied around it and, after '&', in a child of its own.
+int exec_node(int i) {
+    struct node n = ast_nodes[i]; // The pool may move while we run
+    int status, tail = exec_tail && !n.background, fresh = stdin_fresh;
+    exec_tail = 0;
+    stdin_fresh = 0;
+
+    if (n.type == NODE_CMD) {
+        struct arena_mark mark = arena_mark(&line_arena);
+        subst_status = -1;
+        // A pipeline's stages are expanded by launch(), each once its own
+        // stdin and stdout are in place, since a substitution may read or
+        // write them. Pipelines go through launch() even when they start
+        // with a builtin, so every stage gets its own process and pipe ends.
+        char **words = node_words(n.word, n.nwords - 1, 0);
+        int pipeline = has_pipe(words);
+        if (!pipeline) expand_words(&words);
+        if (!pipeline && expand_failed()) words[0] = NULL;
+        run_in_background = n.background;
+        exec_tail = tail && !pipeline; // Expanding the words may have run commands
+        status = !words[0] ? 1 : pipeline ? launch(words, tail) : execute(words);
+        exec_tail = 0;
+        run_in_background = 0;
+        free(words);
+        arena_release(&line_arena, mark);
+        return status;
+    }
+
+    if (n.background) {
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            child_reset();
+            ast_nodes[i].background = 0;
+            exec_node(i);
+            fflush(stdout);
+            _exit(last_exit_status);
+        }
+        if (pid < 0) perror("mysh");
+        else last_bg_pid = pid;
+        last_exit_status = 0;
+        return 1;
+    }
+
+    if (n.nredir == 0) {
+        stdin_fresh = fresh;
+        return exec_compound(&n, tail);
+    }
+
+    struct arena_mark mark = arena_mark(&line_arena);
+    char **redir = node_words(n.redir, n.nredir - 1, 0);
+    expand_error = 0;
+    for (int k = 1; redir[k - 1] != NULL; k += 2) {
+        if (redir[k][0] != HEREDOC_LITERAL) redir[k] = expand_text(redir[k]);
+    }
+    struct saved_fds saved;
+    status = 1;
+    if (!expand_failed()) {
+        if (redirect_push(redir, &saved) == 0) {
+            stdin_fresh = fresh || redirects_stdin(n.redir, n.nredir);
+            status = exec_compound(&n, tail);
+        }
+        else last_exit_status = 1;
+        redirect_pop(&saved);
+    }
+    free(redir);
+    arena_release(&line_arena, mark);
+    return status;
+}
+
+// Runs a function with args[1..] as its positional parameters.
+int call_function(struct func *f, char **args) {
+    char **saved_positional = positional;
+    int saved_npositional = npositional, base = nlocals;
+    positional = args + 1;
+    for (npositional = 0; positional[npositional] != NULL; npositional++)
+        ;
+
+    func_depth++;
+    int status = exec_node(f->body);
+    func_depth--;
+    if (jump_kind == JUMP_RETURN) jump_kind = JUMP_NONE;
+
+    restore_prefix(locals + base, nlocals - base);
+    nlocals = base;
+    positional = saved_positional;
+    npositional = saved_npositional;
+    return status;
+}
+
+// Parses toks and runs what they hold. Returns the shell's keep-going
+// status; *state says whether the input was complete, and if it was not,
+// nothing ran and nothing of the parse is kept.
+int run_tokens(char **toks, int *state) {
+    struct arena_mark words_mark = arena_mark(&ast_arena);
+    int nodes_mark = ast_count, words_first = ast_nwords, pins = tree_pins;
+    struct parser ps = {toks, 0, PARSE_OK, 0};
+    int root = parse_list(&ps, NULL);
+    int status = 1;
+
+    *state = ps.state;
+    if (ps.state == PARSE_OK) status = exec_list(root);
+    else if (ps.state == PARSE_ERROR) last_exit_status = 2;
+    jump_kind = JUMP_NONE; // break or return outside of anything to leave
+
+    if (tree_pins == pins) {
+        // Nothing refers to this tree any more
+        ast_count = nodes_mark;
+        ast_nwords = words_first;
+        arena_release(&ast_arena, words_mark);
+    }
+    return status;
+}
+
+// Runs a complete command list, such as the text of a substitution.
+int execute_list(char **args) {
+    int state;
+    int status = run_tokens(args, &state);
+    if (state == PARSE_INCOMPLETE) {
+        fprintf(stderr, "mysh: syntax error: unexpected end of file\n");
+        last_exit_status = 2;
+    }
+    return status;
+}
+
+// How a simple command runs. The planner picks the cheapest way that
+// behaves as a child process would: functions, builtins and mysh scripts
+// run in the shell process; an external command that is the last thing the
+// shell will do takes over the shell's process; anything else is forked.
+enum { PLAN_FUNCTION, PLAN_BUILTIN, PLAN_FRAME, PLAN_EXEC, PLAN_SPAWN };
+
+struct plan {
+    int kind;
+    struct func *f;
+    int builtin;
+    struct sourced_script *s;
+};
+
+void plan_command(char **args, int tail, struct plan *p) {
+    p->f = NULL;
+    p->builtin = -1;
+    p->s = NULL;
+    if (run_in_background) p->kind = PLAN_SPAWN;
+    else if ((p->f = func_lookup(args[0])) != NULL) p->kind = PLAN_FUNCTION;
+    else if ((p->builtin = find_builtin(args[0])) >= 0) p->kind = PLAN_BUILTIN;
+    else if ((p->s = mysh_script(args[0])) != NULL) p->kind = PLAN_FRAME;
+    else p->kind = tail ? PLAN_EXEC : PLAN_SPAWN;
+}
+
+// Replaces the shell with the command in args, the last one it had to run.
+void exec_in_place(char **args) {
+    fflush(stdout);
+    if (!in_pipeline_stage && !command_mode) fprintf(stderr, "End of file reached. Exiting.\n");
+    exec_stage(args);
+}
+
+int execute(char **args) {
+    int tail = exec_tail;
+    exec_tail = 0;
+    if (args[0] == NULL || args[0][0] == '#' || strlen(args[0]) == 0) {
+        return 1;
+    }
+    if (args[0] == NULL) {
+        //fprintf(stderr, "Debug: execute: No command entered.\n");
+        return 1;
+    }
+
+    // NAME=value words on their own set shell variables. In front of a
+    // command they only apply to that command, in its child process.
+    int nassign = 0;
+    while (args[nassign] != NULL && is_assignment(args[nassign])) nassign++;
+    if (args[nassign] == NULL) {
+        // Their status is that of the last command substitution in them
+        last_exit_status = subst_status >= 0 ? subst_status : 0;
+        for (int i = 0; i < nassign; i++) {
+            if (assign_word(args[i]) != 0) last_exit_status = 1;
+        }
+        return 1;
+    }
+
+    struct plan p;
+    plan_command(args + nassign, tail, &p);
+    if (p.kind == PLAN_EXEC) exec_in_place(args);
+    if (p.kind != PLAN_SPAWN) {
+        //fprintf(stderr, "Debug: execute: Executing builtin: %s\n", args[0]); // Print the builtin being executed
+        struct saved_var *saved = malloc((nassign + 1) * sizeof(*saved));
+        if (!saved) {
+            fprintf(stderr, "mysh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        apply_prefix(args, saved);
+        int status = p.s ? run_frame(p.s, args + nassign) : run_builtin(p.builtin, p.f, args + nassign);
+        restore_prefix(saved, nassign);
+        free(saved);
+        if (status >= 0) return status;
+    }
+
+    return launch(args, 0); // External command execution
+}
+
+
+// Converts a waitpid() status into a shell exit status.
+int wait_status(int status) {
+    if (WIFEXITED(status)) return WEXITSTATUS(status);
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    return 1;
+}
+
+
+// Builtins the perfect hash does not know: those added by load, numbered
+// from num_builtins() up, and any core builtin not yet given a slot. The
+// table holds indices, with linear probing; it is empty unless used.
+struct mysh_builtin *plugin_builtins;
+int nplugin_builtins, plugin_builtins_cap;
+int *builtin_table; // -1 marks an empty slot
+size_t builtin_table_cap, builtin_table_count; // cap is a power of two
+
+size_t builtin_hash(const char *name, uint32_t seed) {
+    return ((uint32_t)hash_bytes(name, strlen(name)) * seed) >> 26; // Top 6 bits
+}
+
+size_t builtin_slot(const char *name) {
+    return builtin_hash(name, BUILTIN_SEED);
+}
+
+const char *builtin_name(int index) {
+    return index < num_builtins() ? builtin_str[index] : plugin_builtins[index - num_builtins()].name;
+}
+
+int builtin_table_find(const char *name) {
+    if (builtin_table_count == 0) return -1;
+    size_t mask = builtin_table_cap - 1;
+    for (size_t i = hash_bytes(name, strlen(name)) & mask; builtin_table[i] >= 0; i = (i + 1) & mask) {
+        if (strcmp(builtin_name(builtin_table[i]), name) == 0) return builtin_table[i];
+    }
+    return -1;
+}
+
+void builtin_table_add(int index) {
+    if ((builtin_table_count + 1) * 2 > builtin_table_cap) {
+        size_t cap = builtin_table_cap ? builtin_table_cap * 2 : 16;
+        int *table = malloc(cap * sizeof(int));
+        if (!table) {
+            fprintf(stderr, "mysh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        memset(table, -1, cap * sizeof(int));
+        for (size_t i = 0; i < builtin_table_cap; i++) {
+            if (builtin_table[i] < 0) continue;
+            const char *name = builtin_name(builtin_table[i]);
+            size_t j = hash_bytes(name, strlen(name)) & (cap - 1);
+            while (table[j] >= 0) j = (j + 1) & (cap - 1);
+            table[j] = builtin_table[i];
+        }
+        free(builtin_table);
+        builtin_table = table;
+        builtin_table_cap = cap;
+    }
+    const char *name = builtin_name(index);
+    size_t i = hash_bytes(name, strlen(name)) & (builtin_table_cap - 1);
+    while (builtin_table[i] >= 0) i = (i + 1) & (builtin_table_cap - 1);
+    builtin_table[i] = index;
+    builtin_table_count++;
+}
+
+// Catches core builtins that builtin_slots has not caught up with.
+void builtins_init(void) {
+    for (int i = 0; i < num_builtins(); i++) {
+        if (builtin_slots[builtin_slot(builtin_str[i])] != i) builtin_table_add(i);
+    }
+}
+
+int find_builtin(char *name) {
+    int i = builtin_slots[builtin_slot(name)];
+    if (i >= 0 && strcmp(name, builtin_str[i]) == 0) return i;
+    return builtin_table_find(name);
+}
+
+// Runs the builtin with the given index in the shell process.
+int builtin_call(int index, char **args) {
+    if (index < num_builtins()) return (*builtin_func[index])(args);
+    int argc = 0;
+    while (args[argc] != NULL) argc++;
+    last_exit_status = plugin_builtins[index - num_builtins()].run(argc, args);
+    fflush(stdout);
+    return 1;
+}
+
+// load file...: opens each shared object and adds the builtins it exports
+// (see mysh.h). The shell's own builtins cannot be replaced; a name that
+// was loaded before is taken over by the newer plugin.
+int mysh_load(char **args) {
+    if (args[1] == NULL) {
+        fprintf(stderr, "mysh: load: expected a file name\n");
+        last_exit_status = 2;
+        return 1;
+    }
+    for (int a = 1; args[a] != NULL; a++) {
+        void *h = dlopen(args[a], RTLD_NOW | RTLD_LOCAL);
+        if (h == NULL) {
+            fprintf(stderr, "mysh: load: %s\n", dlerror());
+            last_exit_status = 1;
+            continue;
+        }
+        const int *abi = dlsym(h, "mysh_plugin_abi");
+        const struct mysh_builtin *list = dlsym(h, "mysh_builtins");
+        if (abi == NULL || list == NULL || *abi != MYSH_PLUGIN_ABI) {
+            fprintf(stderr, "mysh: load: %s: not a mysh plugin for this shell\n", args[a]);
+            dlclose(h);
+            last_exit_status = 1;
+            continue;
+        }
+        // The handle stays open for as long as the shell runs
+        for (; list->name != NULL; list++) {
+            int i = find_builtin((char *)list->name);
+            if (i >= 0 && i < num_builtins()) {
+                fprintf(stderr, "mysh: load: %s: is a shell builtin\n", list->name);
+                last_exit_status = 1;
+            } else if (i >= 0) {
+                plugin_builtins[i - num_builtins()] = *list;
+            } else {
+                if (nplugin_builtins == plugin_builtins_cap) {
+                    plugin_builtins_cap = plugin_builtins_cap ? plugin_builtins_cap * 2 : 8;
+                    plugin_builtins = realloc(plugin_builtins, plugin_builtins_cap * sizeof(*plugin_builtins));
+                    if (!plugin_builtins) {
+                        fprintf(stderr, "mysh: allocation error\n");
+                        exit(EXIT_FAILURE);
+                    }
+                }
+                plugin_builtins[nplugin_builtins++] = *list;
+                builtin_table_add(num_builtins() + nplugin_builtins - 1);
+            }
+        }
+    }
+    return 1;
+}
+
+
+// Applies the redirections in args to the shell's own stdin, stdout and
+// stderr, saving them first. redirect_pop() undoes it, even on failure.
+int redirect_push(char **args, struct saved_fds *saved) {
+    saved->fd[0] = saved->fd[1] = saved->fd[2] = -1;
+    if (!needs_redirection(args)) return 0;
+    fds_save(saved);
+    return setup_redirection(args);
+}
+
+void fds_save(struct saved_fds *saved) {
+    fflush(stdout);
+    for (int fd = 0; fd < 3; fd++) saved->fd[fd] = fcntl(fd, F_DUPFD_CLOEXEC, SHELL_FD_BASE);
+}
+
+void redirect_pop(struct saved_fds *saved) {
+    if (saved->fd[0] == -1) return;
+    fflush(stdout);
+    for (int fd = 0; fd < 3; fd++) {
+        dup2(saved->fd[fd], fd);
+        close(saved->fd[fd]);
+    }
+}
+
+// Runs a builtin (or, with f set, a function) inside the shell process.
+// Redirections are applied to the shell's own descriptors for the duration
+// of the call and then undone.
+int run_builtin(int index, struct func *f, char **args) {
+    struct saved_fds saved = {{-1, -1, -1}};
+    int status = 1;
+
+    if (!f && index < num_builtins() && builtin_func[index] == &mysh_exec) {
+        status = mysh_exec(args); // Its redirections are for the shell itself
+    } else if (redirect_push(args, &saved) != 0) {
+        last_exit_status = 1;
+    } else if (f) {
+        status = call_function(f, args);
+    } else {
+        status_before_builtin = last_exit_status;
+        last_exit_status = 0; // Builtins only set it when they fail
+        status = builtin_call(index, args);
+    }
+    redirect_pop(&saved);
+    return status;
+}
+
+
+// Changes to dir, taken relative to the working directory. With physical
+// set, or when the logical path cannot be opened, ".." means the parent on
+// disk and the new path is read back from the kernel.
+int cd_to(const char *dir, int physical) {
+    if (cwd.path == NULL) cwd_init();
+    char *path = NULL;
+    int fd = -1;
+    if (!physical) {
+        size_t len = strlen(cwd.path), dlen = strlen(dir);
+        path = malloc(len + dlen + 2);
+        if (!path) {
+            fprintf(stderr, "mysh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        if (dir[0] == '/') memcpy(path, dir, dlen + 1);
+        else sprintf(path, "%s/%s", cwd.path, dir);
+        path_clean(path);
+        fd = open_long(AT_FDCWD, path, O_PATH | O_DIRECTORY | O_CLOEXEC, 0);
+        if (fd < 0) {
+            free(path);
+            path = NULL;
+        }
+    }
+    if (fd < 0) fd = open_long(cwd_dirfd(), dir, O_PATH | O_DIRECTORY | O_CLOEXEC, 0);
+    if (fd < 0 || fchdir(fd) != 0) {
+        int err = errno;
+        if (fd >= 0) close(fd);
+        free(path);
+        errno = err;
+        return -1;
+    }
+    if (path == NULL) path = getcwd(NULL, 0);
+    if (path == NULL) {
+        // Too deep for getcwd(): build it from the logical path
+        path = malloc(strlen(cwd.path) + strlen(dir) + 2);
+        if (!path) {
+            fprintf(stderr, "mysh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        if (dir[0] == '/') strcpy(path, dir);
+        else sprintf(path, "%s/%s", cwd.path, dir);
+        path_clean(path);
+    }
+    cwd_replace(path, fd);
+    return 0;
+}
+
+// cd [-L|-P] [dir|-]: "-" is $OLDPWD, and a relative name not starting
+// with "." is looked for along $CDPATH first.
+int cd(char **args) {
+    int physical = 0, i = 1;
+    for (; args[i] && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        if (strcmp(args[i], "-L") == 0) physical = 0;
+        else if (strcmp(args[i], "-P") == 0) physical = 1;
+        else {
+            fprintf(stderr, "mysh: cd: %s: invalid option\n", args[i]);
+            last_exit_status = 2;
+            return 1;
+        }
+    }
+
+    char *dir = args[i];
+    int show = 0; // Print where we ended up
+    if (dir == NULL || strcmp(dir, "~") == 0) {
+        dir = var_get("HOME");
+        if (dir == NULL) {
+            fprintf(stderr, "mysh: cd: HOME not set\n");
+            last_exit_status = 1;
+            return 1;
+        }
+    } else if (args[i + 1] != NULL) {
+        fprintf(stderr, "mysh: cd: too many arguments\n");
+        last_exit_status = 1;
+        return 1;
+    } else if (strcmp(dir, "-") == 0) {
+        dir = var_get("OLDPWD");
+        if (dir == NULL) {
+            fprintf(stderr, "mysh: cd: OLDPWD not set\n");
+            last_exit_status = 1;
+            return 1;
+        }
+        show = 1;
+    }
+    if (dir[0] == '\0') return 1;
+
+    char *cdpath = var_get("CDPATH");
+    int relative = dir[0] != '/' && strcmp(dir, ".") != 0 && strcmp(dir, "..") != 0 &&
+                   strncmp(dir, "./", 2) != 0 && strncmp(dir, "../", 3) != 0;
+    if (cdpath && relative) {
+        for (const char *p = cdpath;;) {
+            size_t len = strcspn(p, ":");
+            char *try = arena_alloc(&line_arena, len + strlen(dir) + 2);
+            if (len == 0) strcpy(try, dir);
+            else sprintf(try, "%.*s/%s", (int)len, p, dir);
+            if (cd_to(try, physical) == 0) {
+                if (len > 0 || show) printf("%s\n", cwd.path);
+                return 1;
+            }
+            if (p[len] == '\0') break;
+            p += len + 1;
+        }
+    }
+    if (cd_to(dir, physical) != 0) {
+        fprintf(stderr, "mysh: cd: %s: %s\n", args[i] ? args[i] : dir, strerror(errno));
+        last_exit_status = 1;
+        return 1;
+    }
+    if (show) printf("%s\n", cwd.path);
+    return 1;
+}
+
+
+// pwd [-L|-P]: the logical path the shell keeps, or with -P the one the
+// kernel resolves with symbolic links taken out.
+int pwd(char **args) {
+    if (args[1] && strcmp(args[1], "-P") == 0) {
+        char *path = getcwd(NULL, 0);
+        if (path == NULL) {
+            perror("mysh: pwd");
+            last_exit_status = 1;
+            return 1;
+        }
+        printf("%s\n", path);
+        free(path);
+        return 1;
+    }
+    if (cwd.path == NULL) cwd_init();
+    printf("%s\n", cwd.path);
+    return 1;
+}
+
+int mysh_which(char **args) {
+    if (args[1] == NULL || args[2] != NULL) {
+        fprintf(stderr, "mysh: expected one argument to \"which\"\n");
+        last_exit_status = 1;
+        return 1;
+    }
+
+    // Builtins win over PATH, as they do when the command runs
+    const char *path;
+    if (find_builtin(args[1]) >= 0) {
+        printf("mysh: %s: shell built-in command\n", args[1]);
+    } else if ((path = path_lookup(args[1])) != NULL) {
+        printf("%s\n", path);
+    } else {
+        fprintf(stderr, "mysh: %s: Command not found\n", args[1]);
+        last_exit_status = 1;
+    }
+    return 1;
+}
+
+// exit [n]: ends the shell, or the subshell or in-process script running
+// it, with status n, or with the status of the last command.
+int mysh_exit(char **args) {
+    int status = status_before_builtin;
+    if (args[1] != NULL) {
+        char *end;
+        long n = strtol(args[1], &end, 10);
+        if (*end != '\0' || end == args[1]) {
+            fprintf(stderr, "mysh: exit: %s: numeric argument required\n", args[1]);
+            n = 2;
+        } else if (args[2] != NULL) {
+            fprintf(stderr, "mysh: exit: too many arguments\n");
+            last_exit_status = 1;
+            return 1;
+        }
+        status = n & 0xff;
+    }
+    shell_exit(status);
+    return 1;
+}
+
+// Ends the shell with status, or only the subshell or in-process script
+// it is running, which then unwinds once the current command returns.
+void shell_exit(int status) {
+    last_exit_status = status;
+    if (unwind_depth > 0) {
+        jump_kind = JUMP_EXIT; // Ends the script or subshell, not the shell
+        return;
+    }
+    if (in_pipeline_stage) {
+        fflush(stdout);
+        _exit(status); // Not exit(): see exec_stage()
+    }
+    exit(status);
+}
+
+// exec [command [args...]]: replaces the shell with command. Without one,
+// its redirections apply to the shell itself from then on, or until the
+// subshell or in-process script running it ends. There the command cannot
+// take over the process: it runs as a child and ends the subshell or
+// script, which is what replacing a child process would have come to.
+int mysh_exec(char **args) {
+    if (needs_redirection(args)) {
+        if (exec_fds && exec_fds->fd[0] == -1) fds_save(exec_fds);
+        if (setup_redirection(args) != 0) {
+            last_exit_status = 1;
+            return 1;
+        }
+    }
+    if (args[1] == NULL) return 1;
+    if (unwind_depth > 0) {
+        single_command_execution(args + 1);
+        jump_kind = JUMP_EXIT;
+        return 1;
+    }
+    fflush(stdout);
+    exec_command(args + 1);
+    int err = errno;
+    fprintf(stderr, "mysh: exec: %s: %s\n", args[1], strerror(err));
+    last_exit_status = err == ENOENT ? 127 : 126;
+    return 1;
+}
+
+// True when in and out are the same regular file, which cat would keep
+// appending to for as long as there is disk.
+int same_file(int in, int out) {
+    struct stat a, b;
+    return fstat(in, &a) == 0 && fstat(out, &b) == 0 && S_ISREG(a.st_mode) &&
+           a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+}
+
+int mysh_cat(char **args) {
+    for (int i = 1; args[i] != NULL; i++) {
+        if (args[i][0] == '-' && args[i][1] != '\0') return external_fallback(args); // -n, -A, ...
+    }
+    last_exit_status = 0;
+    fflush(stdout); // Anything printf'd so far must land before our raw writes
+
+    if (args[1] == NULL) {
+        if (same_file(STDIN_FILENO, STDOUT_FILENO)) {
+            fprintf(stderr, "mysh: cat: -: input file is output file\n");
+            last_exit_status = 1;
+        } else if (copy_fd(STDIN_FILENO, STDOUT_FILENO) < 0) {
+            perror("mysh: cat");
+            last_exit_status = 1;
+        }
+        return 1;
+    }
+
+    for (int i = 1; args[i] != NULL; i++) {
+        int fd = STDIN_FILENO;
+        if (strcmp(args[i], "-") != 0) {
+            fd = open(args[i], O_RDONLY);
+            if (fd < 0) {
+                fprintf(stderr, "mysh: cat: %s: %s\n", args[i], strerror(errno));
+                last_exit_status = 1;
+                continue;
+            }
+        }
+        if (same_file(fd, STDOUT_FILENO)) {
+            fprintf(stderr, "mysh: cat: %s: input file is output file\n", args[i]);
+            last_exit_status = 1;
+        } else if (copy_fd(fd, STDOUT_FILENO) < 0) {
+            fprintf(stderr, "mysh: cat: %s: %s\n", args[i], strerror(errno));
+            last_exit_status = 1;
+        }
+        if (fd != STDIN_FILENO) {
+            close(fd);
+        }
+    }
+    return 1;
+}
+
+#define COPY_CHUNK (1 << 30)
+#define SPLICE_CHUNK (1 << 20)
+#define RW_CHUNK (128 * 1024)
+
+// True when a zero-copy syscall refused this pair of descriptors and the
+// caller should fall through to the next, more general method.
+static int copy_unsupported(int err) {
+    return err == EINVAL || err == EXDEV || err == ENOSYS || err == EOPNOTSUPP || err == EBADF;
+}
+
+// Copies in to out until EOF. Each method works from the current file
+// offsets, so when one gives up part way the next one picks up where it
+// stopped. Returns 0 on success, -1 with errno set on a real I/O error.
+int copy_fd(int in, int out) {
+    struct stat in_st, out_st;
+    ssize_t n;
+
+    if (fstat(in, &in_st) == 0 && fstat(out, &out_st) == 0) {
+        // File to file: let the filesystem share or copy extents itself.
+        if (S_ISREG(in_st.st_mode) && S_ISREG(out_st.st_mode)) {
+            while ((n = copy_file_range(in, NULL, out, NULL, COPY_CHUNK, 0)) > 0)
+                ;
+            if (n == 0) return 0;
+            if (!copy_unsupported(errno)) return -1;
+        }
+
+        // File to socket or pipe: page cache straight into the destination.
+        if (S_ISREG(in_st.st_mode) && (S_ISSOCK(out_st.st_mode) || S_ISFIFO(out_st.st_mode))) {
+            while ((n = sendfile(out, in, NULL, COPY_CHUNK)) > 0)
+                ;
+            if (n == 0) return 0;
+            if (!copy_unsupported(errno)) return -1;
+        }
+
+        // Pipe to pipe: move buffer references without touching the data.
+        if (S_ISFIFO(in_st.st_mode) && S_ISFIFO(out_st.st_mode)) {
+            while ((n = splice(in, NULL, out, NULL, SPLICE_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE)) > 0)
+                ;
+            if (n == 0) return 0;
+            if (!copy_unsupported(errno)) return -1;
+        }
+    }
+
+    // Plain read/write loop for terminals and anything else.
+    char *buf = malloc(RW_CHUNK);
+    if (!buf) {
+        fprintf(stderr, "mysh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    while ((n = read(in, buf, RW_CHUNK)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            free(buf);
+            return -1;
+        }
+        for (ssize_t off = 0; off < n; ) {
+            ssize_t w = write(out, buf + off, n - off);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                free(buf);
+                return -1;
+            }
+            off += w;
+        }
+    }
+    free(buf);
+    return 0;
+}
+
+// Text filters. These cover the option subsets our pipelines actually use;
+// anything else is handed to the real program via external_fallback().
+
+// Runs the external program of the same name. In a pipeline child we can
+// just exec it; in the shell process it needs a child of its own.
+int external_fallback(char **args) {
+    if (in_pipeline_stage) {
+        fflush(stdout);
+        exec_command(args);
+        perror("mysh");
+        _exit(EXIT_FAILURE);
+    }
+    return single_command_execution(args);
+}
+
+struct outbuf {
+    int fd;
+    size_t len;
+    char buf[64 * 1024];
+};
+
+int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, data, len);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += w;
+        len -= w;
+    }
+    return 0;
+}
+
+void out_flush(struct outbuf *out) {
+    write_all(out->fd, out->buf, out->len);
+    out->len = 0;
+}
+
+void out_write(struct outbuf *out, const char *data, size_t len) {
+    if (out->len + len > sizeof(out->buf)) {
+        out_flush(out);
+        if (len > sizeof(out->buf)) {
+            write_all(out->fd, data, len); // Large runs skip the copy
+            return;
+        }
+    }
+    memcpy(out->buf + out->len, data, len);
+    out->len += len;
+}
+
+// Counts the bytes equal to c, 16 at a time with GCC vector types, which
+// become SSE2 on x86-64 and NEON on arm64 without any target flags. Each
+// compare gives 0xff (-1) in the lanes that match; subtracting it adds one
+// per lane. Lane counts are folded into the total every 255 vectors, before a
+// byte could wrap.
+typedef unsigned char bytes16 __attribute__((vector_size(16)));
+
+size_t count_byte(const char *buf, size_t len, unsigned char c) {
+    const bytes16 want = (bytes16){0} + c;
+    size_t total = 0, i = 0;
+
+    while (len - i >= 16) {
+        bytes16 acc = {0};
+        for (int k = 0; k < 255 && len - i >= 16; k++, i += 16) {
+            bytes16 x;
+            memcpy(&x, buf + i, 16);
+            acc -= (bytes16)(x == want);
+        }
+        uint64_t half[2];
+        memcpy(half, &acc, 16);
+        for (int h = 0; h < 2; h++) {
+            uint64_t a = (half[h] & 0x00ff00ff00ff00ffULL) + ((half[h] >> 8) & 0x00ff00ff00ff00ffULL);
+            total += (a * 0x0001000100010001ULL) >> 48;
+        }
+    }
+    for (; i < len; i++) {
+        total += (unsigned char)buf[i] == c;
+    }
+    return total;
+}
+
+size_t count_newlines(const char *buf, size_t len) {
+    return count_byte(buf, len, '\n');
+}
+
+// Callback for scan_lines(). Returns nonzero to stop reading early.
+typedef int (*block_fn)(const char *buf, size_t len, void *ctx);
+
+// Hands fd to fn in blocks that end on a line boundary, except possibly the
+// last one. Regular files are mapped in one piece from the current offset;
+// anything else is read in large blocks, carrying a partial line forward.
+// Returns -1 on a read error, otherwise 0.
+int scan_lines(int fd, block_fn fn, void *ctx) {
+    struct stat st;
+    off_t pos;
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+        (pos = lseek(fd, 0, SEEK_CUR)) >= 0) {
+        if (pos >= st.st_size) return 0;
+        char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            fn(map + pos, st.st_size - pos, ctx);
+            munmap(map, st.st_size);
+            return 0;
+        }
+    }
+
+    size_t cap = RW_CHUNK, have = 0;
+    char *buf = malloc(cap);
+    if (!buf) {
+        fprintf(stderr, "mysh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    for (;;) {
+        if (have == cap) {
+            cap *= 2; // A single line longer than the buffer
+            buf = realloc(buf, cap);
+            if (!buf) {
+                fprintf(stderr, "mysh: allocation error\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        ssize_t n = read(fd, buf + have, cap - have);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            free(buf);
+            return -1;
+        }
+        if (n == 0) {
+            if (have > 0) fn(buf, have, ctx);
+            break;
+        }
+        have += n;
+
+        char *last = memrchr(buf, '\n', have);
+        if (last == NULL) continue;
+        size_t whole = last - buf + 1;
+        if (fn(buf, whole, ctx)) break;
+        memmove(buf, buf + whole, have - whole);
+        have -= whole;
+    }
+    free(buf);
+    return 0;
+}
+
+// Opens a filter's input operand; "-" is standard input.
+int open_input(char *name) {
+    if (strcmp(name, "-") == 0) return STDIN_FILENO;
+    int fd = open(name, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "mysh: %s: %s\n", name, strerror(errno));
+        last_exit_status = 1;
+    }
+    return fd;
+}
+
+void close_input(int fd) {
+    if (fd != STDIN_FILENO) close(fd);
+}
+
+struct wc_counts {
+    size_t lines, words, bytes;
+    int in_word;
+    int want_words;
+};
+
+int wc_block(const char *buf, size_t len, void *ctx) {
+    struct wc_counts *c = ctx;
+    c->lines += count_newlines(buf, len);
+    c->bytes += len;
+    if (c->want_words) {
+        int in_word = c->in_word;
+        for (size_t i = 0; i < len; i++) {
+            int space = isspace((unsigned char)buf[i]);
+            c->words += !space && !in_word;
+            in_word = !space;
+        }
+        c->in_word = in_word;
+    }
+    return 0;
+}
+
+// The column width coreutils wc uses: wide enough for the total size of
+// the regular files, and 7 if any input is something else, such as a
+// pipe. A single count of a single input is not padded at all.
+int wc_width(char **names, int ncounts) {
+    if (ncounts == 1 && names[1] == NULL) return 1;
+    int width = 1, minimum = 1;
+    size_t total = 0;
+    for (int k = 0; names[k] != NULL; k++) {
+        struct stat st;
+        int ok = strcmp(names[k], "-") == 0 ? fstat(STDIN_FILENO, &st) == 0 : stat(names[k], &st) == 0;
+        if (!ok) {
+            if (k == 0) return 1;
+            continue;
+        }
+        if (S_ISREG(st.st_mode)) total += st.st_size;
+        else minimum = 7;
+    }
+    for (; total >= 10; total /= 10) width++;
+    return width < minimum ? minimum : width;
+}
+
+void wc_report(struct outbuf *out, int show_l, int show_w, int show_c, int width,
+               struct wc_counts *c, char *name) {
+    char line[128];
+    int n = 0;
+    if (show_l) n += snprintf(line + n, sizeof(line) - n, "%s%*zu", n ? " " : "", width, c->lines);
+    if (show_w) n += snprintf(line + n, sizeof(line) - n, "%s%*zu", n ? " " : "", width, c->words);
+    if (show_c) n += snprintf(line + n, sizeof(line) - n, "%s%*zu", n ? " " : "", width, c->bytes);
+    out_write(out, line, n);
+    if (name) {
+        out_write(out, " ", 1);
+        out_write(out, name, strlen(name));
+    }
+    out_write(out, "\n", 1);
+}
+
+int mysh_wc(char **args) {
+    int show_l = 0, show_w = 0, show_c = 0;
+    int i = 1;
+
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        for (char *f = args[i] + 1; *f; f++) {
+            if (*f == 'l') show_l = 1;
+            else if (*f == 'w') show_w = 1;
+            else if (*f == 'c') show_c = 1;
+            else return external_fallback(args);
+        }
+    }
+    if (!show_l && !show_w && !show_c) show_l = show_w = show_c = 1;
+
+    static struct outbuf out;
+    struct wc_counts total = {0};
+    out.fd = STDOUT_FILENO;
+    out.len = 0;
+    last_exit_status = 0;
+    fflush(stdout);
+
+    char *stdin_only[] = {"-", NULL};
+    char **names = args[i] ? &args[i] : stdin_only;
+    int width = wc_width(names, show_l + show_w + show_c);
+    for (int k = 0; names[k] != NULL; k++) {
+        int fd = open_input(names[k]);
+        if (fd < 0) continue;
+
+        struct wc_counts c = {0};
+        struct stat st;
+        c.want_words = show_w;
+        if (!show_l && !show_w && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            // Byte count of a regular file needs no reading at all
+            off_t pos = lseek(fd, 0, SEEK_CUR);
+            c.bytes = st.st_size > pos ? st.st_size - pos : 0;
+        } else if (scan_lines(fd, wc_block, &c) < 0) {
+            fprintf(stderr, "mysh: wc: %s: %s\n", names[k], strerror(errno));
+            last_exit_status = 1;
+        }
+        close_input(fd);
+
+        wc_report(&out, show_l, show_w, show_c, width, &c, args[i] ? names[k] : NULL);
+        total.lines += c.lines;
+        total.words += c.words;
+        total.bytes += c.bytes;
+    }
+    if (names[0] && names[1]) wc_report(&out, show_l, show_w, show_c, width, &total, "total"); // Even if one failed
+    out_flush(&out);
+    return 1;
+}
+
+// Parses the line count of head/tail: -n N, -nN or -N. Returns the index of
+// the first operand, or -1 for options we leave to the external program.
+int parse_line_count(char **args, long *count) {
+    int i = 1;
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        char *val;
+        if (strcmp(args[i], "-n") == 0) {
+            val = args[++i];
+            if (val == NULL) return -1;
+        } else if (strncmp(args[i], "-n", 2) == 0) {
+            val = args[i] + 2;
+        } else if (isdigit((unsigned char)args[i][1])) {
+            val = args[i] + 1;
+        } else {
+            return -1;
+        }
+        char *end;
+        *count = strtol(val, &end, 10);
+        if (*end != '\0' || *count < 0 || !isdigit((unsigned char)val[0])) return -1;
+    }
+    return i;
+}
+
+struct head_state {
+    struct outbuf *out;
+    long remaining;
+    size_t consumed;
+};
+
+int head_block(const char *buf, size_t len, void *ctx) {
+    struct head_state *h = ctx;
+    const char *p = buf, *end = buf + len;
+    while (h->remaining > 0 && p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        p = nl ? nl + 1 : end;
+        h->remaining--;
+    }
+    out_write(h->out, buf, p - buf);
+    h->consumed += p - buf;
+    return h->remaining == 0;
+}
+
+int mysh_head(char **args) {
+    long count = 10;
+    int i = parse_line_count(args, &count);
+    if (i < 0) return external_fallback(args);
+
+    static struct outbuf out;
+    out.fd = STDOUT_FILENO;
+    out.len = 0;
+    last_exit_status = 0;
+    fflush(stdout);
+
+    char *stdin_only[] = {"-", NULL};
+    char **names = args[i] ? &args[i] : stdin_only;
+    int many = names[0] != NULL && names[1] != NULL;
+    for (int k = 0; names[k] != NULL; k++) {
+        int fd = open_input(names[k]);
+        if (fd < 0) continue;
+        if (many) {
+            if (k > 0) out_write(&out, "\n", 1);
+            out_write(&out, "==> ", 4);
+            out_write(&out, names[k], strlen(names[k]));
+            out_write(&out, " <==\n", 5);
+        }
+
+        struct head_state h = {&out, count, 0};
+        off_t start = lseek(fd, 0, SEEK_CUR);
+        if (count > 0) scan_lines(fd, head_block, &h);
+        if (start >= 0) {
+            // Leave a seekable input positioned just past what we printed
+            lseek(fd, start + h.consumed, SEEK_SET);
+        } else if (fd == STDIN_FILENO && stage_builtin) {
+            // Hang up on the upstream stage now rather than at exit, so it
+            // gets EPIPE as soon as we have all the lines we want. Only when
+            // nothing else in this stage could still read stdin.
+            close(STDIN_FILENO);
+        }
+        close_input(fd);
+    }
+    out_flush(&out);
+    return 1;
+}
+
+// Writes the last count lines of buf[0..len).
+void tail_lines(struct outbuf *out, const char *buf, size_t len, long count) {
+    size_t end = len;
+    if (count == 0 || len == 0) return;
+    if (buf[end - 1] == '\n') end--; // The final newline ends the last line
+    while (end > 0) {
+        char *nl = memrchr(buf, '\n', end);
+        if (nl == NULL) {
+            end = 0;
+            break;
+        }
+        end = nl - buf;
+        if (--count == 0) {
+            end++;
+            break;
+        }
+    }
+    out_write(out, buf + end, len - end);
+}
+
+// Input that can't be mapped is kept as a queue of blocks. Whole blocks are
+// dropped from the front once the blocks behind them hold enough lines.
+struct tail_block {
+    struct tail_block *next;
+    size_t len, lines;
+    char data[];
+};
+
+struct tail_state {
+    struct tail_block *head, *tail;
+    size_t lines_after_head;
+    long count;
+};
+
+int tail_block_fn(const char *buf, size_t len, void *ctx) {
+    struct tail_state *t = ctx;
+    struct tail_block *b = malloc(sizeof(*b) + len);
+    if (!b) {
+        fprintf(stderr, "mysh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(b->data, buf, len);
+    b->len = len;
+    b->lines = count_newlines(buf, len);
+    b->next = NULL;
+    if (t->tail) {
+        t->tail->next = b;
+        t->lines_after_head += b->lines;
+    } else {
+        t->head = b;
+    }
+    t->tail = b;
+
+    while (t->head != t->tail && t->lines_after_head > (size_t)t->count) {
+        struct tail_block *old = t->head;
+        t->head = old->next;
+        t->lines_after_head -= t->head->lines;
+        free(old);
+    }
+    return 0;
+}
+
+int mysh_tail(char **args) {
+    long count = 10;
+    int i = parse_line_count(args, &count);
+    if (i < 0) return external_fallback(args);
+
+    static struct outbuf out;
+    out.fd = STDOUT_FILENO;
+    out.len = 0;
+    last_exit_status = 0;
+    fflush(stdout);
+
+    char *stdin_only[] = {"-", NULL};
+    char **names = args[i] ? &args[i] : stdin_only;
+    int many = names[0] != NULL && names[1] != NULL;
+    for (int k = 0; names[k] != NULL; k++) {
+        int fd = open_input(names[k]);
+        if (fd < 0) continue;
+        if (many) {
+            if (k > 0) out_write(&out, "\n", 1);
+            out_write(&out, "==> ", 4);
+            out_write(&out, names[k], strlen(names[k]));
+            out_write(&out, " <==\n", 5);
+        }
+
+        struct stat st;
+        off_t pos = lseek(fd, 0, SEEK_CUR);
+        char *map = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && pos >= 0) {
+            map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        if (map != MAP_FAILED) {
+            // Only the pages near the end are ever touched
+            if (pos < st.st_size) tail_lines(&out, map + pos, st.st_size - pos, count);
+            munmap(map, st.st_size);
+        } else {
+            struct tail_state t = {NULL, NULL, 0, count};
+            scan_lines(fd, tail_block_fn, &t);
+            size_t len = 0;
+            for (struct tail_block *b = t.head; b; b = b->next) len += b->len;
+            char *all = malloc(len + 1);
+            if (!all) {
+                fprintf(stderr, "mysh: allocation error\n");
+                exit(EXIT_FAILURE);
+            }
+            len = 0;
+            while (t.head) {
+                struct tail_block *b = t.head;
+                memcpy(all + len, b->data, b->len);
+                len += b->len;
+                t.head = b->next;
+                free(b);
+            }
+            tail_lines(&out, all, len, count);
+            free(all);
+        }
+        close_input(fd);
+    }
+    out_flush(&out);
+    return 1;
+}
+
+struct grep_state {
+    struct outbuf *out;
+    const char *pat;
+    size_t patlen;
+    int invert, count_only, number, quiet;
+    char *label; // File name prefix when searching several files
+    size_t lineno, matches;
+};
+
+void grep_emit(struct grep_state *g, const char *line, size_t len) {
+    g->matches++;
+    if (g->count_only || g->quiet) return;
+    if (g->label) {
+        out_write(g->out, g->label, strlen(g->label));
+        out_write(g->out, ":", 1);
+    }
+    if (g->number) {
+        char num[32];
+        int n = snprintf(num, sizeof(num), "%zu:", g->lineno);
+        out_write(g->out, num, n);
+    }
+    out_write(g->out, line, len);
+    if (len == 0 || line[len - 1] != '\n') out_write(g->out, "\n", 1);
+}
+
+int grep_block(const char *buf, size_t len, void *ctx) {
+    struct grep_state *g = ctx;
+    const char *p = buf, *end = buf + len;
+
+    if (g->invert) {
+        while (p < end) {
+            const char *nl = memchr(p, '\n', end - p);
+            const char *next = nl ? nl + 1 : end;
+            g->lineno++;
+            if (memmem(p, next - p, g->pat, g->patlen) == NULL) grep_emit(g, p, next - p);
+            p = next;
+        }
+        return 0;
+    }
+
+    // Search the whole block for the needle, then widen each hit to its line.
+    // Lines without a match are skipped at memmem speed.
+    while (p < end) {
+        const char *hit = memmem(p, end - p, g->pat, g->patlen);
+        if (hit == NULL) break;
+        const char *bol = memrchr(p, '\n', hit - p);
+        bol = bol ? bol + 1 : p;
+        const char *nl = memchr(hit, '\n', end - hit);
+        const char *next = nl ? nl + 1 : end;
+        if (g->number) g->lineno += count_newlines(p, bol - p) + 1;
+        grep_emit(g, bol, next - bol);
+        if (g->quiet) return 1;
+        p = next;
+    }
+    if (g->number) g->lineno += count_newlines(p, end - p);
+    return 0;
+}
+
+int mysh_grep(char **args) {
+    int fixed = 0, invert = 0, count_only = 0, number = 0, quiet = 0;
+    int i = 1;
+
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        for (char *f = args[i] + 1; *f; f++) {
+            if (*f == 'F') fixed = 1;
+            else if (*f == 'v') invert = 1;
+            else if (*f == 'c') count_only = 1;
+            else if (*f == 'n') number = 1;
+            else if (*f == 'q') quiet = 1;
+            else return external_fallback(args);
+        }
+    }
+    char *pat = args[i];
+    if (pat == NULL) return external_fallback(args);
+    // Without -F only a pattern free of regex syntax means the same thing
+    if (!fixed && strpbrk(pat, ".[]*^$\\") != NULL) return external_fallback(args);
+    if (pat[0] == '\0') return external_fallback(args);
+    i++;
+
+    static struct outbuf out;
+    out.fd = STDOUT_FILENO;
+    out.len = 0;
+    fflush(stdout);
+
+    size_t total = 0;
+    int failed = 0;
+    char *stdin_only[] = {"-", NULL};
+    char **names = args[i] ? &args[i] : stdin_only;
+    int many = names[0] != NULL && names[1] != NULL;
+    for (int k = 0; names[k] != NULL; k++) {
+        int fd = open_input(names[k]);
+        if (fd < 0) {
+            failed = 1;
+            continue;
+        }
+        struct grep_state g = {&out, pat, strlen(pat), invert, count_only, number, quiet,
+                               many ? names[k] : NULL, 0, 0};
+        scan_lines(fd, grep_block, &g);
+        close_input(fd);
+        if (count_only && !quiet) {
+            char num[32];
+            int n = snprintf(num, sizeof(num), "%zu\n", g.matches);
+            if (g.label) {
+                out_write(&out, g.label, strlen(g.label));
+                out_write(&out, ":", 1);
+            }
+            out_write(&out, num, n);
+        }
+        total += g.matches;
+        if (quiet && total > 0) break;
+    }
+    out_flush(&out);
+    last_exit_status = failed ? 2 : (total > 0 ? 0 : 1);
+    return 1;
+}
+
+// Line reading for the read builtin. A shell's read must not consume bytes
+// past the end of its line, since the next command may read the same input.
+// On seekable input we read ahead in blocks and lseek() back over what we
+// didn't use. Pipes can't be rewound: they are read a byte at a time,
+// unless a while or until loop owns the pipe. Then the loop holds a
+// buffered reader for it, and over-read bytes stay in its buffer for the
+// next read in the loop; they go with it when the loop ends.
+struct line_reader {
+    dev_t dev;
+    ino_t ino;
+    char *buf;
+    size_t start, end, cap;
+    int owned; // Set while a loop owns the pipe
+};
+
+struct line_reader stdin_reader;
+size_t read_block_hint = 128; // Grows towards the typical line length
+
+struct record {
+    char *data;
+    size_t len, cap;
+};
+
+void record_append(struct record *rec, const char *data, size_t len) {
+    if (rec->len + len + 1 > rec->cap) {
+        while (rec->len + len + 1 > rec->cap) rec->cap = rec->cap ? rec->cap * 2 : 256;
+        rec->data = realloc(rec->data, rec->cap);
+        if (!rec->data) {
+            fprintf(stderr, "mysh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(rec->data + rec->len, data, len);
+    rec->len += len;
+    rec->data[rec->len] = '\0';
+}
+
+// Reads up to and including delim from a seekable fd. Returns 1 if the
+// delimiter was found, 0 at EOF, -1 on error.
+int read_record_seekable(int fd, int delim, struct record *rec) {
+    static char tmp[RW_CHUNK];
+    size_t block = read_block_hint;
+    size_t start_len = rec->len;
+    int found = 0;
+    for (;;) {
+        ssize_t n = read(fd, tmp, block);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) break;
+        char *hit = memchr(tmp, delim, n);
+        if (hit) {
+            size_t used = hit - tmp + 1;
+            record_append(rec, tmp, used - 1);
+            if ((size_t)n > used) lseek(fd, -(off_t)(n - used), SEEK_CUR);
+            found = 1;
+            break;
+        }
+        record_append(rec, tmp, n);
+        if (block < RW_CHUNK) block *= 2;
+    }
+
+    // Aim the next first read just past this line length, so a typical
+    // line costs one read and one lseek.
+    size_t line = rec->len - start_len + 1;
+    read_block_hint = 128;
+    while (read_block_hint < line * 2 && read_block_hint < RW_CHUNK) read_block_hint *= 2;
+    return found;
+}
+
+// Reads up to and including delim from a pipe nobody owns, one byte at a
+// time so that nothing past it is taken from the next command.
+int read_record_bytewise(int fd, int delim, struct record *rec) {
+    char tmp[256];
+    size_t n = 0;
+    int found = 0;
+    for (;;) {
+        ssize_t got = read(fd, tmp + n, 1);
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            found = -1;
+            break;
+        }
+        if (got == 0) break;
+        if (tmp[n] == delim) {
+            found = 1;
+            break;
+        }
+        if (++n == sizeof(tmp)) {
+            record_append(rec, tmp, n);
+            n = 0;
+        }
+    }
+    record_append(rec, tmp, n);
+    return found;
+}
+
+// Gives the running loop a reader of its own for the pipe on fd 0, and
+// returns the one it replaces, or NULL if fd 0 is not a pipe.
+struct line_reader *line_reader_own(void) {
+    struct stat st;
+    if (lseek(STDIN_FILENO, 0, SEEK_CUR) >= 0 || fstat(STDIN_FILENO, &st) != 0) return NULL;
+    struct line_reader *outer = malloc(sizeof(*outer));
+    if (!outer) {
+        fprintf(stderr, "mysh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    *outer = stdin_reader;
+    memset(&stdin_reader, 0, sizeof(stdin_reader));
+    stdin_reader.dev = st.st_dev;
+    stdin_reader.ino = st.st_ino;
+    stdin_reader.owned = 1;
+    return outer;
+}
+
+// Ends the loop's hold on its pipe, dropping whatever it read ahead.
+void line_reader_release(struct line_reader *outer) {
+    if (!outer) return;
+    free(stdin_reader.buf);
+    stdin_reader = *outer;
+    free(outer);
+}
+
+// True if fd is the pipe a running loop owns.
+int line_reader_owns(int fd) {
+    struct stat st;
+    return stdin_reader.owned && fd == STDIN_FILENO && fstat(fd, &st) == 0 &&
+           st.st_dev == stdin_reader.dev && st.st_ino == stdin_reader.ino;
+}
+
+// Reads up to and including delim through the owning loop's reader.
+int read_record_buffered(int fd, int delim, struct record *rec) {
+    struct line_reader *r = &stdin_reader;
+
+    if (r->buf == NULL) {
+        r->cap = RW_CHUNK;
+        r->buf = malloc(r->cap);
+        if (!r->buf) {
+            fprintf(stderr, "mysh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (;;) {
+        if (r->start < r->end) {
+            char *p = r->buf + r->start;
+            char *hit = memchr(p, delim, r->end - r->start);
+            if (hit) {
+                record_append(rec, p, hit - p);
+                r->start += hit - p + 1;
+                return 1;
+            }
+            record_append(rec, p, r->end - r->start);
+        }
+        r->start = r->end = 0;
+        ssize_t n = read(fd, r->buf, r->cap);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) return 0;
+        r->end = n;
+    }
+}
+
+// Splits the record into the named variables using IFS. The last name takes
+// the rest of the line. Without -r a backslash quotes the next character.
+void read_assign(char **names, char *line, int raw) {
+    const char *ifs = var_get("IFS");
+    if (ifs == NULL) ifs = " \t\n";
+
+    // Remove backslashes first, remembering which bytes they protected
+    size_t len = strlen(line);
+    char *quoted = calloc(len + 1, 1);
+    if (!quoted) {
+        fprintf(stderr, "mysh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    if (!raw) {
+        size_t j = 0;
+        for (size_t i = 0; i < len; i++) {
+            if (line[i] == '\\' && i + 1 < len) {
+                i++;
+                quoted[j] = 1;
+            }
+            line[j++] = line[i];
+        }
+        line[j] = '\0';
+        len = j;
+    }
+
+    size_t i = 0;
+    for (int v = 0; names[v] != NULL; v++) {
+        while (i < len && !quoted[i] && strchr(ifs, line[i])) i++;
+        size_t start = i, end;
+        if (names[v + 1] == NULL) {
+            end = len;
+            while (end > start && !quoted[end - 1] && strchr(ifs, line[end - 1])) end--;
+        } else {
+            while (i < len && (quoted[i] || !strchr(ifs, line[i]))) i++;
+            end = i;
+        }
+        char saved = line[end];
+        line[end] = '\0';
+        var_set(names[v], line + start);
+        line[end] = saved;
+    }
+    free(quoted);
+}
+
+int mysh_read(char **args) {
+    int raw = 0, delim = '\n';
+    int i = 1;
+
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        if (strcmp(args[i], "-r") == 0) {
+            raw = 1;
+        } else if (strcmp(args[i], "-d") == 0 && args[i + 1] != NULL) {
+            delim = (unsigned char)args[++i][0];
+        } else {
+            fprintf(stderr, "mysh: read: unknown option %s\n", args[i]);
+            last_exit_status = 2;
+            return 1;
+        }
+    }
+    char *reply[] = {"REPLY", NULL};
+    char **names = args[i] ? &args[i] : reply;
+
+    int seekable = lseek(STDIN_FILENO, 0, SEEK_CUR) >= 0;
+    int owned = !seekable && line_reader_owns(STDIN_FILENO);
+    struct record rec = {NULL, 0, 0};
+    int found;
+    for (;;) {
+        if (seekable) found = read_record_seekable(STDIN_FILENO, delim, &rec);
+        else if (owned) found = read_record_buffered(STDIN_FILENO, delim, &rec);
+        else found = read_record_bytewise(STDIN_FILENO, delim, &rec);
+        // Without -r a trailing backslash continues the line
+        if (found == 1 && !raw && delim == '\n' && rec.len > 0 && rec.data[rec.len - 1] == '\\') {
+            rec.data[--rec.len] = '\0';
+            continue;
+        }
+        break;
+    }
+    if (found < 0) {
+        perror("mysh: read");
+    }
+
+    record_append(&rec, "", 0);
+    read_assign(names, rec.data, raw);
+    free(rec.data);
+    last_exit_status = found == 1 ? 0 : 1;
+    return 1;
+}
+
+// Arrays. Indexed arrays keep their elements in a dense vector (unset
+// elements are NULL slices) and switch to a hash table keyed by index once
+// assignments leave the vector mostly empty. Associative arrays use the
+// same open-addressing table keyed by string, with backward-shift deletion
+// like the variable store. Elements are slices: values loaded by mapfile
+// point into one backing buffer holding what it read, so loading costs no
+// allocation or copy per line; values assigned later are owned,
+// NUL-terminated copies. The buffer is the shell's own rather than a
+// mapping of the file, which may be truncated or rewritten while the array
+// still holds its lines.
+#define ARRAY_ASSOC 0x1
+#define ARRAY_SPARSE 0x2
+
+struct slice {
+    const char *ptr;
+    size_t len;
+};
+
+struct array_entry {
+    uint64_t hash;
+    int64_t index;     // Sparse indexed arrays
+    char *key;         // Associative arrays
+    struct slice value;
+    int used;
+};
+
+struct shell_array {
+    int flags;
+    struct slice *items; // Dense: items[0..count), ptr NULL if unset
+    size_t count, cap;
+    size_t nset;         // Number of elements that are set
+    struct array_entry *slots; // Sparse and associative
+    size_t slot_cap, slot_count; // slot_cap is a power of two
+    char *backing;
+    size_t backing_len;
+};
+
+// True if s points at a value the array owns rather than into its backing.
+int slice_owned(struct shell_array *a, const char *s) {
+    return s != NULL && !(a->backing && s >= a->backing && s < a->backing + a->backing_len);
+}
+
+void slice_free(struct shell_array *a, struct slice *s) {
+    if (slice_owned(a, s->ptr)) free((char *)s->ptr);
+    s->ptr = NULL;
+    s->len = 0;
+}
+
+struct slice slice_dup_n(const char *value, size_t len) {
+    char *copy = malloc(len + 1);
+    if (!copy) {
+        fprintf(stderr, "mysh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(copy, value, len);
+    copy[len] = '\0';
+    return (struct slice){copy, len};
+}
+
+struct slice slice_dup(const char *value) {
+    struct slice s = {strdup(value), strlen(value)};
+    if (!s.ptr) {
+        fprintf(stderr, "mysh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    return s;
+}
+
+void array_release(struct shell_array *a) {
+    for (size_t i = 0; i < a->count; i++) slice_free(a, &a->items[i]);
+    for (size_t i = 0; i < a->slot_cap; i++) {
+        if (!a->slots[i].used) continue;
+        slice_free(a, &a->slots[i].value);
+        free(a->slots[i].key);
+    }
+    free(a->backing);
+    free(a->items);
+    free(a->slots);
+    int assoc = a->flags & ARRAY_ASSOC;
+    memset(a, 0, sizeof(*a));
+    a->flags = assoc;
+}
+
+void array_free(struct shell_array *a) {
+    if (a == NULL) return;
+    array_release(a);
+    free(a);
+}
+
+// Returns a copy of a that owns all of its values.
+struct shell_array *array_copy(struct shell_array *a) {
+    struct shell_array *c = malloc(sizeof(*c));
+    if (c) *c = *a;
+    if (c) c->items = a->cap ? malloc(a->cap * sizeof(struct slice)) : NULL;
+    if (c) c->slots = a->slot_cap ? calloc(a->slot_cap, sizeof(struct array_entry)) : NULL;
+    if (!c || (a->cap && !c->items) || (a->slot_cap && !c->slots)) {
+        fprintf(stderr, "mysh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    c->backing = NULL;
+    c->backing_len = 0;
+    for (size_t i = 0; i < a->count; i++) {
+        struct slice *s = &a->items[i];
+        c->items[i] = s->ptr ? slice_dup_n(s->ptr, s->len) : *s;
+    }
+    for (size_t i = 0; i < a->slot_cap; i++) {
+        struct array_entry *e = &a->slots[i];
+        if (!e->used) continue;
+        c->slots[i] = *e;
+        c->slots[i].value = slice_dup_n(e->value.ptr, e->value.len);
+        if (e->key) c->slots[i].key = strdup(e->key);
+        if (e->key && !c->slots[i].key) {
+            fprintf(stderr, "mysh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return c;
+}
+
+// Returns the named variable's array, or NULL if it is not an array.
+struct shell_array *array_lookup(const char *name) {
+    struct var *v = var_find(name);
+    return v ? v->array : NULL;
+}
+
+// Turns the named variable into an array if it is not one already. A scalar
+// value becomes element 0, as in other shells.
+struct shell_array *array_declare(const char *name, int assoc) {
+    struct var *v = var_intern(name);
+    var_touch(v, 1);
+    if (v->array) return v->array;
+    v->array = calloc(1, sizeof(struct shell_array));
+    if (!v->array) {
+        fprintf(stderr, "mysh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    v->array->flags = assoc ? ARRAY_ASSOC : 0;
+    envp_drop(v); // Arrays are not exported
+    if (v->value) {
+        char *old = v->value;
+        v->value = NULL;
+        array_store(v->array, "0", old);
+        free(old);
+    }
+    return v->array;
+}
+
+// Returns the named array emptied, creating it if needed.
+struct shell_array *array_reset(const char *name, int assoc) {
+    struct shell_array *a = array_declare(name, assoc);
+    array_release(a);
+    a->flags = assoc ? ARRAY_ASSOC : 0;
+    return a;
+}
+
+uint64_t index_hash(int64_t i) {
+    uint64_t h = (uint64_t)i * 0x9E3779B97F4A7C15ULL; // Fibonacci hashing
+    return h ^ (h >> 32);
+}
+
+struct array_entry *map_find(struct shell_array *a, const char *key, int64_t index, uint64_t hash) {
+    if (a->slot_cap == 0) return NULL;
+    size_t mask = a->slot_cap - 1;
+    for (size_t i = hash & mask; a->slots[i].used; i = (i + 1) & mask) {
+        struct array_entry *e = &a->slots[i];
+        if (e->hash != hash) continue;
+        if (key ? strcmp(e->key, key) == 0 : e->index == index) return e;
+    }
+    return NULL;
+}
+
+void map_grow(struct shell_array *a) {
+    size_t cap = a->slot_cap ? a->slot_cap * 2 : 16;
+    struct array_entry *slots = calloc(cap, sizeof(*slots));
+    if (!slots) {
+        fprintf(stderr, "mysh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < a->slot_cap; i++) {
+        if (!a->slots[i].used) continue;
+        size_t j = a->slots[i].hash & (cap - 1);
+        while (slots[j].used) j = (j + 1) & (cap - 1);
+        slots[j] = a->slots[i];
+    }
+    free(a->slots);
+    a->slots = slots;
+    a->slot_cap = cap;
+}
+
+// Returns the entry for key (or index), adding an unset one if needed.
+struct array_entry *map_intern(struct shell_array *a, const char *key, int64_t index, uint64_t hash) {
+    struct array_entry *e = map_find(a, key, index, hash);
+    if (e) return e;
+    if ((a->slot_count + 1) * 4 > a->slot_cap * 3) map_grow(a);
+    size_t mask = a->slot_cap - 1;
+    size_t i = hash & mask;
+    while (a->slots[i].used) i = (i + 1) & mask;
+    e = &a->slots[i];
+    e->used = 1;
+    e->hash = hash;
+    e->index = index;
+    e->key = NULL;
+    if (key && !(e->key = strdup(key))) {
+        fprintf(stderr, "mysh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    e->value.ptr = NULL;
+    e->value.len = 0;
+    a->slot_count++;
+    return e;
+}
+
+void map_delete(struct shell_array *a, struct array_entry *e) {
+    slice_free(a, &e->value);
+    free(e->key);
+    size_t mask = a->slot_cap - 1;
+    size_t hole = e - a->slots;
+    for (size_t j = (hole + 1) & mask; a->slots[j].used; j = (j + 1) & mask) {
+        size_t home = a->slots[j].hash & mask;
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            a->slots[hole] = a->slots[j];
+            hole = j;
+        }
+    }
+    memset(&a->slots[hole], 0, sizeof(a->slots[hole]));
+    a->slot_count--;
+}
+
+// Moves a dense array's elements into the index-keyed table.
+void array_make_sparse(struct shell_array *a) {
+    for (size_t i = 0; i < a->count; i++) {
+        if (a->items[i].ptr == NULL) continue;
+        map_intern(a, NULL, i, index_hash(i))->value = a->items[i];
+    }
+    free(a->items);
+    a->items = NULL;
+    a->count = a->cap = 0;
+    a->flags |= ARRAY_SPARSE;
+}
+
+// Highest set index plus one.
+int64_t array_end(struct shell_array *a) {
+    if (!(a->flags & ARRAY_SPARSE)) return a->count;
+    int64_t end = 0;
+    for (size_t i = 0; i < a->slot_cap; i++) {
+        if (a->slots[i].used && a->slots[i].index >= end) end = a->slots[i].index + 1;
+    }
+    return end;
+}
+
+// Returns the slot for element index of an indexed array, creating it if
+// needed. The slot's value is left as it was (NULL if unset).
+struct slice *array_index_slot(struct shell_array *a, int64_t index) {
+    // Far past the end would leave the vector mostly holes: go sparse
+    if (!(a->flags & ARRAY_SPARSE) && (size_t)index >= a->count &&
+        (size_t)index > 2 * a->nset + 1024) {
+        array_make_sparse(a);
+    }
+    if (a->flags & ARRAY_SPARSE) return &map_intern(a, NULL, index, index_hash(index))->value;
+
+    if ((size_t)index >= a->cap) {
+        size_t cap = a->cap ? a->cap : 16;
+        while (cap <= (size_t)index) cap *= 2;
+        a->items = realloc(a->items, cap * sizeof(*a->items));
+        if (!a->items) {
+            fprintf(stderr, "mysh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        a->cap = cap;
+    }
+    while (a->count <= (size_t)index) {
+        a->items[a->count].ptr = NULL;
+        a->items[a->count++].len = 0;
+    }
+    return &a->items[index];
+}
+
+// Evaluates an indexed-array subscript. Negative values count back from the
+// end. Returns 0 on success.
+//
+// Here and in array_store(), array_fetch() and array_remove(), sub has
+// already been expanded, once, by the caller: a key that came out of a
+// variable is never expanded again.
+int array_index(struct shell_array *a, char *sub, int64_t *index) {
+    int ok;
+    *index = arith_value(sub, &ok);
+    if (!ok) return -1;
+    if (*index < 0) *index += array_end(a);
+    if (*index < 0) {
+        fprintf(stderr, "mysh: %s: bad array subscript\n", sub);
+        return -1;
+    }
+    return 0;
+}
+
+// Sets a[sub] = value. Returns 0 on success.
+int array_store(struct shell_array *a, char *sub, const char *value) {
+    struct slice *s;
+    if (a->flags & ARRAY_ASSOC) {
+        s = &map_intern(a, sub, 0, hash_bytes(sub, strlen(sub)))->value;
+    } else {
+        int64_t index;
+        if (array_index(a, sub, &index) != 0) return -1;
+        s = array_index_slot(a, index);
+    }
+    if (s->ptr == NULL) a->nset++;
+    else slice_free(a, s);
+    *s = slice_dup(value);
+    return 0;
+}
+
+// Appends value after the highest set index.
+void array_append(struct shell_array *a, const char *value) {
+    struct slice *s = array_index_slot(a, array_end(a));
+    *s = slice_dup(value);
+    a->nset++;
+}
+
+// Returns a[sub], or NULL if it is unset.
+struct slice *array_fetch(struct shell_array *a, char *sub) {
+    if (a->flags & ARRAY_ASSOC) {
+        struct array_entry *e = map_find(a, sub, 0, hash_bytes(sub, strlen(sub)));
+        return e ? &e->value : NULL;
+    }
+    int64_t index;
+    if (array_index(a, sub, &index) != 0) return NULL;
+    if (a->flags & ARRAY_SPARSE) {
+        struct array_entry *e = map_find(a, NULL, index, index_hash(index));
+        return e ? &e->value : NULL;
+    }
+    if ((size_t)index >= a->count || a->items[index].ptr == NULL) return NULL;
+    return &a->items[index];
+}
+
+void array_remove(struct shell_array *a, char *sub) {
+    if (a->flags & ARRAY_ASSOC) {
+        struct array_entry *e = map_find(a, sub, 0, hash_bytes(sub, strlen(sub)));
+        if (e) {
+            map_delete(a, e);
+            a->nset--;
+        }
+        return;
+    }
+    int64_t index;
+    if (array_index(a, sub, &index) != 0) return;
+    if (a->flags & ARRAY_SPARSE) {
+        struct array_entry *e = map_find(a, NULL, index, index_hash(index));
+        if (e) {
+            map_delete(a, e);
+            a->nset--;
+        }
+        return;
+    }
+    if ((size_t)index < a->count && a->items[index].ptr) {
+        slice_free(a, &a->items[index]);
+        a->nset--;
+        while (a->count > 0 && a->items[a->count - 1].ptr == NULL) a->count--;
+    }
+}
+
+int compare_entries(const void *x, const void *y) {
+    int64_t i = (*(struct array_entry *const *)x)->index, j = (*(struct array_entry *const *)y)->index;
+    return (i > j) - (i < j);
+}
+
+// Pushes every element of a (or, with keys set, every subscript) onto out,
+// in index order for indexed arrays. Each one becomes its own word, copied
+// into the line arena so later assignments cannot pull it out from under
+// the command.
+void array_push_all(struct shell_array *a, struct argv_builder *out, int keys) {
+    char num[32];
+    if (!(a->flags & (ARRAY_ASSOC | ARRAY_SPARSE))) {
+        for (size_t i = 0; i < a->count; i++) {
+            if (a->items[i].ptr == NULL) continue;
+            if (keys) argv_push(out, arena_strndup(&line_arena, num, snprintf(num, sizeof(num), "%zu", i)));
+            else argv_push(out, arena_strndup(&line_arena, a->items[i].ptr, a->items[i].len));
+        }
+        return;
+    }
+
+    struct array_entry **order = malloc((a->slot_count + 1) * sizeof(*order));
+    if (!order) {
+        fprintf(stderr, "mysh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < a->slot_cap; i++) {
+        if (a->slots[i].used) order[n++] = &a->slots[i];
+    }
+    if (a->flags & ARRAY_SPARSE) qsort(order, n, sizeof(*order), compare_entries);
+    for (size_t i = 0; i < n; i++) {
+        struct array_entry *e = order[i];
+        if (!keys) argv_push(out, arena_strndup(&line_arena, e->value.ptr, e->value.len));
+        else if (e->key) argv_push(out, arena_strndup(&line_arena, e->key, strlen(e->key)));
+        else argv_push(out, arena_strndup(&line_arena, num, snprintf(num, sizeof(num), "%lld", (long long)e->index)));
+    }
+    free(order);
+}
+
+// Hands bytes read past the last consumed record back to the reader of the
+// loop owning the pipe, so a following read builtin still sees them.
+void line_reader_unread(int fd, const char *data, size_t len) {
+    struct line_reader *r = &stdin_reader;
+    if (len == 0 || !line_reader_owns(fd)) return;
+    if (r->cap < len) {
+        free(r->buf);
+        r->cap = len > RW_CHUNK ? len : RW_CHUNK;
+        r->buf = malloc(r->cap);
+        if (!r->buf) {
+            fprintf(stderr, "mysh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(r->buf, data, len);
+    r->start = 0;
+    r->end = len;
+}
+
+// Moves bytes still pending in the owning loop's reader into *buf, growing
+// it as needed. Returns how many bytes were moved.
+size_t line_reader_drain(int fd, char **buf, size_t *cap) {
+    struct line_reader *r = &stdin_reader;
+    if (r->start >= r->end || !line_reader_owns(fd)) return 0;
+    size_t len = r->end - r->start;
+    while (*cap < len * 2) *cap *= 2; // Room for the pending bytes plus a read
+    *buf = realloc(*buf, *cap);
+    if (!*buf) {
+        fprintf(stderr, "mysh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(*buf, r->buf + r->start, len);
+    r->start = r->end = 0;
+    return len;
+}
+
+// Splits buf into up to max records (0 = no limit) after skipping skip of
+// them. Returns the number of bytes consumed, which is all of buf unless
+// the limit was reached first.
+size_t mapfile_split(struct shell_array *a, const char *buf, size_t len, int delim,
+                     int strip, long skip, long max) {
+    const char *p = buf, *end = buf + len;
+
+    while (p < end && (max == 0 || (long)a->count < max)) {
+        const char *hit = memchr(p, delim, end - p);
+        const char *next = hit ? hit + 1 : end;
+        if (skip > 0) {
+            skip--;
+        } else {
+            if (a->count == a->cap) {
+                a->cap = a->cap ? a->cap * 2 : 1024;
+                a->items = realloc(a->items, a->cap * sizeof(*a->items));
+                if (!a->items) {
+                    fprintf(stderr, "mysh: allocation error\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            a->items[a->count].ptr = p;
+            a->items[a->count].len = (next - p) - (strip && hit);
+            a->count++;
+        }
+        p = next;
+    }
+    a->nset = a->count;
+    return p - buf;
+}
+
+int mysh_mapfile(char **args) {
+    int delim = '\n', strip = 0, fd = STDIN_FILENO;
+    long skip = 0, max = 0;
+    int i = 1;
+
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        char *opt = args[i];
+        if (strcmp(opt, "-t") == 0) {
+            strip = 1;
+            continue;
+        }
+        if (args[i + 1] == NULL) {
+            fprintf(stderr, "mysh: %s: option %s requires an argument\n", args[0], opt);
+            last_exit_status = 2;
+            return 1;
+        }
+        char *val = args[++i];
+        if (strcmp(opt, "-d") == 0) delim = (unsigned char)val[0];
+        else if (strcmp(opt, "-n") == 0) max = atol(val);
+        else if (strcmp(opt, "-s") == 0) skip = atol(val);
+        else if (strcmp(opt, "-u") == 0) fd = atoi(val);
+        else {
+            fprintf(stderr, "mysh: %s: unknown option %s\n", args[0], opt);
+            last_exit_status = 2;
+            return 1;
+        }
+    }
+    char *name = args[i] ? args[i] : "MAPFILE";
+    struct shell_array *a = array_reset(name, 0);
+    last_exit_status = 0;
+
+    // Read everything (or until -n is satisfied) into one growing buffer,
+    // then split it in a single pass. A regular file gets a buffer of its
+    // size up front, so it is read in one go.
+    struct stat st;
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    int seekable = pos >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    size_t cap = RW_CHUNK, have = 0, lines = 0;
+    if (seekable && st.st_size > pos && (size_t)(st.st_size - pos) >= cap) cap = st.st_size - pos + 1;
+    char *buf = malloc(cap);
+    if (!buf) {
+        fprintf(stderr, "mysh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    // With a count, a pipe no loop owns is read a byte at a time, so the
+    // lines after the last one taken are left for the next command. A file
+    // is instead rewound to just past them.
+    int owned = !seekable && line_reader_owns(fd), bytewise = max > 0 && !owned && !seekable;
+    if (owned) {
+        have = line_reader_drain(fd, &buf, &cap);
+        lines = count_byte(buf, have, delim);
+    }
+    while (max == 0 || (long)lines < skip + max) {
+        if (have == cap) {
+            cap *= 2;
+            buf = realloc(buf, cap);
+            if (!buf) {
+                fprintf(stderr, "mysh: allocation error\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        ssize_t n = read(fd, buf + have, bytewise ? 1 : cap - have);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("mysh: mapfile");
+            last_exit_status = 1;
+            break;
+        }
+        if (n == 0) break;
+        if (max > 0) lines += count_byte(buf + have, n, delim);
+        have += n;
+    }
+    a->backing = buf;
+    a->backing_len = have;
+    size_t used = mapfile_split(a, buf, have, delim, strip, skip, max);
+    if (seekable) lseek(fd, pos + used, SEEK_SET);
+    else if (owned) line_reader_unread(fd, buf + used, have - used);
+    return 1;
+}
+
+// Batch scripts are parsed from a mapping of the file rather than read line
+// by line, and the resulting tree is saved under $XDG_CACHE_HOME/mysh,
+// named after a hash of the script's contents. On the next run of an
+// unchanged script the saved tree is mapped back in and split_line() never
+// sees the text. Parsing stops at the first syntax error; from there on the
+// script is read line by line as before, so everything ahead of the error
+// still runs and the error is reported when it is reached.
+#define SCRIPT_CACHE_MAGIC "MYSHAST"
+#define SCRIPT_CACHE_MAX_AGE (30 * 24 * 3600) // Entries unused this long are removed
+#define SCRIPT_CACHE_TOUCH (24 * 3600)        // How stale a used entry's mtime may get
+#define SCRIPT_CACHE_VERSION 5 // Bumped whenever the parser would build a different tree
+
+// Set apart the entries written by each build of the shell, so a parser
+// change that forgot to bump the version still never meets the trees of
+// the old one. The Makefile passes a checksum of the source as
+// MYSH_BUILD_ID; without one, only the version tells builds apart.
+#ifndef MYSH_BUILD_ID
+#define MYSH_BUILD_ID ""
+#endif
+#define SCRIPT_CACHE_BUILD MYSH_BUILD_ID
+
+struct script_cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t node_size;   // sizeof(struct node) of the writer
+    uint64_t script_hash;
+    uint64_t script_len;
+    uint64_t resume;      // Offset where line-by-line reading takes over
+    uint32_t nnodes, nwords, nroots;
+    uint32_t build;       // Hash of SCRIPT_CACHE_BUILD of the writer
+    uint64_t text_len;
+    // Then: nodes, word offsets (int64_t, -1 for NULL), roots (int32_t), text
+};
+
+// The top-level commands of the running script, as roots in the node pool
+int *script_roots;
+int script_nroots;
+
+// Trees parsed from sourced files are pinned in the node pool wherever the
+// pool happened to end, which may be in the middle of a batch script's own
+// tree. Their ranges are kept so script_cache_save() can leave them out.
+struct tree_range {
+    int node_start, node_end, word_start, word_end;
+};
+
+struct tree_range *pinned_ranges;
+int npinned_ranges, pinned_ranges_cap;
+
+// Node (or, with words set, word) index i once the pinned ranges from first
+// on are taken out of the pool.
+int tree_squeeze(int i, int first, int words) {
+    int shift = 0;
+    for (int r = first; r < npinned_ranges; r++) {
+        struct tree_range *t = &pinned_ranges[r];
+        int start = words ? t->word_start : t->node_start;
+        int end = words ? t->word_end : t->node_end;
+        if (end <= i) shift += end - start;
+    }
+    return i - shift;
+}
+
+int tree_pinned(int i, int first, int words) {
+    for (int r = first; r < npinned_ranges; r++) {
+        struct tree_range *t = &pinned_ranges[r];
+        if (words ? t->word_start <= i && i < t->word_end : t->node_start <= i && i < t->node_end) return 1;
+    }
+    return 0;
+}
+
+// Returns the cache file for a script with the given hash, or NULL if there
+// is nowhere to keep one. Creates the directory if needed.
+char *script_cache_path(uint64_t hash) {
+    char dir[4096];
+    const char *base = var_get("XDG_CACHE_HOME");
+    const char *home = var_get("HOME");
+    if (base && base[0] == '/') snprintf(dir, sizeof(dir), "%s/mysh", base);
+    else if (home) snprintf(dir, sizeof(dir), "%s/.cache/mysh", home);
+    else return NULL;
+
+    // mkdir -p, tolerating components that already exist
+    for (char *p = dir + 1; ; p++) {
+        if (*p == '/' || *p == '\0') {
+            char c = *p;
+            *p = '\0';
+            if (mkdir(dir, 0700) != 0 && errno != EEXIST) return NULL;
+            *p = c;
+            if (c == '\0') break;
+        }
+    }
+    char *path = malloc(strlen(dir) + 32);
+    if (path) sprintf(path, "%s/%016llx.ast", dir, (unsigned long long)hash);
+    return path;
+}
+
+// True if word range [first, first + n) lies within the nwords words and,
+// when the node relies on it, ends in NULL.
+int cache_range_ok(int first, int n, uint32_t nwords, const int64_t *offsets, int terminated) {
+    if (first < 0 || n < 0 || (uint32_t)first > nwords || (uint32_t)n > nwords - first) return 0;
+    return !terminated || n == 0 || offsets[first + n - 1] < 0;
+}
+
+// Checks everything in a cache file that the shell would follow: node
+// types, child and word indices, word offsets into the text and the roots.
+// A file that fails is not used, so a damaged or foreign one can only cost
+// a parse.
+int script_cache_valid(const struct script_cache_header *h, const struct node *nodes,
+                       const int64_t *offsets, const int32_t *roots, const char *text) {
+    if (h->resume > h->script_len) return 0;
+    if (h->text_len > 0 && text[h->text_len - 1] != '\0') return 0;
+    for (uint32_t i = 0; i < h->nwords; i++) {
+        if (offsets[i] < -1 || (offsets[i] >= 0 && (uint64_t)offsets[i] >= h->text_len)) return 0;
+    }
+    for (uint32_t i = 0; i < h->nroots; i++) {
+        if (roots[i] < 0 || (uint32_t)roots[i] >= h->nnodes) return 0;
+    }
+    int64_t nnodes = h->nnodes;
+    for (uint32_t i = 0; i < h->nnodes; i++) {
+        const struct node *p = &nodes[i];
+        if (p->type < NODE_CMD || p->type > NODE_SUBSHELL) return 0;
+        if (p->a < -1 || p->a >= nnodes || p->b < -1 || p->b >= nnodes || p->next < -1 || p->next >= nnodes) {
+            return 0;
+        }
+        if (node_c_is_child(p->type) && (p->c < -1 || p->c >= nnodes)) return 0;
+        if (!cache_range_ok(p->word, p->nwords, h->nwords, offsets, p->type == NODE_CMD || p->type == NODE_FOR) ||
+            !cache_range_ok(p->redir, p->nredir, h->nwords, offsets, 1)) {
+            return 0;
+        }
+        // Words the executor takes without looking: a name, or patterns
+        int named = p->type == NODE_FOR || p->type == NODE_CASE || p->type == NODE_FUNC;
+        if ((p->type == NODE_CMD || named) && p->nwords < 1) return 0;
+        if (named && offsets[p->word] < 0) return 0;
+        for (int k = 0; p->type == NODE_CASE_ITEM && k < p->nwords; k++) {
+            if (offsets[p->word + k] < 0) return 0;
+        }
+    }
+    return 1;
+}
+
+// Maps a saved tree into the node pool. The words point straight into the
+// private mapping, which stays for the life of the shell. Returns the
+// offset to resume reading at, or -1 if there is no usable cache entry.
+long script_cache_load(const char *path, uint64_t hash, size_t script_len) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct script_cache_header)) {
+        close(fd);
+        return -1;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    struct script_cache_header *h = (struct script_cache_header *)map;
+    size_t need = sizeof(*h) + (size_t)h->nnodes * sizeof(struct node) +
+                  (size_t)h->nwords * sizeof(int64_t) + (size_t)h->nroots * sizeof(int32_t) + h->text_len;
+    if (memcmp(h->magic, SCRIPT_CACHE_MAGIC, 8) != 0 || h->version != SCRIPT_CACHE_VERSION ||
+        h->build != (uint32_t)hash_bytes(SCRIPT_CACHE_BUILD, strlen(SCRIPT_CACHE_BUILD)) ||
+        h->node_size != sizeof(struct node) || h->script_hash != hash || h->script_len != script_len ||
+        need != (size_t)st.st_size) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    struct node *nodes = (struct node *)(h + 1);
+    int64_t *offsets = (int64_t *)(nodes + h->nnodes);
+    int32_t *roots = (int32_t *)(offsets + h->nwords);
+    char *text = (char *)(roots + h->nroots);
+    if (!script_cache_valid(h, nodes, offsets, roots, text)) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    int node_base = ast_count, word_base = ast_nwords;
+    for (uint32_t i = 0; i < h->nnodes; i++) {
+        int n = node_new(NODE_CMD);
+        ast_nodes[n] = nodes[i];
+        struct node *p = &ast_nodes[n];
+        if (p->a >= 0) p->a += node_base;
+        if (p->b >= 0) p->b += node_base;
+        if (p->c >= 0 && node_c_is_child(p->type)) p->c += node_base;
+        if (p->next >= 0) p->next += node_base;
+        p->word += word_base;
+        p->redir += word_base;
+    }
+    for (uint32_t i = 0; i < h->nwords; i++) {
+        int w = word_push(NULL);
+        ast_words[w] = offsets[i] < 0 ? NULL : (char *)operator_word(text + offsets[i]);
+    }
+    // The mtime marks the entry as in use; see script_cache_prune()
+    if (st.st_mtime < time(NULL) - SCRIPT_CACHE_TOUCH) utimensat(AT_FDCWD, path, NULL, 0);
+    script_roots = malloc((h->nroots + 1) * sizeof(int));
+    if (!script_roots) {
+        fprintf(stderr, "mysh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    for (uint32_t i = 0; i < h->nroots; i++) script_roots[i] = roots[i] + node_base;
+    script_nroots = h->nroots;
+    return (long)h->resume;
+}
+
+// Removes the entries of the cache directory holding path that no script
+// has loaded for SCRIPT_CACHE_MAX_AGE, and temporary files left as long by
+// writers that died. Run when an entry is written, so a cache only grows
+// while new scripts keep coming.
+void script_cache_prune(const char *path) {
+    const char *slash = strrchr(path, '/');
+    if (slash == NULL) return;
+    char *dir = strndup(path, slash - path);
+    DIR *d = dir ? opendir(dir) : NULL;
+    free(dir);
+    if (d == NULL) return;
+    time_t oldest = time(NULL) - SCRIPT_CACHE_MAX_AGE;
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        size_t len = strlen(ent->d_name);
+        if (len < 4 || (strcmp(ent->d_name + len - 4, ".ast") != 0 && strcmp(ent->d_name + len - 4, ".tmp") != 0)) {
+            continue;
+        }
+        struct stat st;
+        if (fstatat(dirfd(d), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode) &&
+            st.st_mtime < oldest) {
+            unlinkat(dirfd(d), ent->d_name, 0);
+        }
+    }
+    closedir(d);
+}
+
+// Writes the tree parsed from a script, nodes [node_base, ast_count) and
+// words [word_base, ast_nwords) less the pinned ranges from first_range on,
+// with indices made relative to those bases. The file is written under a
+// temporary name and renamed into place, so a reader never sees half of it.
+void script_cache_save(const char *path, uint64_t hash, size_t script_len, size_t resume,
+                       int node_base, int word_base, int first_range) {
+    struct script_cache_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SCRIPT_CACHE_MAGIC, 8);
+    h.version = SCRIPT_CACHE_VERSION;
+    h.build = (uint32_t)hash_bytes(SCRIPT_CACHE_BUILD, strlen(SCRIPT_CACHE_BUILD));
+    h.node_size = sizeof(struct node);
+    h.script_hash = hash;
+    h.script_len = script_len;
+    h.resume = resume;
+    h.nnodes = tree_squeeze(ast_count, first_range, 0) - node_base;
+    h.nwords = tree_squeeze(ast_nwords, first_range, 1) - word_base;
+    h.nroots = script_nroots;
+
+    for (int i = word_base; i < ast_nwords; i++) {
+        char *w = ast_words[i];
+        if (w && !tree_pinned(i, first_range, 1)) h.text_len += strlen(w) + 1;
+    }
+    int64_t *offsets = malloc((h.nwords + 1) * sizeof(int64_t));
+    struct node *nodes = malloc((h.nnodes + 1) * sizeof(struct node));
+    int32_t *roots = malloc((h.nroots + 1) * sizeof(int32_t));
+    char *text = malloc(h.text_len + 1);
+    if (!offsets || !nodes || !roots || !text) {
+        free(offsets);
+        free(nodes);
+        free(roots);
+        free(text);
+        return;
+    }
+    size_t used = 0;
+    uint32_t k = 0;
+    for (int i = word_base; i < ast_nwords; i++) {
+        char *w = ast_words[i];
+        if (tree_pinned(i, first_range, 1)) continue;
+        offsets[k++] = w ? (int64_t)used : -1;
+        if (w) {
+            size_t n = strlen(w) + 1;
+            memcpy(text + used, w, n);
+            used += n;
+        }
+    }
+    k = 0;
+    for (int i = node_base; i < ast_count; i++) {
+        if (tree_pinned(i, first_range, 0)) continue;
+        struct node p = ast_nodes[i];
+        if (p.a >= 0) p.a = tree_squeeze(p.a, first_range, 0) - node_base;
+        if (p.b >= 0) p.b = tree_squeeze(p.b, first_range, 0) - node_base;
+        if (p.c >= 0 && node_c_is_child(p.type)) p.c = tree_squeeze(p.c, first_range, 0) - node_base;
+        if (p.next >= 0) p.next = tree_squeeze(p.next, first_range, 0) - node_base;
+        p.word = tree_squeeze(p.word, first_range, 1) - word_base;
+        p.redir = tree_squeeze(p.redir, first_range, 1) - word_base;
+        nodes[k++] = p;
+    }
+    for (uint32_t i = 0; i < h.nroots; i++) roots[i] = tree_squeeze(script_roots[i], first_range, 0) - node_base;
+
+    char *tmp = malloc(strlen(path) + 32);
+    if (tmp) sprintf(tmp, "%s.%ld.tmp", path, (long)getpid());
+    int fd = tmp ? open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600) : -1;
+    if (fd >= 0) {
+        int ok = write_all(fd, (char *)&h, sizeof(h)) == 0 &&
+                 write_all(fd, (char *)nodes, h.nnodes * sizeof(struct node)) == 0 &&
+                 write_all(fd, (char *)offsets, h.nwords * sizeof(int64_t)) == 0 &&
+                 write_all(fd, (char *)roots, h.nroots * sizeof(int32_t)) == 0 &&
+                 write_all(fd, text, h.text_len) == 0;
+        close(fd);
+        if (!ok || rename(tmp, path) != 0) unlink(tmp);
+        else script_cache_prune(path);
+    }
+    free(tmp);
+    free(text);
+    free(offsets);
+    free(nodes);
+    free(roots);
+}
+
+// A script is split into chunks at newlines and the chunks are lexed on a
+// few threads, each into its own arena, while the main thread parses and
+// runs them in order. The first command therefore starts as soon as the
+// first chunk is ready. A chunk is lexed as if it began outside any quote
+// or here-document; when the one before it turns out to end inside one,
+// the main thread throws that work away and lexes the chunk again,
+// carrying on from where the previous chunk left off.
+#define SCRIPT_CHUNK (1 << 20)
+#define SCRIPT_THREADS 8
+
+struct script_chunk {
+    const char *text;
+    size_t off, len;           // Byte range within the script
+    struct arena arena;        // Text of the words
+    struct argv_builder words; // Words of every complete line
+    struct lexer lx;           // Records where the lines end
+    int ready;
+};
+
+struct script_pool {
+    struct script_chunk *chunks;
+    int nchunks;
+    int next; // Next chunk to lex
+    int stop; // Set when the script exits early
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+};
+
+void chunk_lex(struct script_chunk *c) {
+    argv_init(&c->words);
+    lexer_init(&c->lx, &c->arena, &c->words);
+    c->lx.record = 1;
+    c->lx.offset = c->off;
+    lexer_feed(&c->lx, c->text, c->len);
+}
+
+void chunk_free(struct script_chunk *c) {
+    lexer_free(&c->lx);
+    memset(&c->lx, 0, sizeof(c->lx));
+    arena_release(&c->arena, (struct arena_mark){NULL, 0});
+    free(c->words.v);
+    c->words.v = NULL;
+}
+
+void *script_worker(void *arg) {
+    struct script_pool *pool = arg;
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        int i = pool->stop || pool->next == pool->nchunks ? -1 : pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        if (i < 0) return NULL;
+
+        chunk_lex(&pool->chunks[i]);
+        pthread_mutex_lock(&pool->lock);
+        pool->chunks[i].ready = 1;
+        pthread_cond_broadcast(&pool->ready);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+void script_roots_push(int root, int *cap) {
+    if (script_nroots == *cap) {
+        *cap = *cap ? *cap * 2 : 256;
+        script_roots = realloc(script_roots, *cap * sizeof(int));
+        if (!script_roots) {
+            fprintf(stderr, "mysh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    script_roots[script_nroots++] = root;
+}
+
+int script_exec(int root, int tail) {
+    while (waitpid(-1, NULL, WNOHANG) > 0) // Reap finished background commands
+        ;
+    exec_tail = tail;
+    int status = exec_list(root);
+    jump_kind = JUMP_NONE;
+    return status;
+}
+
+// Parses script[0..len) one top-level command at a time and runs each as
+// soon as it is complete. Once the whole script has parsed, the tree is
+// saved to the cache at path (if any). Sets *resume to where parsing
+// stopped: len, or the start of the first command that does not parse.
+// Returns 0 once the shell should exit.
+int script_parse_run(const char *script, size_t len, const char *path, uint64_t hash, size_t *resume) {
+    struct script_pool pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.nchunks = (len + SCRIPT_CHUNK - 1) / SCRIPT_CHUNK;
+    pool.chunks = calloc(pool.nchunks, sizeof(struct script_chunk));
+    if (!pool.chunks) {
+        fprintf(stderr, "mysh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t off = 0, i = 0; off < len; i++) {
+        size_t end = off + SCRIPT_CHUNK < len ? off + SCRIPT_CHUNK : len;
+        const char *nl = end < len ? memchr(script + end, '\n', len - end) : NULL;
+        if (nl) end = nl - script + 1;
+        else end = len;
+        pool.chunks[i].text = script + off;
+        pool.chunks[i].off = off;
+        pool.chunks[i].len = end - off;
+        pool.nchunks = i + 1; // Chunks run long to end on a newline, so there may be fewer
+        off = end;
+    }
+
+    pthread_t threads[SCRIPT_THREADS];
+    int nthreads = 0;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (pool.nchunks > 1 && cpus > 1) {
+        int want = cpus < SCRIPT_THREADS ? (int)cpus : SCRIPT_THREADS;
+        if (want > pool.nchunks) want = pool.nchunks;
+        pthread_mutex_init(&pool.lock, NULL);
+        pthread_cond_init(&pool.ready, NULL);
+        for (; nthreads < want; nthreads++) {
+            if (pthread_create(&threads[nthreads], NULL, script_worker, &pool) != 0) break;
+        }
+    }
+
+    struct argv_builder toks = {NULL, 0, 0};
+    argv_init(&toks);
+    int cap = 0, status = 1;
+    int node_base = ast_count, word_base = ast_nwords;
+    int contiguous = 1; // False once running a command kept nodes of its own
+    int first_range = npinned_ranges; // Sourced trees from here on are not ours
+    size_t pos = 0, unit_start = 0;
+    int first = 0; // Oldest chunk the pending command still has words in
+
+    struct script_chunk *lc = NULL; // Chunk whose lexer output is being parsed
+    int w = 0, li = 0;                // Next word and line of lc
+    struct nesting ns;                // Blocks open in toks[0..scanned)
+    int scanned = 0;
+    nesting_init(&ns);
+    for (int ci = 0; ci < pool.nchunks && status > 0; ci++) {
+        struct script_chunk *c = &pool.chunks[ci];
+        if (nthreads == 0) {
+            chunk_lex(c);
+        } else {
+            pthread_mutex_lock(&pool.lock);
+            while (!c->ready) pthread_cond_wait(&pool.ready, &pool.lock);
+            pthread_mutex_unlock(&pool.lock);
+        }
+        if (lc && !lexer_complete(&lc->lx)) {
+            // Lexed from the wrong state: feed it to the previous lexer
+            chunk_free(c);
+            lexer_feed(&lc->lx, c->text, c->len);
+        } else {
+            lc = c;
+            w = li = 0;
+        }
+        if (ci == pool.nchunks - 1) lexer_finish(&lc->lx);
+
+        for (; li < lc->lx.nlines && status > 0; li++) {
+            for (; w < lc->lx.lines[li].end; w++) argv_push(&toks, lc->words.v[w]);
+            pos = lc->lx.lines[li].next;
+            nesting_feed(&ns, toks.v, scanned, toks.n);
+            scanned = toks.n;
+            if (nesting_open(&ns) && pos < len) continue; // Parse the block once it is all in
+
+            struct parser ps = {toks.v, 0, PARSE_OK, 1};
+            struct arena_mark text_mark = arena_mark(&ast_arena);
+            int nodes_mark = ast_count, words_mark = ast_nwords;
+            int root = parse_list(&ps, NULL);
+            if (ps.state != PARSE_OK) {
+                ast_count = nodes_mark;
+                ast_nwords = words_mark;
+                arena_release(&ast_arena, text_mark);
+                if (ps.state == PARSE_INCOMPLETE && pos < len) continue; // Parse again once more lines are in
+                status = -1;
+                break;
+            }
+            if (root >= 0) script_roots_push(root, &cap);
+            toks.n = 0;
+            toks.v[0] = NULL;
+            nesting_init(&ns);
+            scanned = 0;
+            unit_start = pos;
+            for (; first < lc - pool.chunks; first++) chunk_free(&pool.chunks[first]);
+
+            if (pos == len && path && contiguous) {
+                script_cache_save(path, hash, len, len, node_base, word_base, first_range);
+            }
+            if (root >= 0) {
+                int before = ast_count, words_before = ast_nwords, ranges_before = npinned_ranges;
+                status = script_exec(root, pos == len); // Nothing after the last command
+                if (tree_squeeze(ast_count, ranges_before, 0) != before ||
+                    tree_squeeze(ast_nwords, ranges_before, 1) != words_before) {
+                    contiguous = 0;
+                }
+            }
+        }
+    }
+    if (status > 0 && unit_start < len) status = -1; // Ends inside a quote or a command
+    if (status < 0) {
+        // The rest goes to loop(), which reports the error where it is
+        pos = unit_start;
+        if (path && contiguous) script_cache_save(path, hash, len, pos, node_base, word_base, first_range);
+        status = 1;
+    }
+
+    if (nthreads > 0) {
+        pthread_mutex_lock(&pool.lock);
+        pool.stop = 1;
+        pthread_mutex_unlock(&pool.lock);
+        for (int i = 0; i < nthreads; i++) pthread_join(threads[i], NULL);
+        pthread_mutex_destroy(&pool.lock);
+        pthread_cond_destroy(&pool.ready);
+    }
+    for (int i = first; i < pool.nchunks; i++) chunk_free(&pool.chunks[i]);
+    free(pool.chunks);
+    free(toks.v);
+    *resume = pos;
+    return status;
+}
+
+// Runs the batch script open on script_input: its parsed form from the
+// cache when there is one, otherwise parsing it as it goes (and saving the
+// result). Whatever could not be parsed up front is left to loop(). Returns
+// 0 once the shell should exit, like launch().
+int run_script(void) {
+    int fd = fileno(script_input);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) return 1;
+    size_t len = st.st_size;
+    char *script = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (script == MAP_FAILED) return 1;
+
+    uint64_t hash = hash_bytes(script, len);
+    char *path = script_cache_path(hash);
+    long cached = path ? script_cache_load(path, hash, len) : -1;
+    size_t resume = cached;
+    int status = 1;
+    if (cached < 0) {
+        madvise(script, len, MADV_SEQUENTIAL);
+        status = script_parse_run(script, len, path, hash, &resume);
+    } else {
+        for (int i = 0; i < script_nroots && status; i++) {
+            status = script_exec(script_roots[i], i == script_nroots - 1 && resume == len);
+        }
+    }
+    free(path);
+    munmap(script, len);
+    if (status) fseek(script_input, resume, SEEK_SET);
+    return status;
+}
+
+// Sourced files, and scripts whose #! line names mysh, run inside this
+// shell: `source` in the shell's own context, a mysh script called as a
+// command in a frame that looks to it like a new process. Either way the
+// file's parsed form is kept, keyed by the file (device and inode) and its
+// modification time, so running a helper again costs one stat(). The first
+// time round the on-disk cache of batch scripts is used as for any script.
+#define SOURCED_TABLE_SIZE 64
+#define FRAME_DEPTH_MAX 64
+
+struct sourced_script {
+    dev_t dev;
+    ino_t ino;       // 0 once the file has changed and a newer entry took over
+    struct timespec mtime;
+    off_t size;
+    int exec;        // Has an execute bit
+    int shebang;     // First line is #!.../mysh or #!.../env mysh
+    int parsed;
+    int *roots;      // Top-level commands in the node pool
+    int nroots;
+    char *error;     // The syntax error that ended the parse, if any
+    char *path;
+    struct sourced_script *next;
+};
+
+struct sourced_script *sourced_table[SOURCED_TABLE_SIZE];
+
+// True if head[0..n), the start of a file, is a #! line naming mysh.
+int is_mysh_shebang(const char *head, size_t n) {
+    if (n < 2 || head[0] != '#' || head[1] != '!') return 0;
+    char line[256];
+    size_t len = 0;
+    for (size_t i = 2; i < n && head[i] != '\n' && len < sizeof(line) - 1; i++) line[len++] = head[i];
+    line[len] = '\0';
+
+    char *save, *prog = strtok_r(line, " \t\r", &save);
+    if (prog == NULL) return 0;
+    char *base = strrchr(prog, '/') ? strrchr(prog, '/') + 1 : prog;
+    if (strcmp(base, "env") == 0) {
+        prog = strtok_r(NULL, " \t\r", &save);
+        if (prog == NULL) return 0;
+        base = strrchr(prog, '/') ? strrchr(prog, '/') + 1 : prog;
+    }
+    return strcmp(base, "mysh") == 0;
+}
+
+// Returns the entry for the file at path, making a new one if the file is
+// new or has changed since it was seen. Returns NULL with errno set if it
+// is not a regular file that can be looked at.
+struct sourced_script *sourced_find(const char *path) {
+    struct stat st;
+    if (stat(path, &st) != 0) return NULL;
+    if (!S_ISREG(st.st_mode)) {
+        errno = S_ISDIR(st.st_mode) ? EISDIR : EACCES;
+        return NULL;
+    }
+    struct sourced_script **bucket = &sourced_table[(st.st_dev * 31 + st.st_ino) % SOURCED_TABLE_SIZE];
+    struct sourced_script *s = *bucket;
+    while (s && (s->ino != st.st_ino || s->dev != st.st_dev)) s = s->next;
+    if (s && s->size == st.st_size && s->mtime.tv_sec == st.st_mtim.tv_sec &&
+        s->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        return s;
+    }
+    if (s) s->ino = 0; // Stale, but a frame may still be running its tree
+
+    s = calloc(1, sizeof(*s));
+    if (s) s->path = strdup(path);
+    if (!s || !s->path) {
+        fprintf(stderr, "mysh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    s->dev = st.st_dev;
+    s->ino = st.st_ino;
+    s->mtime = st.st_mtim;
+    s->size = st.st_size;
+    s->exec = (st.st_mode & 0111) != 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        char head[256];
+        ssize_t n = read(fd, head, sizeof(head));
+        s->shebang = n > 0 && is_mysh_shebang(head, n);
+        close(fd);
+    }
+    s->next = *bucket;
+    *bucket = s;
+    return s;
+}
+
+// Parses text, the contents of s's file, into the node pool for good. A
+// syntax error ends the tree at the command that has it; the message is
+// kept for when the commands before it have run.
+void sourced_parse(struct sourced_script *s, const char *text, size_t len) {
+    int *outer_roots = script_roots, outer_nroots = script_nroots;
+    script_roots = NULL;
+    script_nroots = 0;
+    int node_base = ast_count, word_base = ast_nwords;
+    size_t resume = 0;
+
+    uint64_t hash = hash_bytes(text, len);
+    char *cache = script_cache_path(hash);
+    long cached = cache ? script_cache_load(cache, hash, len) : -1;
+    if (cached >= 0) {
+        resume = cached;
+    } else {
+        struct arena a = {NULL};
+        struct argv_builder words, toks;
+        struct lexer lx;
+        argv_init(&words);
+        argv_init(&toks);
+        lexer_init(&lx, &a, &words);
+        lx.record = 1;
+        lexer_feed(&lx, text, len);
+        lexer_finish(&lx);
+
+        struct nesting ns;
+        nesting_init(&ns);
+        int cap = 0, w = 0;
+        for (int li = 0; li < lx.nlines; li++) {
+            int from = toks.n;
+            for (; w < lx.lines[li].end; w++) argv_push(&toks, words.v[w]);
+            nesting_feed(&ns, toks.v, from, toks.n);
+            if (nesting_open(&ns) && lx.lines[li].next < len) continue;
+
+            struct parser ps = {toks.v, 0, PARSE_OK, 1};
+            struct arena_mark text_mark = arena_mark(&ast_arena);
+            int nodes_mark = ast_count, words_mark = ast_nwords;
+            int root = parse_list(&ps, NULL);
+            if (ps.state != PARSE_OK) {
+                ast_count = nodes_mark;
+                ast_nwords = words_mark;
+                arena_release(&ast_arena, text_mark);
+                if (ps.state == PARSE_INCOMPLETE && lx.lines[li].next < len) continue;
+                break;
+            }
+            if (root >= 0) script_roots_push(root, &cap);
+            toks.n = 0;
+            toks.v[0] = NULL;
+            nesting_init(&ns);
+            resume = lx.lines[li].next;
+        }
+        lexer_free(&lx);
+        arena_release(&a, (struct arena_mark){NULL, 0});
+        free(words.v);
+        free(toks.v);
+        if (cache) script_cache_save(cache, hash, len, resume, node_base, word_base, npinned_ranges);
+    }
+    free(cache);
+
+    s->roots = script_roots;
+    s->nroots = script_nroots;
+    s->parsed = 1;
+    script_roots = outer_roots;
+    script_nroots = outer_nroots;
+
+    if (npinned_ranges == pinned_ranges_cap) {
+        pinned_ranges_cap = pinned_ranges_cap ? pinned_ranges_cap * 2 : 16;
+        pinned_ranges = realloc(pinned_ranges, pinned_ranges_cap * sizeof(struct tree_range));
+        if (!pinned_ranges) {
+            fprintf(stderr, "mysh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    pinned_ranges[npinned_ranges++] = (struct tree_range){node_base, ast_count, word_base, ast_nwords};
+    tree_pins++;
+
+    if (resume < len) {
+        // Parse what is left again to put the error into words
+        struct arena_mark mark = arena_mark(&line_arena);
+        char **toks = split_line(arena_strndup(&line_arena, text + resume, len - resume));
+        struct parser ps = {toks, 0, PARSE_OK, 1};
+        int nodes_mark = ast_count, words_mark = ast_nwords;
+        parse_list(&ps, NULL);
+        ast_count = nodes_mark;
+        ast_nwords = words_mark;
+        char msg[256];
+        if (ps.state == PARSE_ERROR) {
+            snprintf(msg, sizeof(msg), "syntax error near unexpected token `%s'",
+                     at(&ps, "\n") ? "newline" : peek(&ps));
+        } else {
+            snprintf(msg, sizeof(msg), "syntax error: unexpected end of file");
+        }
+        s->error = strdup(msg);
+        free(toks);
+        arena_release(&line_arena, mark);
+    }
+}
+
+// Makes sure s has been parsed. Returns -1 with errno set if its file
+// cannot be read.
+int sourced_load(struct sourced_script *s) {
+    if (s->parsed) return 0;
+    if (s->size == 0) {
+        s->parsed = 1;
+        return 0;
+    }
+    int fd = open(s->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    char *text = mmap(NULL, s->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (text == MAP_FAILED) return -1;
+    sourced_parse(s, text, s->size);
+    munmap(text, s->size);
+    return 0;
+}
+
+// Runs the commands of a parsed file, then reports the syntax error that
+// ended its parse, if there was one. Returns the keep-going status.
+int sourced_run(struct sourced_script *s) {
+    int status = 1;
+    last_exit_status = 0;
+    for (int i = 0; i < s->nroots && status && jump_kind == JUMP_NONE; i++) {
+        status = exec_list(s->roots[i]);
+    }
+    if (status && jump_kind == JUMP_NONE && s->error) {
+        fprintf(stderr, "mysh: %s: %s\n", s->path, s->error);
+        last_exit_status = 2;
+    }
+    return status;
+}
+
+// Returns the command name's file if it is an executable mysh script,
+// parsed and ready to run in this process, or NULL.
+struct sourced_script *mysh_script(const char *name) {
+    const char *path = strchr(name, '/') ? name : path_lookup(name);
+    if (path == NULL) return NULL;
+    struct sourced_script *s = sourced_find(path);
+    if (s == NULL || !s->exec || !s->shebang || sourced_load(s) != 0) return NULL;
+    return s;
+}
+
+// Runs a mysh script in this process as though it were a new one: it sees
+// the exported variables but not the others or the functions, has its own
+// $0 and positional parameters, and everything it changes in the shell
+// (variables, functions, the working directory, the umask) is put back
+// when it ends. exit ends just the script. args[0] is the script's name.
+// Returns -1, having done nothing, if the script needs a process after all.
+int run_frame(struct sourced_script *s, char **args) {
+    if (frame_depth == FRAME_DEPTH_MAX) return -1;
+    struct saved_fds saved;
+    if (redirect_push(args, &saved) != 0) {
+        redirect_pop(&saved);
+        last_exit_status = 1;
+        return 1;
+    }
+
+    char **outer_positional = positional, *outer_name = shell_name;
+    int outer_npositional = npositional, outer_func_depth = func_depth;
+    int outer_loop_depth = loop_depth, outer_source_depth = source_depth;
+    mode_t mask = umask(0);
+    umask(mask);
+    struct func *outer_funcs[FUNC_TABLE_SIZE];
+    memcpy(outer_funcs, func_table, sizeof(func_table));
+    memset(func_table, 0, sizeof(func_table));
+
+    // A fresh variable table holding copies of the exported variables. PATH
+    // is copied as it is, so the command cache stays valid.
+    vars_load();
+    struct var_table outer_vars = shell_vars;
+    char **outer_envp = shell_envp;
+    int outer_envp_count = envp_count, outer_envp_cap = envp_cap;
+    memset(&shell_vars, 0, sizeof(shell_vars));
+    shell_envp = NULL;
+    envp_count = envp_cap = 0;
+    for (size_t i = 0; i < outer_vars.cap; i++) {
+        struct var *o = &outer_vars.slots[i];
+        if (o->name == NULL || !(o->flags & VAR_EXPORT)) continue;
+        struct var *v = var_intern(o->name);
+        v->flags = VAR_EXPORT;
+        if (o->value) {
+            v->value = strdup(o->value);
+            if (!v->value) {
+                fprintf(stderr, "mysh: allocation error\n");
+                exit(EXIT_FAILURE);
+            }
+            envp_put(v);
+        }
+    }
+    if (shell_envp == NULL) environ = shell_envp = calloc(1, sizeof(char *));
+
+    shell_name = args[0];
+    positional = args + 1;
+    for (npositional = 0; positional[npositional] != NULL; npositional++)
+        ;
+    func_depth = loop_depth = source_depth = 0;
+    struct snapshot *outer_snapshot = snapshot; // The frame undoes its own changes
+    struct saved_fds *outer_exec_fds = exec_fds;
+    struct cwd outer_cwd = {NULL, -1}, *outer_cwd_saved = cwd_saved;
+    snapshot = NULL;
+    snapshot_id = 0;
+    exec_fds = &saved;
+    cwd_saved = &outer_cwd;
+    frame_depth++;
+    unwind_depth++;
+    sourced_run(s);
+    unwind_depth--;
+    frame_depth--;
+    jump_kind = JUMP_NONE;
+    snapshot = outer_snapshot;
+    snapshot_id = snapshot ? snapshot->id : 0;
+    exec_fds = outer_exec_fds;
+    cwd_restore(&outer_cwd);
+    cwd_saved = outer_cwd_saved;
+
+    // Back to the caller's world
+    char *inner_path = var_get("PATH") ? strdup(var_get("PATH")) : NULL;
+    for (size_t i = 0; i < shell_vars.cap; i++) {
+        struct var *v = &shell_vars.slots[i];
+        if (v->name == NULL) continue;
+        free(v->value);
+        array_free(v->array);
+    }
+    free(shell_vars.slots);
+    for (int i = 0; i < envp_count; i++) free(shell_envp[i]);
+    free(shell_envp);
+    shell_vars = outer_vars;
+    environ = shell_envp = outer_envp;
+    envp_count = outer_envp_count;
+    envp_cap = outer_envp_cap;
+    char *path = var_get("PATH");
+    if ((path == NULL) != (inner_path == NULL) || (path && strcmp(path, inner_path) != 0)) path_cache_clear();
+    free(inner_path);
+
+    for (int i = 0; i < FUNC_TABLE_SIZE; i++) {
+        while (func_table[i]) {
+            struct func *f = func_table[i];
+            func_table[i] = f->next;
+            free(f);
+        }
+    }
+    memcpy(func_table, outer_funcs, sizeof(func_table));
+    func_depth = outer_func_depth;
+    loop_depth = outer_loop_depth;
+    source_depth = outer_source_depth;
+    positional = outer_positional;
+    npositional = outer_npositional;
+    shell_name = outer_name;
+    umask(mask);
+    redirect_pop(&saved);
+    return 1;
+}
+
+// source file [args...] and . file [args...]: runs the commands in file in
+// the shell itself. A name without a slash is looked for along PATH first.
+// With args, they are the positional parameters while it runs.
+int mysh_source(char **args) {
+    if (args[1] == NULL) {
+        fprintf(stderr, "mysh: %s: filename argument required\n", args[0]);
+        last_exit_status = 2;
+        return 1;
+    }
+    char *found = strchr(args[1], '/') ? NULL : path_find(args[1], R_OK);
+    struct sourced_script *s = sourced_find(found ? found : args[1]);
+    free(found);
+    if (s == NULL || sourced_load(s) != 0) {
+        fprintf(stderr, "mysh: %s: %s\n", args[1], strerror(errno));
+        last_exit_status = 1;
+        return 1;
+    }
+
+    char **outer_positional = positional;
+    int outer_npositional = npositional;
+    if (args[2] != NULL) {
+        positional = args + 2;
+        for (npositional = 0; positional[npositional] != NULL; npositional++)
+            ;
+    }
+    source_depth++;
+    int status = sourced_run(s);
+    source_depth--;
+    if (jump_kind == JUMP_RETURN) jump_kind = JUMP_NONE;
+    positional = outer_positional;
+    npositional = outer_npositional;
+    return status;
+}
+
+// Sets up what every shell starts with, whether it runs as a program or
+// inside one.
+void shell_init(void) {
+    script_input = stdin;
+    vars_init(environ);
+    cwd_init();
+    builtins_init();
+}
+
+// Runs one command line the way a script line runs, under a snapshot so
+// nothing it changes outlives it. Returns its exit status.
+int run_line_isolated(const char *cmdline) {
+    struct arena_mark mark = arena_mark(&line_arena);
+    char **args = split_line(arena_strndup(&line_arena, cmdline, strlen(cmdline)));
+    struct snapshot snap;
+    snapshot_begin(&snap);
+    execute_list(args);
+    snapshot_end(&snap);
+    fflush(stdout);
+    free(args);
+    arena_release(&line_arena, mark);
+    return last_exit_status;
+}
+
+// The library interface (see mysh.h). All the shell's state is global, so
+// the context is a token for it that one caller holds at a time.
+struct mysh_ctx {
+    int open;
+};
+
+struct mysh_ctx mysh_context;
+int shell_ready; // shell_init() has run
+
+struct mysh_stream {
+    int fd;
+    const struct mysh_opts *opts;
+};
+
+// Passes everything written to the pipe to the output callback.
+void *mysh_stream_worker(void *arg) {
+    struct mysh_stream *st = arg;
+    char buf[64 * 1024];
+    for (;;) {
+        ssize_t n = read(st->fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return NULL;
+        st->opts->output(st->opts->arg, buf, n);
+    }
+}
+
+struct mysh_ctx *mysh_open(void) {
+    if (mysh_context.open) return NULL;
+    if (!shell_ready) {
+        shell_init();
+        shell_ready = 1;
+    }
+    mysh_context.open = 1;
+    return &mysh_context;
+}
+
+void mysh_close(struct mysh_ctx *ctx) {
+    ctx->open = 0;
+}
+
+int mysh_run(struct mysh_ctx *ctx, const char *cmdline, const struct mysh_opts *opts) {
+    if (ctx == NULL || !ctx->open) return -1;
+
+    // Standard output goes to a pipe that a thread drains into the callback
+    struct mysh_stream st = {-1, opts};
+    int saved_stdout = -1, pipefd[2];
+    pthread_t reader;
+    if (opts && opts->output) {
+        if (pipe2(pipefd, O_CLOEXEC) != 0) return -1;
+        fflush(stdout);
+        saved_stdout = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, SHELL_FD_BASE);
+        st.fd = pipefd[0];
+        if (saved_stdout < 0 || pthread_create(&reader, NULL, mysh_stream_worker, &st) != 0) {
+            if (saved_stdout >= 0) close(saved_stdout);
+            close(pipefd[0]);
+            close(pipefd[1]);
+            return -1;
+        }
+        dup2(pipefd[1], STDOUT_FILENO); // Without close-on-exec: commands inherit it
+        close(pipefd[1]);
+    }
+
+    int status = run_line_isolated(cmdline);
+    if (saved_stdout >= 0) {
+        dup2(saved_stdout, STDOUT_FILENO); // The reader sees end of file
+        close(saved_stdout);
+        pthread_join(reader, NULL);
+        close(pipefd[0]);
+    }
+    return status;
+}
+
+
+// mysh --server path: a daemon that keeps one warm shell and runs command
+// lines sent to it over a Unix socket, so a caller pays for neither the
+// shell's startup nor cold caches. Each request is one SOCK_SEQPACKET
+// message holding the command line, with the caller's stdin, stdout and
+// stderr passed along as SCM_RIGHTS, then optionally its working
+// directory; the reply is the exit status as an int. Requests run one at
+// a time, each isolated like mysh_run()'s. Only the user running the
+// server may connect.
+#define SERVER_MAX_LINE (64 * 1024)
+
+// Receives a request. Returns its length, 0 at end of connection, or -1
+// for a request that cannot be run, an empty one included, whose
+// descriptors are closed; fds gets the descriptors, with -1 for a
+// directory not sent.
+ssize_t server_recv(int c, char *line, int *fds) {
+    union {
+        struct cmsghdr h;
+        char buf[CMSG_SPACE(4 * sizeof(int))];
+    } ctl;
+    struct iovec iov = {line, SERVER_MAX_LINE};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    ssize_t n;
+    while ((n = recvmsg(c, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+        ;
+    if (n < 0) return -1;
+
+    // An empty message reads as 0 too, but comes with descriptors
+    int nfds = 0;
+    fds[3] = -1;
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) continue;
+        int count = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int k = 0; k < count; k++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cm) + k * sizeof(int), sizeof(int));
+            if (nfds < 4) fds[nfds++] = fd;
+            else close(fd);
+        }
+    }
+    if (n == 0 && nfds == 0 && !(msg.msg_flags & MSG_CTRUNC)) return 0;
+    if (n > 0 && nfds >= 3 && !(msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+        line[n] = '\0';
+        return n;
+    }
+    fprintf(stderr, "mysh: server: %s request\n", n == 0 ? "empty" : "malformed");
+    for (int k = 0; k < nfds; k++) close(fds[k]);
+    return -1;
+}
+
+void server_client(int c, char *line) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(c, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0 || cred.uid != getuid()) {
+        fprintf(stderr, "mysh: server: refused a client of another user\n");
+        return;
+    }
+    for (;;) {
+        int fds[4], status = 2; // What a request that cannot run gets back
+        ssize_t n = server_recv(c, line, fds);
+        if (n == 0) return;
+        if (n > 0) {
+            struct saved_fds saved;
+            fds_save(&saved);
+            for (int k = 0; k < 3; k++) {
+                dup2(fds[k], k);
+                close(fds[k]);
+            }
+            struct snapshot snap; // Takes the server back to its own directory
+            snapshot_begin(&snap);
+            char *dir = fds[3] >= 0 && fchdir(fds[3]) == 0 ? getcwd(NULL, 0) : NULL;
+            if (dir) cwd_replace(dir, fds[3]);
+            else if (fds[3] >= 0) close(fds[3]);
+            status = run_line_isolated(line);
+            snapshot_end(&snap);
+            redirect_pop(&saved);
+        }
+        if (send(c, &status, sizeof(status), MSG_NOSIGNAL) != sizeof(status) || n < 0) return;
+    }
+}
+
+int serve(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "mysh: server: %s: socket path too long\n", path);
+        return EXIT_FAILURE;
+    }
+    strcpy(addr.sun_path, path);
+
+    // A socket left behind by an earlier server is replaced; nothing else is
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(sock, 64) != 0) {
+        fprintf(stderr, "mysh: server: %s: %s\n", path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    char *line = malloc(SERVER_MAX_LINE + 1);
+    if (!line) {
+        fprintf(stderr, "mysh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    for (;;) {
+        int c = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+        if (c < 0) {
+            if (errno != EINTR) perror("mysh: server");
+            continue;
+        }
+        server_client(c, line);
+        close(c);
+        while (waitpid(-1, NULL, WNOHANG) > 0) // Reap finished background commands
+            ;
+    }
+}
+
+
+#ifdef MYSH_GEN_BUILTINS
+// Searches for the first odd seed that gives every core builtin a slot of
+// its own and prints the generated part of the perfect hash.
+int main(void) {
+    int n = num_builtins();
+    for (uint32_t seed = 1; seed < 0x10000; seed += 2) {
+        signed char slots[BUILTIN_SLOTS];
+        memset(slots, -1, sizeof(slots));
+        int i;
+        for (i = 0; i < n && slots[builtin_hash(builtin_str[i], seed)] < 0; i++) {
+            slots[builtin_hash(builtin_str[i], seed)] = i;
+        }
+        if (i < n) continue;
+
+        printf("#define BUILTIN_SEED 0x%xu\n#define BUILTIN_COUNT %d\n\n", seed, n);
+        printf("const signed char builtin_slots[BUILTIN_SLOTS] = {\n");
+        for (i = 0; i < BUILTIN_SLOTS; i++) {
+            printf("%s%d%s", i % 16 ? " " : "    ", slots[i],
+                   i == BUILTIN_SLOTS - 1 ? "\n" : i % 16 == 15 ? ",\n" : ",");
+        }
+        printf("};\n");
+        return 0;
+    }
+    fprintf(stderr, "mysh: no seed gives each builtin its own slot; raise BUILTIN_SLOTS\n");
+    return 1;
+}
+#elif !defined(MYSH_LIBRARY)
+// mysh -c cmdline [name [args...]]: runs cmdline and exits with its status.
+// Only what the line uses gets set up, and its last command takes over the
+// shell's process, so a one-shot command costs little more than an exec.
+int command_main(int argc, char **argv) {
+    command_mode = 1;
+    vars_init(environ);
+    builtins_init();
+    if (argc > 3) {
+        shell_name = argv[3];
+        positional = argv + 4;
+        npositional = argc - 4;
+    }
+    exec_tail = 1;
+    execute_list(split_line(argv[2]));
+    exec_tail = 0;
+    return last_exit_status;
+}
+
+int main(int argc, char **argv) {
+    // Main entry point of the shell
+
+    if (argc >= 2 && strcmp(argv[1], "-c") == 0) {
+        if (argc == 2) {
+            fprintf(stderr, "mysh: -c: option requires an argument\n");
+            return 2;
+        }
+        return command_main(argc, argv);
+    }
+    shell_init();
+
+    if (argc == 3 && strcmp(argv[1], "--server") == 0) return serve(argv[2]);
+
+    // If batch mode
+    if (argc >= 2) {
+        // Words after the script name become $1, $2, ...
+        shell_name = argv[1];
+        positional = argv + 2;
+        npositional = argc - 2;
+
+        // Read commands from the file but leave standard input alone, so
+        // commands (and the read builtin) still see the shell's real stdin.
+        // Close-on-exec keeps the script out of child processes.
+        int fd = fd_move_high(open(argv[1], O_RDONLY | O_CLOEXEC));
+        script_input = fd >= 0 ? fdopen(fd, "r") : NULL;
+        if (!script_input) {
+            fprintf(stderr, "mysh: Cannot open file %s\n", argv[1]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    interactive = script_input == stdin && isatty(STDIN_FILENO);
+    printf(interactive ? "Welcome to my shell!\n" : "");
+
+    // Run command loop; a batch script has its parsed part run first.
+    if (script_input == stdin || run_script()) loop();
+
+    printf(interactive ? "Exiting my shell.\n" : "");
+
+    // Perform any shutdown/cleanup.
+
+    return EXIT_SUCCESS;
+}
+#endif
+
+// Arithmetic expansion: $(( ... )) with 64-bit integers and the C operator
+// set. Each distinct expression text is compiled once into a small stack
+// bytecode and cached, so an expression inside a loop is only parsed the
+// first time it runs. Text built from changing values, as in $(( $1 + 1 )),
+// is new every time, so the cache is bounded: once it holds
+// ARITH_CACHE_MAX programs they are retired together and it starts over.
+// Retired programs are freed at the next retirement, which leaves any
+// program a caller still holds valid until then.
+
+enum arith_opcode {
+    AR_PUSH, AR_LOAD, AR_STORE, AR_POP, AR_DUP,
+    AR_NEG, AR_NOT, AR_BNOT, AR_BOOL,
+    AR_MUL, AR_DIV, AR_MOD, AR_ADD, AR_SUB, AR_SHL, AR_SHR,
+    AR_LT, AR_LE, AR_GT, AR_GE, AR_EQ, AR_NE,
+    AR_BAND, AR_BXOR, AR_BOR,
+    AR_JZ, AR_JNZ, AR_JMP
+};
+
+struct arith_insn {
+    int op;
+    int64_t arg; // Constant, jump target or variable name index
+};
+
+struct arith_prog {
+    char *src;
+    struct arith_insn *code;
+    int ncode, capcode;
+    char **names;
+    int nnames;
+    int max_stack;
+    struct arith_prog *next; // Hash chain
+};
+
+#define ARITH_CACHE_SIZE 1024
+#define ARITH_CACHE_MAX 4096
+struct arith_prog *arith_cache[ARITH_CACHE_SIZE];
+struct arith_prog *arith_retired; // Chained by next
+int arith_cached;
+
+// Compiler state: a cursor over the source plus the program being built.
+struct arith_parser {
+    const char *p;
+    struct arith_prog *prog;
+    const char *error;
+    int depth; // Stack depth tracked at compile time for max_stack
+};
+
+int arith_emit(struct arith_parser *ps, int op, int64_t arg) {
+    struct arith_prog *pr = ps->prog;
+    if (pr->ncode == pr->capcode) {
+        pr->capcode = pr->capcode ? pr->capcode * 2 : 16;
+        pr->code = realloc(pr->code, pr->capcode * sizeof(*pr->code));
+        if (!pr->code) {
+            fprintf(stderr, "mysh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    // Track stack depth so evaluation can use a fixed-size stack
+    if (op == AR_PUSH || op == AR_LOAD || op == AR_DUP) ps->depth++;
+    else if (op >= AR_MUL && op <= AR_BOR) ps->depth--;
+    else if (op == AR_POP || op == AR_JZ || op == AR_JNZ) ps->depth--;
+    if (ps->depth > pr->max_stack) pr->max_stack = ps->depth;
+
+    pr->code[pr->ncode].op = op;
+    pr->code[pr->ncode].arg = arg;
+    return pr->ncode++;
+}
+
+int arith_name(struct arith_parser *ps, const char *name, size_t len) {
+    struct arith_prog *pr = ps->prog;
+    for (int i = 0; i < pr->nnames; i++) {
+        if (strlen(pr->names[i]) == len && strncmp(pr->names[i], name, len) == 0) return i;
+    }
+    pr->names = realloc(pr->names, (pr->nnames + 1) * sizeof(char *));
+    if (!pr->names || !(pr->names[pr->nnames] = strndup(name, len))) {
+        fprintf(stderr, "mysh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    return pr->nnames++;
+}
+
+void arith_skip_space(struct arith_parser *ps) {
+    while (isspace((unsigned char)*ps->p)) ps->p++;
+}
+
+// Consumes op if it comes next and isn't the prefix of a longer operator
+// listed in notbefore (so "<" doesn't match "<<" or "<=").
+int arith_accept(struct arith_parser *ps, const char *op, const char *notbefore) {
+    arith_skip_space(ps);
+    size_t n = strlen(op);
+    if (strncmp(ps->p, op, n) != 0) return 0;
+    if (notbefore && ps->p[n] != '\0' && strchr(notbefore, ps->p[n])) return 0;
+    ps->p += n;
+    return 1;
+}
+
+void arith_expr(struct arith_parser *ps);
+void arith_assign(struct arith_parser *ps);
+void arith_ternary(struct arith_parser *ps);
+void arith_unary(struct arith_parser *ps);
+
+void arith_primary(struct arith_parser *ps) {
+    arith_skip_space(ps);
+    const char *s = ps->p;
+
+    if (*s == '(') {
+        ps->p++;
+        arith_expr(ps);
+        if (!arith_accept(ps, ")", NULL) && !ps->error) ps->error = "missing ')'";
+        return;
+    }
+    if (isdigit((unsigned char)*s)) {
+        char *end;
+        int64_t v = (int64_t)strtoull(s, &end, 0); // 0x.. hex, 0.. octal, decimal
+        if (*end == '#') { // base#digits
+            long base = strtol(s, NULL, 10);
+            if (base < 2 || base > 36) {
+                ps->error = "invalid arithmetic base";
+                return;
+            }
+            v = (int64_t)strtoull(end + 1, &end, base);
+        }
+        if (isalnum((unsigned char)*end) || *end == '_') {
+            ps->error = "value too great for base";
+            return;
+        }
+        ps->p = end;
+        arith_emit(ps, AR_PUSH, v);
+        return;
+    }
+    if (*s == '$') s++; // $name means the same as name here
+    if (isalpha((unsigned char)*s) || *s == '_') {
+        const char *name = s;
+        while (isalnum((unsigned char)*s) || *s == '_') s++;
+        int idx = arith_name(ps, name, s - name);
+        ps->p = s;
+        arith_emit(ps, AR_LOAD, idx);
+        // Postfix ++/--: leave the old value, store the new one
+        if (arith_accept(ps, "++", NULL) || arith_accept(ps, "--", NULL)) {
+            int op = ps->p[-1] == '+' ? AR_ADD : AR_SUB;
+            arith_emit(ps, AR_DUP, 0);
+            arith_emit(ps, AR_PUSH, 1);
+            arith_emit(ps, op, 0);
+            arith_emit(ps, AR_STORE, idx);
+            arith_emit(ps, AR_POP, 0);
+        }
+        return;
+    }
+    ps->error = *s ? "syntax error: operand expected" : "syntax error: unexpected end of expression";
+}
+
+void arith_unary(struct arith_parser *ps) {
+    arith_skip_space(ps);
+    if (ps->error) return;
+
+    // Prefix ++/-- on a variable
+    if ((ps->p[0] == '+' && ps->p[1] == '+') || (ps->p[0] == '-' && ps->p[1] == '-')) {
+        int op = ps->p[0] == '+' ? AR_ADD : AR_SUB;
+        const char *s = ps->p + 2;
+        while (isspace((unsigned char)*s)) s++;
+        if (*s == '$') s++;
+        const char *name = s;
+        while (isalnum((unsigned char)*s) || *s == '_') s++;
+        if (s == name || isdigit((unsigned char)*name)) {
+            ps->error = "syntax error: variable expected after ++/--";
+            return;
+        }
+        int idx = arith_name(ps, name, s - name);
+        ps->p = s;
+        arith_emit(ps, AR_LOAD, idx);
+        arith_emit(ps, AR_PUSH, 1);
+        arith_emit(ps, op, 0);
+        arith_emit(ps, AR_STORE, idx);
+        return;
+    }
+    if (arith_accept(ps, "-", NULL)) {
+        arith_unary(ps);
+        arith_emit(ps, AR_NEG, 0);
+    } else if (arith_accept(ps, "+", NULL)) {
+        arith_unary(ps);
+    } else if (arith_accept(ps, "!", NULL)) {
+        arith_unary(ps);
+        arith_emit(ps, AR_NOT, 0);
+    } else if (arith_accept(ps, "~", NULL)) {
+        arith_unary(ps);
+        arith_emit(ps, AR_BNOT, 0);
+    } else {
+        arith_primary(ps);
+    }
+}
+
+// Binary operators by precedence level, lowest last. Each entry is the
+// operator text, what may not follow it, and its opcode.
+struct arith_binop {
+    const char *text, *notbefore;
+    int op;
+};
+
+const struct arith_binop arith_levels[][4] = {
+    {{"*", "=", AR_MUL}, {"/", "=", AR_DIV}, {"%", "=", AR_MOD}, {NULL, NULL, 0}},
+    {{"+", "=+", AR_ADD}, {"-", "=-", AR_SUB}, {NULL, NULL, 0}},
+    {{"<<", "=", AR_SHL}, {">>", "=", AR_SHR}, {NULL, NULL, 0}},
+    {{"<=", NULL, AR_LE}, {">=", NULL, AR_GE}, {"<", "<=", AR_LT}, {">", ">=", AR_GT}},
+    {{"==", NULL, AR_EQ}, {"!=", NULL, AR_NE}, {NULL, NULL, 0}},
+    {{"&", "&=", AR_BAND}, {NULL, NULL, 0}},
+    {{"^", "=", AR_BXOR}, {NULL, NULL, 0}},
+    {{"|", "|=", AR_BOR}, {NULL, NULL, 0}},
+};
+#define ARITH_NLEVELS ((int)(sizeof(arith_levels) / sizeof(arith_levels[0])))
+
+void arith_binary(struct arith_parser *ps, int level) {
+    if (level < 0) {
+        arith_unary(ps);
+        return;
+    }
+    arith_binary(ps, level - 1);
+    for (;;) {
+        if (ps->error) return;
+        const struct arith_binop *match = NULL;
+        for (int k = 0; k < 4 && arith_levels[level][k].text; k++) {
+            if (arith_accept(ps, arith_levels[level][k].text, arith_levels[level][k].notbefore)) {
+                match = &arith_levels[level][k];
+                break;
+            }
+        }
+        if (!match) return;
+        arith_binary(ps, level - 1);
+        arith_emit(ps, match->op, 0);
+    }
+}
+
+// && and || short-circuit: the right operand is jumped over when the left
+// one already decides the result.
+void arith_logand(struct arith_parser *ps) {
+    arith_binary(ps, ARITH_NLEVELS - 1);
+    while (!ps->error && arith_accept(ps, "&&", NULL)) {
+        int jz = arith_emit(ps, AR_JZ, 0);
+        arith_binary(ps, ARITH_NLEVELS - 1);
+        arith_emit(ps, AR_BOOL, 0);
+        int jmp = arith_emit(ps, AR_JMP, 0);
+        ps->depth--; // Only one of the two branches pushes a result
+        ps->prog->code[jz].arg = arith_emit(ps, AR_PUSH, 0);
+        ps->prog->code[jmp].arg = ps->prog->ncode;
+    }
+}
+
+void arith_logor(struct arith_parser *ps) {
+    arith_logand(ps);
+    while (!ps->error && arith_accept(ps, "||", NULL)) {
+        int jnz = arith_emit(ps, AR_JNZ, 0);
+        arith_logand(ps);
+        arith_emit(ps, AR_BOOL, 0);
+        int jmp = arith_emit(ps, AR_JMP, 0);
+        ps->depth--;
+        ps->prog->code[jnz].arg = arith_emit(ps, AR_PUSH, 1);
+        ps->prog->code[jmp].arg = ps->prog->ncode;
+    }
+}
+
+void arith_ternary(struct arith_parser *ps) {
+    arith_logor(ps);
+    if (ps->error || !arith_accept(ps, "?", NULL)) return;
+    int jz = arith_emit(ps, AR_JZ, 0);
+    arith_expr(ps);
+    int jmp = arith_emit(ps, AR_JMP, 0);
+    if (!arith_accept(ps, ":", NULL)) {
+        if (!ps->error) ps->error = "expected ':' in conditional expression";
+        return;
+    }
+    ps->depth--;
+    ps->prog->code[jz].arg = ps->prog->ncode;
+    arith_ternary(ps);
+    ps->prog->code[jmp].arg = ps->prog->ncode;
+}
+
+void arith_assign(struct arith_parser *ps) {
+    static const struct { const char *text; int op; } assign_ops[] = {
+        {"=", -1}, {"*=", AR_MUL}, {"/=", AR_DIV}, {"%=", AR_MOD}, {"+=", AR_ADD},
+        {"-=", AR_SUB}, {"<<=", AR_SHL}, {">>=", AR_SHR}, {"&=", AR_BAND},
+        {"^=", AR_BXOR}, {"|=", AR_BOR},
+    };
+    arith_skip_space(ps);
+    const char *s = ps->p;
+    if (*s == '$') s++;
+    if (isalpha((unsigned char)*s) || *s == '_') {
+        const char *name = s;
+        while (isalnum((unsigned char)*s) || *s == '_') s++;
+        size_t namelen = s - name;
+        while (isspace((unsigned char)*s)) s++;
+        for (size_t k = 0; k < sizeof(assign_ops) / sizeof(assign_ops[0]); k++) {
+            size_t n = strlen(assign_ops[k].text);
+            if (strncmp(s, assign_ops[k].text, n) != 0 || s[n] == '=') continue;
+            int idx = arith_name(ps, name, namelen);
+            ps->p = s + n;
+            if (assign_ops[k].op >= 0) arith_emit(ps, AR_LOAD, idx);
+            arith_assign(ps);
+            if (assign_ops[k].op >= 0) arith_emit(ps, assign_ops[k].op, 0);
+            arith_emit(ps, AR_STORE, idx);
+            return;
+        }
+    }
+    arith_ternary(ps);
+}
+
+void arith_expr(struct arith_parser *ps) {
+    arith_assign(ps);
+    while (!ps->error && arith_accept(ps, ",", NULL)) {
+        arith_emit(ps, AR_POP, 0);
+        arith_assign(ps);
+    }
+}
+
+// Returns the compiled program for src, compiling and caching it on first
+// use. Returns NULL and prints a message if src doesn't parse.
+void arith_free(struct arith_prog *pr) {
+    for (int i = 0; i < pr->nnames; i++) free(pr->names[i]);
+    free(pr->names);
+    free(pr->code);
+    free(pr->src);
+    free(pr);
+}
+
+void arith_cache_retire(void) {
+    while (arith_retired) {
+        struct arith_prog *next = arith_retired->next;
+        arith_free(arith_retired);
+        arith_retired = next;
+    }
+    for (int i = 0; i < ARITH_CACHE_SIZE; i++) {
+        while (arith_cache[i]) {
+            struct arith_prog *pr = arith_cache[i];
+            arith_cache[i] = pr->next;
+            pr->next = arith_retired;
+            arith_retired = pr;
+        }
+    }
+    arith_cached = 0;
+}
+
+struct arith_prog *arith_compile(const char *src) {
+    size_t len = strlen(src);
+    uint64_t h = hash_bytes(src, len);
+    struct arith_prog **bucket = &arith_cache[h % ARITH_CACHE_SIZE];
+    for (struct arith_prog *pr = *bucket; pr; pr = pr->next) {
+        if (strcmp(pr->src, src) == 0) return pr;
+    }
+
+    struct arith_prog *pr = calloc(1, sizeof(*pr));
+    if (!pr || !(pr->src = strdup(src))) {
+        fprintf(stderr, "mysh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    struct arith_parser ps = {src, pr, NULL, 0};
+    arith_skip_space(&ps);
+    if (*ps.p == '\0') {
+        arith_emit(&ps, AR_PUSH, 0); // $(( )) is 0
+    } else {
+        arith_expr(&ps);
+        arith_skip_space(&ps);
+        if (!ps.error && *ps.p != '\0') ps.error = "syntax error in expression";
+    }
+    if (ps.error) {
+        fprintf(stderr, "mysh: %s: %s\n", src, ps.error);
+        arith_free(pr);
+        return NULL;
+    }
+    if (arith_cached == ARITH_CACHE_MAX) arith_cache_retire();
+    pr->next = *bucket;
+    *bucket = pr;
+    arith_cached++;
+    return pr;
+}
+
+int64_t arith_get(const char *name) {
+    const char *v = var_get(name);
+    if (v == NULL || *v == '\0') return 0;
+    return (int64_t)strtoll(v, NULL, 0);
+}
+
+void arith_set(const char *name, int64_t value) {
+    char num[32];
+    snprintf(num, sizeof(num), "%lld", (long long)value);
+    var_set(name, num);
+}
+
+// Runs a compiled program. Returns 0 and sets *result, or -1 on an error
+// such as division by zero.
+int arith_run(struct arith_prog *pr, int64_t *result) {
+    int64_t stack_small[32];
+    int64_t *stack = pr->max_stack <= 32 ? stack_small : malloc(pr->max_stack * sizeof(int64_t));
+    int sp = 0, pc = 0, status = 0;
+    if (!stack) {
+        fprintf(stderr, "mysh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    while (pc < pr->ncode) {
+        struct arith_insn *in = &pr->code[pc++];
+        int64_t a, b;
+        if (in->op >= AR_MUL && in->op <= AR_BOR) {
+            b = stack[--sp];
+            a = stack[sp - 1];
+            uint64_t ua = (uint64_t)a, ub = (uint64_t)b; // Wrap instead of overflow UB
+            switch (in->op) {
+            case AR_MUL: a = (int64_t)(ua * ub); break;
+            case AR_DIV:
+            case AR_MOD:
+                if (b == 0) {
+                    fprintf(stderr, "mysh: %s: division by 0\n", pr->src);
+                    status = -1;
+                    goto done;
+                }
+                if (b == -1) a = in->op == AR_DIV ? (int64_t)(0 - ua) : 0;
+                else a = in->op == AR_DIV ? a / b : a % b;
+                break;
+            case AR_ADD: a = (int64_t)(ua + ub); break;
+            case AR_SUB: a = (int64_t)(ua - ub); break;
+            case AR_SHL: a = (int64_t)(ua << (ub & 63)); break;
+            case AR_SHR: a = a >> (ub & 63); break;
+            case AR_LT: a = a < b; break;
+            case AR_LE: a = a <= b; break;
+            case AR_GT: a = a > b; break;
+            case AR_GE: a = a >= b; break;
+            case AR_EQ: a = a == b; break;
+            case AR_NE: a = a != b; break;
+            case AR_BAND: a = a & b; break;
+            case AR_BXOR: a = a ^ b; break;
+            case AR_BOR: a = a | b; break;
+            }
+            stack[sp - 1] = a;
+            continue;
+        }
+        switch (in->op) {
+        case AR_PUSH: stack[sp++] = in->arg; break;
+        case AR_LOAD: stack[sp++] = arith_get(pr->names[in->arg]); break;
+        case AR_STORE: arith_set(pr->names[in->arg], stack[sp - 1]); break;
+        case AR_POP: sp--; break;
+        case AR_DUP: stack[sp] = stack[sp - 1]; sp++; break;
+        case AR_NEG: stack[sp - 1] = (int64_t)(0 - (uint64_t)stack[sp - 1]); break;
+        case AR_NOT: stack[sp - 1] = !stack[sp - 1]; break;
+        case AR_BNOT: stack[sp - 1] = ~stack[sp - 1]; break;
+        case AR_BOOL: stack[sp - 1] = stack[sp - 1] != 0; break;
+        case AR_JZ: if (stack[--sp] == 0) pc = in->arg; break;
+        case AR_JNZ: if (stack[--sp] != 0) pc = in->arg; break;
+        case AR_JMP: pc = in->arg; break;
+        }
+    }
+    *result = stack[sp - 1];
+done:
+    if (stack != stack_small) free(stack);
+    return status;
+}
+
+// Evaluates the text between "$((" and "))" and returns the result as a
+// string in the line arena, or NULL on error.
+char *arith_expand(const char *src) {
+    struct arith_prog *pr = arith_compile(src);
+    int64_t value;
+    if (pr == NULL || arith_run(pr, &value) != 0) {
+        last_exit_status = 1;
+        expand_error = 1;
+        return NULL;
+    }
+    char num[32];
+    int n = snprintf(num, sizeof(num), "%lld", (long long)value);
+    return arena_strndup(&line_arena, num, n);
+}
+
+// Command substitution: $( ... ) and ` ... `, plus $(( ... )) arithmetic.
+
+// Runs cmdline with standard output pointed at an in-memory file and
+// returns what it wrote, in the line arena. Builtins write straight into the
+// memfd from this process, so $(pwd) or $(echo ...) never fork. External
+// commands inherit the memfd as their stdout, so there is no pipe to drain
+// while we wait. The result is collected with one large read at the end.
+char *capture_output(char *cmdline, size_t *len) {
+    int fd = memfd_create("mysh-subst", MFD_CLOEXEC);
+    if (fd < 0) fd = open("/tmp", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        perror("mysh: command substitution");
+        *len = 0;
+        return "";
+    }
+
+    char **args = split_line(cmdline);
+
+    fflush(stdout);
+    int saved_stdout = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, SHELL_FD_BASE);
+    dup2(fd, STDOUT_FILENO);
+    struct snapshot snap; // Like ( ... ), nothing it changes outlives it
+    int outer_error = expand_error; // The inner commands expand words of their own
+    snapshot_begin(&snap);
+    execute_list(args);
+    snapshot_end(&snap);
+    expand_error = outer_error;
+    subst_status = last_exit_status;
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    free(args);
+
+    struct stat st;
+    size_t size = fstat(fd, &st) == 0 ? st.st_size : 0;
+    char *buf = arena_alloc(&line_arena, size + 1);
+    size_t got = 0;
+    while (got < size) {
+        ssize_t n = pread(fd, buf + got, size - got, got);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            break;
+        }
+        got += n;
+    }
+    close(fd);
+
+    while (got > 0 && buf[got - 1] == '\n') got--; // Strip trailing newlines
+    buf[got] = '\0';
+    *len = got;
+    return buf;
+}
+
+// bench [-n N] [-w W] cmd...: times each command line N times through
+// the usual parse and execute path, after W untimed warmup runs. Every run
+// is undone like ( ... ) and its standard output is thrown away. With more
+// than one command line, the fastest is compared with each of the others.
+#define BENCH_RUNS 10
+
+struct bench_result {
+    char *cmd;
+    double *t; // Wall time of each run in seconds, sorted
+    int n;
+    double mean, var; // var is the sample variance
+    double user, sys; // CPU seconds per run, the shell and its children
+    int failed;       // Last non-zero exit status, or 0
+};
+
+// Square root by Newton's method, which keeps the shell off libm.
+double bench_sqrt(double x) {
+    if (x <= 0) return 0;
+    double r = x > 1 ? x : 1;
+    for (int i = 0; i < 128; i++) {
+        double next = (r + x / r) / 2;
+        if (next >= r) break;
+        r = next;
+    }
+    return r;
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+double timespec_seconds(struct timespec t) {
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+double timeval_seconds(struct timeval t) {
+    return t.tv_sec + t.tv_usec / 1e6;
+}
+
+double rusage_cpu(int user) {
+    struct rusage self, kids;
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &kids);
+    return user ? timeval_seconds(self.ru_utime) + timeval_seconds(kids.ru_utime)
+                : timeval_seconds(self.ru_stime) + timeval_seconds(kids.ru_stime);
+}
+
+// Formats a duration with a unit that keeps it readable.
+char *bench_time(double t, char *buf, size_t size) {
+    if (t < 1e-3) snprintf(buf, size, "%.1f us", t * 1e6);
+    else if (t < 1) snprintf(buf, size, "%.3f ms", t * 1e3);
+    else snprintf(buf, size, "%.3f s", t);
+    return buf;
+}
+
+// Runs cmd once with its output discarded. Returns its wall time.
+double bench_run(char *cmd, int devnull, int *failed) {
+    struct arena_mark mark = arena_mark(&line_arena);
+    char **args = split_line(cmd);
+    fflush(stdout);
+    int saved_stdout = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, SHELL_FD_BASE);
+    dup2(devnull, STDOUT_FILENO);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct snapshot snap;
+    snapshot_begin(&snap);
+    execute_list(args);
+    snapshot_end(&snap);
+    fflush(stdout);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    free(args);
+    arena_release(&line_arena, mark);
+    if (last_exit_status != 0) *failed = last_exit_status;
+    return timespec_seconds(end) - timespec_seconds(start);
+}
+
+// The two-sided 5% critical value of Student's t with df degrees of freedom.
+double t_critical(double df) {
+    static const double table[] = {
+        12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+        2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+        2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+    };
+    if (df < 1) df = 1;
+    if (df <= 30) return table[(int)df - 1]; // Rounding df down errs on the safe side
+    if (df <= 40) return 2.021;
+    if (df <= 60) return 2.000;
+    if (df <= 120) return 1.980;
+    return 1.960;
+}
+
+void bench_report(struct bench_result *r, int warmup) {
+    char a[32], b[32], c[32], d[32], e[32];
+    printf("bench: %s (%d runs, %d warmup)\n", r->cmd, r->n, warmup);
+    printf("  mean %s +/- %s   user %s   sys %s\n", bench_time(r->mean, a, sizeof(a)),
+           bench_time(bench_sqrt(r->var), b, sizeof(b)), bench_time(r->user, c, sizeof(c)),
+           bench_time(r->sys, d, sizeof(d)));
+    // Nearest-rank percentiles
+    int p95 = (r->n * 95 + 99) / 100 - 1, p99 = (r->n * 99 + 99) / 100 - 1;
+    printf("  min %s   p50 %s   p95 %s   p99 %s   max %s\n", bench_time(r->t[0], a, sizeof(a)),
+           bench_time(r->t[(r->n - 1) / 2], b, sizeof(b)), bench_time(r->t[p95], c, sizeof(c)),
+           bench_time(r->t[p99], d, sizeof(d)), bench_time(r->t[r->n - 1], e, sizeof(e)));
+    if (r->failed) printf("  warning: exited with status %d\n", r->failed);
+}
+
+// Compares the fastest command with another by Welch's t-test, which does
+// not assume the two have the same variance.
+void bench_compare(struct bench_result *fast, struct bench_result *r) {
+    double se2 = fast->var / fast->n + r->var / r->n;
+    printf("  %.2fx faster than %s", fast->mean > 0 ? r->mean / fast->mean : 0.0, r->cmd);
+    if (fast->n < 2 || r->n < 2) {
+        printf(" (too few runs to test)\n");
+        return;
+    }
+    double diff = r->mean - fast->mean;
+    if (se2 == 0) {
+        printf(" (%s)\n", diff != 0 ? "significant, no variance" : "not significant");
+        return;
+    }
+    double df = se2 * se2 / (fast->var * fast->var / ((double)fast->n * fast->n * (fast->n - 1)) +
+                             r->var * r->var / ((double)r->n * r->n * (r->n - 1)));
+    double t = diff / bench_sqrt(se2), crit = t_critical(df);
+    printf(" (t = %.2f, df = %.1f, %s at p < 0.05)\n", t, df, t * t > crit * crit ? "significant" : "not significant");
+}
+
+int mysh_bench(char **args) {
+    int runs = BENCH_RUNS, warmup = 0, i = 1;
+    for (; args[i] && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        int *opt = strcmp(args[i], "-n") == 0 ? &runs : strcmp(args[i], "-w") == 0 ? &warmup : NULL;
+        char *end;
+        long v = opt && args[i + 1] ? strtol(args[i + 1], &end, 10) : -1;
+        if (opt == NULL || v < (opt == &runs) || *end != '\0' || v > 1000000) {
+            fprintf(stderr, "mysh: bench: usage: bench [-n runs] [-w warmup] command...\n");
+            last_exit_status = 2;
+            return 1;
+        }
+        *opt = (int)v;
+        i++;
+    }
+    int ncmds = 0;
+    while (args[i + ncmds] != NULL) ncmds++;
+    if (ncmds == 0) {
+        fprintf(stderr, "mysh: bench: usage: bench [-n runs] [-w warmup] command...\n");
+        last_exit_status = 2;
+        return 1;
+    }
+
+    int devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    struct bench_result *res = calloc(ncmds, sizeof(*res));
+    if (devnull < 0 || !res) {
+        perror("mysh: bench");
+        free(res);
+        if (devnull >= 0) close(devnull);
+        last_exit_status = 1;
+        return 1;
+    }
+    int fastest = 0, failed = 0;
+    for (int c = 0; c < ncmds; c++) {
+        struct bench_result *r = &res[c];
+        r->cmd = args[i + c];
+        r->n = runs;
+        r->t = malloc(runs * sizeof(double));
+        if (!r->t) {
+            fprintf(stderr, "mysh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        for (int k = 0; k < warmup; k++) bench_run(r->cmd, devnull, &r->failed);
+        double user = rusage_cpu(1), sys = rusage_cpu(0);
+        for (int k = 0; k < runs; k++) r->t[k] = bench_run(r->cmd, devnull, &r->failed);
+        r->user = (rusage_cpu(1) - user) / runs;
+        r->sys = (rusage_cpu(0) - sys) / runs;
+
+        for (int k = 0; k < runs; k++) r->mean += r->t[k] / runs;
+        for (int k = 0; k < runs && runs > 1; k++) r->var += (r->t[k] - r->mean) * (r->t[k] - r->mean) / (runs - 1);
+        qsort(r->t, runs, sizeof(double), compare_doubles);
+        bench_report(r, warmup);
+        if (r->mean < res[fastest].mean) fastest = c;
+        if (r->failed) failed = 1;
+    }
+    if (ncmds > 1) {
+        printf("summary: %s ran fastest\n", res[fastest].cmd);
+        for (int c = 0; c < ncmds; c++) {
+            if (c != fastest) bench_compare(&res[fastest], &res[c]);
+        }
+    }
+    for (int c = 0; c < ncmds; c++) free(res[c].t);
+    free(res);
+    close(devnull);
+    last_exit_status = failed;
+    return 1;
+}
+
+// Finds the ')' matching the '(' at word[open], counting parentheses only,
+// as in arithmetic. Returns its index, or -1.
+int find_paren_end(const char *word, int open) {
+    int depth = 0;
+    for (int i = open; word[i] != '\0'; i++) {
+        if (word[i] == '(') depth++;
+        else if (word[i] == ')' && --depth == 0) return i;
+    }
+    return -1;
+}
+
+// Returns the index just past the part of a word at s[i]: a quoted string,
+// an escaped byte, a substitution or a single byte. Returns -1 if it is
+// unterminated.
+int skip_word_part(const char *s, int i) {
+    const char *q;
+    int end;
+    switch (s[i]) {
+    case '\\':
+        return s[i + 1] ? i + 2 : -1;
+    case '\'':
+        q = strchr(s + i + 1, '\'');
+        return q ? q - s + 1 : -1;
+    case '"':
+        for (i++; s[i] != '"'; ) {
+            if (s[i] == '\0') return -1;
+            if (s[i] == '\\' || s[i] == '$' || s[i] == '`') i = skip_word_part(s, i);
+            else i++;
+            if (i < 0) return -1;
+        }
+        return i + 1;
+    case '`':
+        end = find_backtick_end(s, i);
+        return end < 0 ? -1 : end + 1;
+    case '$':
+        if (s[i + 1] == '(') end = find_subst_end(s, i + 1);
+        else if (s[i + 1] == '{') end = find_brace_end(s, i + 1);
+        else return i + 1;
+        return end < 0 ? -1 : end + 1;
+    }
+    return i + 1;
+}
+
+// Finds the ')' closing the '(' at s[open] that holds commands, reading
+// them as the lexer does: quotes, escapes and substitutions are skipped
+// whole, and compound commands are followed so that the ')' ending a case
+// pattern is not taken for it. Returns its index, or -1.
+int find_commands_end(const char *s, int open) {
+    struct nesting ns;
+    nesting_init(&ns);
+    char tok[8]; // Keywords and operators are short; longer words are just words
+    char *toks[] = {tok};
+    for (int i = open + 1; s[i] != '\0';) {
+        char c = s[i];
+        if (c == ' ' || c == '\t') {
+            i++;
+            continue;
+        }
+        if (c == ')' && ns.depth == 0 && ns.fn != 2) return i;
+        int end = i + 1;
+        if (strchr(";&|", c)) {
+            if (s[end] == c) end++; // ;; && ||
+        } else if (!strchr("\n()", c)) {
+            for (end = i; s[end] != '\0' && !strchr(" \t\n;&|()", s[end]); end = skip_word_part(s, end)) {
+                if (end < 0) return -1;
+            }
+        }
+        int n = end - i < (int)sizeof(tok) ? end - i : 0;
+        memcpy(tok, s + i, n);
+        tok[n] = '\0';
+        nesting_feed(&ns, toks, 0, 1);
+        i = end;
+    }
+    return -1;
+}
+
+// Finds the ')' closing the "$(" at word[open], or the "))" of "$((".
+// Returns its index, or -1.
+int find_subst_end(const char *word, int open) {
+    if (word[open + 1] == '(') {
+        int end = find_paren_end(word, open);
+        if (end > 0 && find_paren_end(word, open + 1) == end - 1) return end; // Arithmetic
+    }
+    return find_commands_end(word, open);
+}
+
+// Finds the '`' closing the one at word[open]. Returns its index, or -1.
+int find_backtick_end(const char *word, int open) {
+    for (int i = open + 1; word[i] != '\0'; i++) {
+        if (word[i] == '\\' && word[i + 1] != '\0') i++;
+        else if (word[i] == '`') return i;
+    }
+    return -1;
+}
+
+// Evaluates the expansion starting at word[i]: $name, ${...}, $((...)),
+// $(...) or `...`. Sets *next to the index just past it. Returns NULL if it is
+// unterminated.
+char *run_substitution(char *word, int i, int *next, size_t *len) {
+    char *inner;
+    int namelen = param_name_len(word + i + 1);
+    if (word[i] == '$' && namelen > 0) {
+        char *name = arena_strndup(&line_arena, word + i + 1, namelen);
+        char *value = lookup_param(name);
+        *next = i + 1 + namelen;
+        *len = value ? strlen(value) : 0;
+        return arena_strndup(&line_arena, value ? value : "", *len); // Callers may split it in place
+    }
+    if (word[i] == '$' && word[i + 1] == '{') {
+        int close = find_brace_end(word, i + 1);
+        if (close < 0) return NULL;
+        inner = arena_strndup(&line_arena, word + i + 2, close - i - 2);
+        *next = close + 1;
+        char *value = param_expand(inner);
+        if (value == NULL) {
+            expand_error = 1; // A bad substitution or ${name:?word}
+            value = "";
+        }
+        *len = strlen(value);
+        return arena_strndup(&line_arena, value, *len); // Callers may split it in place
+    }
+    if (word[i] == '$') {
+        int close = find_subst_end(word, i + 1);
+        if (close < 0) return NULL;
+        if (word[i + 2] == '(' && find_paren_end(word, i + 2) == close - 1) {
+            // $(( ... )) is arithmetic, not a command
+            inner = arena_strndup(&line_arena, word + i + 3, close - i - 4);
+            *next = close + 1;
+            // Plain $name is left to the compiler so the cached program
+            // stays valid whatever the value; other expansions go first.
+            for (char *p = strpbrk(inner, "$`"); p != NULL; p = strpbrk(p + 1, "$`")) {
+                if (starts_expansion(p) && !(p[0] == '$' && (isalpha((unsigned char)p[1]) || p[1] == '_'))) {
+                    inner = expand_text(inner);
+                    break;
+                }
+            }
+            char *value = arith_expand(inner);
+            if (value == NULL) value = arena_strndup(&line_arena, "", 0);
+            *len = strlen(value);
+            return value;
+        }
+        inner = arena_strndup(&line_arena, word + i + 2, close - i - 2);
+        *next = close + 1;
+    } else {
+        int close = find_backtick_end(word, i);
+        if (close < 0) return NULL;
+        // Inside backticks a backslash only escapes `, \ and $
+        inner = arena_alloc(&line_arena, close - i);
+        int n = 0;
+        for (int k = i + 1; k < close; k++) {
+            if (word[k] == '\\' && strchr("`\\$", word[k + 1])) k++;
+            inner[n++] = word[k];
+        }
+        inner[n] = '\0';
+        *next = close + 1;
+    }
+    return capture_output(inner, len);
+}
+
+// Length of the parameter name in a $name reference starting at s (just
+// after the '$'): a variable name, one digit or one special character.
+int param_name_len(const char *s) {
+    if (isalpha((unsigned char)s[0]) || s[0] == '_') {
+        int n = 1;
+        while (isalnum((unsigned char)s[n]) || s[n] == '_') n++;
+        return n;
+    }
+    if (s[0] != '\0' && (isdigit((unsigned char)s[0]) || strchr("?$#!@*-", s[0]))) return 1;
+    return 0;
+}
+
+// True if an expansion starts at s.
+int starts_expansion(const char *s) {
+    if (s[0] == '`') return 1;
+    return s[0] == '$' && (s[1] == '(' || s[1] == '{' || param_name_len(s + 1) > 0);
+}
+
+const char *current_ifs(void) {
+    const char *ifs = var_get("IFS");
+    return ifs ? ifs : " \t\n";
+}
+
+int is_ifs(const char *ifs, char c) {
+    return c != '\0' && strchr(ifs, c) != NULL;
+}
+
+// Splits buf in place at IFS characters and pushes each field. Used when a
+// whole word is one unquoted substitution: fields point into the captured
+// buffer, so nothing is copied. Fields with wildcards are globbed.
+void split_fields_in_place(struct argv_builder *out, char *buf, size_t len) {
+    const char *ifs = current_ifs();
+    size_t i = 0;
+    while (i < len) {
+        while (i < len && is_ifs(ifs, buf[i])) i++;
+        if (i == len) break;
+        char *field = buf + i;
+        while (i < len && !is_ifs(ifs, buf[i])) i++;
+        buf[i++] = '\0';
+        if (has_glob_meta(field)) glob_push(out, field, field);
+        else argv_push(out, field);
+    }
+}
+
+#define EXPAND_SPLIT 1   // Split unquoted results into fields and glob them
+#define EXPAND_PATTERN 2 // Escape quoted pattern characters with '\'
+#define EXPAND_HEREDOC 4 // A here-document body: quotes are ordinary text
+
+// A field being built by expand_word(). quoted runs parallel to text and
+// marks the bytes that came from quotes, escapes or quoted expansions, so a
+// quoted '*' stays literal without scanning the word again.
+struct field {
+    struct strbuf text, quoted;
+    int have;   // Holds at least one byte
+    int quotes; // Saw quotes, so "" still makes a field
+    int none;   // Saw "$@" with nothing in it
+    int glob;   // Has an unquoted *, ? or [
+};
+
+void field_add(struct field *f, const char *data, size_t len, int quoted) {
+    strbuf_add(&f->text, data, len);
+    strbuf_add(&f->quoted, data, len);
+    memset(f->quoted.data + f->quoted.len - len, quoted, len);
+    f->have = 1;
+    for (size_t k = 0; k < len && !quoted && !f->glob; k++) {
+        f->glob = data[k] == '*' || data[k] == '?' || data[k] == '[';
+    }
+}
+
+// The field's text as a pattern: quoted pattern characters get a '\'.
+char *field_pattern(struct field *f) {
+    char *pat = arena_alloc(&line_arena, f->text.len * 2 + 1);
+    size_t n = 0;
+    for (size_t k = 0; k < f->text.len; k++) {
+        char c = f->text.data[k];
+        if (f->quoted.data[k] && c != '\0' && strchr("*?[]\\", c)) pat[n++] = '\\';
+        pat[n++] = c;
+    }
+    pat[n] = '\0';
+    return pat;
+}
+
+void field_end(struct field *f, struct argv_builder *out, int flags) {
+    if (f->have || (f->quotes && !f->none) || !(flags & EXPAND_SPLIT)) {
+        char *text = arena_strndup(&line_arena, f->text.data ? f->text.data : "", f->text.len);
+        if ((flags & EXPAND_SPLIT) && f->glob) glob_push(out, text, field_pattern(f));
+        else if (flags & EXPAND_PATTERN) argv_push(out, field_pattern(f));
+        else argv_push(out, text);
+    }
+    f->text.len = f->quoted.len = 0;
+    f->have = f->quotes = f->none = f->glob = 0;
+}
+
+// Collects the items of "$@", "${@}" or "${name[@]}" (or "${!name[@]}")
+// starting at word[i], each of which becomes a field of its own. Returns 0
+// if the expansion is something else.
+int expand_all_items(char *word, int i, int *next, struct argv_builder *items) {
+    if (word[i] != '$') return 0;
+    int close = i + 1;
+    char *inner = word + i + 1;
+    size_t n = 1;
+    if (word[i + 1] == '{') {
+        close = find_brace_end(word, i + 1);
+        if (close < 0) return 0;
+        inner = word + i + 2;
+        n = close - i - 2;
+    }
+    if (n == 1 && inner[0] == '@') {
+        for (int k = 0; k < npositional; k++) argv_push(items, positional[k]);
+        *next = close + 1;
+        return 1;
+    }
+    int keys = inner[0] == '!';
+    char *name = inner + keys;
+    int namelen = param_name_len(name);
+    if (word[i + 1] != '{' || namelen == 0 || !(isalpha((unsigned char)*name) || *name == '_') ||
+        n != (size_t)(keys + namelen + 3) || memcmp(name + namelen, "[@]", 3) != 0) {
+        return 0;
+    }
+    struct shell_array *a = array_lookup(arena_strndup(&line_arena, name, namelen));
+    if (a == NULL) return 0;
+    array_push_all(a, items, keys);
+    *next = close + 1;
+    return 1;
+}
+
+// Expands one word in a single pass: quotes and backslashes are removed as
+// the bytes are copied, and the $ and ` constructs are evaluated. Results
+// inside double quotes are inserted as they are; with EXPAND_SPLIT unquoted
+// results are split into fields, the first joining the text before the
+// expansion and the last the text after it, and fields with unquoted
+// wildcards are globbed. Without it the word always yields one result.
+void expand_word(char *word, struct argv_builder *out, int flags) {
+    int split = flags & EXPAND_SPLIT;
+    size_t wlen = strlen(word);
+    int next;
+    size_t len;
+
+    if (!(flags & EXPAND_HEREDOC) && expand_array_word(word, out, split)) return;
+    if (split && ((word[0] == '$' && param_name_len(word + 1) == (int)wlen - 1) ||
+                  (word[0] == '$' && word[1] == '(' && find_subst_end(word, 1) == (int)wlen - 1) ||
+                  (word[0] == '$' && word[1] == '{' && find_brace_end(word, 1) == (int)wlen - 1) ||
+                  (word[0] == '`' && find_backtick_end(word, 0) == (int)wlen - 1))) {
+        char *buf = run_substitution(word, 0, &next, &len);
+        if (buf) {
+            split_fields_in_place(out, buf, len);
+            return;
+        }
+    }
+
+    const char *ifs = current_ifs();
+    struct field f = {{NULL, 0, 0}, {NULL, 0, 0}, 0, 0, 0, 0};
+    int in_dq = 0;
+    for (int i = 0; word[i] != '\0'; ) {
+        char c = word[i];
+        if (starts_expansion(word + i)) {
+            struct argv_builder items = {NULL, 0, 0};
+            argv_init(&items);
+            if (in_dq && expand_all_items(word, i, &next, &items)) {
+                i = next;
+                if (items.n == 0) f.none = 1;
+                for (int k = 0; k < items.n; k++) {
+                    if (k > 0) {
+                        field_end(&f, out, flags);
+                        f.quotes = 1;
+                    }
+                    field_add(&f, items.v[k], strlen(items.v[k]), 1);
+                }
+                free(items.v);
+                continue;
+            }
+            free(items.v);
+            char *buf = run_substitution(word, i, &next, &len);
+            if (buf == NULL) {
+                field_add(&f, word + i, strlen(word + i), 1); // Unterminated: keep the text
+                break;
+            }
+            i = next;
+            if (in_dq || !split) {
+                field_add(&f, buf, len, in_dq || (flags & EXPAND_HEREDOC));
+                continue;
+            }
+            for (size_t k = 0; k < len; ) {
+                if (is_ifs(ifs, buf[k])) {
+                    field_end(&f, out, flags);
+                    k++;
+                    continue;
+                }
+                size_t start = k;
+                while (k < len && !is_ifs(ifs, buf[k])) k++;
+                field_add(&f, buf + start, k - start, 0);
+            }
+            continue;
+        }
+        if (flags & EXPAND_HEREDOC) {
+            // Quotes are literal; a backslash only escapes $, `, \ and newline
+            if (c == '\\' && word[i + 1] != '\0' && strchr("$`\\\n", word[i + 1])) {
+                if (word[i + 1] != '\n') field_add(&f, word + i + 1, 1, 1);
+                i += 2;
+                continue;
+            }
+            field_add(&f, &c, 1, 1);
+            i++;
+            continue;
+        }
+        if (c == '\'' && !in_dq) {
+            int close = i + 1;
+            while (word[close] != '\0' && word[close] != '\'') close++;
+            field_add(&f, word + i + 1, close - i - 1, 1);
+            f.quotes = 1;
+            i = word[close] ? close + 1 : close;
+            continue;
+        }
+        if (c == '"') {
+            in_dq = !in_dq;
+            f.quotes = 1;
+            i++;
+            continue;
+        }
+        if (c == '\\' && word[i + 1] != '\0') {
+            // Inside double quotes a backslash only escapes $, `, ", \ and
+            // newline; elsewhere it escapes anything
+            if (in_dq && !strchr("$`\"\\\n", word[i + 1])) {
+                field_add(&f, &c, 1, 1);
+                i++;
+                continue;
+            }
+            if (word[i + 1] != '\n') field_add(&f, word + i + 1, 1, 1);
+            i += 2;
+            continue;
+        }
+        field_add(&f, &c, 1, in_dq);
+        i++;
+    }
+    field_end(&f, out, flags);
+    free(f.text.data);
+    free(f.quoted.data);
+}
+
+// True if word contains anything expand_word() would change.
+int needs_expansion(const char *word) {
+    return strpbrk(word, "$`'\"\\*?[") != NULL;
+}
+
+void expand_words(char ***args) {
+    int any = 0;
+    expand_error = 0;
+    for (int i = 0; (*args)[i] != NULL && !any; i++) {
+        any = needs_expansion((*args)[i]);
+    }
+    if (!any) return;
+
+    struct argv_builder out = {NULL, 0, 0};
+    argv_init(&out);
+    for (int i = 0; (*args)[i] != NULL; i++) {
+        char *word = (*args)[i];
+        if (!needs_expansion(word) || word[0] == HEREDOC_LITERAL) {
+            argv_push(&out, word);
+        } else if (is_heredoc_body(*args, i)) {
+            expand_word(word, &out, EXPAND_HEREDOC);
+        } else if (is_assignment_arg(*args, i)) {
+            // Assignments are neither split nor globbed; NAME=( ... )
+            // expands its words when it is assigned
+            if (word[assignment_lhs(word) + 1] == '(') argv_push(&out, word);
+            else expand_word(word, &out, 0);
+        } else {
+            expand_word(word, &out, EXPAND_SPLIT);
+        }
+    }
+    free(*args);
+    *args = out.v;
+}
+
+// True if args[i] is the body of a here-document, which is expanded as
+// one word and never globbed.
+int is_heredoc_body(char **args, int i) {
+    int fd;
+    return i > 0 && redirect_op(args[i - 1], &fd) == 'h';
+}
+
+// True if args[i] is an assignment the command performs itself: one of the
+// leading NAME=value words, or an operand of declare or export. These are
+// neither field split nor globbed.
+int is_assignment_arg(char **args, int i) {
+    if (!is_assignment(args[i])) return 0;
+    int cmd = 0;
+    while (cmd < i && is_assignment(args[cmd])) cmd++;
+    return cmd == i || strcmp(args[cmd], "declare") == 0 || strcmp(args[cmd], "typeset") == 0 ||
+           strcmp(args[cmd], "export") == 0;
+}
+
+// Writes s with echo -e's backslash escapes replaced. Returns 0 if it met
+// \c, which ends all output.
+int echo_escaped(const char *s) {
+    for (; *s; s++) {
+        if (*s != '\\' || s[1] == '\0') {
+            putchar(*s);
+            continue;
+        }
+        int c = *++s, digits = 0, value = 0;
+        switch (c) {
+        case 'a': putchar('\a'); break;
+        case 'b': putchar('\b'); break;
+        case 'c': return 0;
+        case 'e': case 'E': putchar('\033'); break;
+        case 'f': putchar('\f'); break;
+        case 'n': putchar('\n'); break;
+        case 'r': putchar('\r'); break;
+        case 't': putchar('\t'); break;
+        case 'v': putchar('\v'); break;
+        case '\\': putchar('\\'); break;
+        case '0':
+            // \0nnn: up to three octal digits
+            while (digits < 3 && s[1] >= '0' && s[1] <= '7') {
+                value = value * 8 + (*++s - '0');
+                digits++;
+            }
+            putchar(value);
+            break;
+        case 'x':
+            // \xHH: one or two hex digits
+            while (digits < 2 && isxdigit((unsigned char)s[1])) {
+                c = *++s;
+                value = value * 16 + (isdigit(c) ? c - '0' : (tolower(c) - 'a' + 10));
+                digits++;
+            }
+            if (digits) putchar(value);
+            else fputs("\\x", stdout);
+            break;
+        default:
+            putchar('\\');
+            putchar(c);
+        }
+    }
+    return 1;
+}
+
+int mysh_echo(char **args) {
+    int i = 1, newline = 1, escapes = 0;
+    // Options are words of n, e and E after a '-'; anything else is printed
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        if (strspn(args[i] + 1, "neE") != strlen(args[i] + 1)) break;
+        for (const char *o = args[i] + 1; *o; o++) {
+            if (*o == 'n') newline = 0;
+            else escapes = *o == 'e';
+        }
+    }
+    for (; args[i] != NULL; i++) {
+        if (!escapes) fputs(args[i], stdout);
+        else if (!echo_escaped(args[i])) return 1;
+        if (args[i + 1] != NULL) putchar(' ');
+    }
+    if (newline) putchar('\n');
+    last_exit_status = 0;
+    return 1;
+}
+
+int mysh_export(char **args) {
+    if (args[1] == NULL || strcmp(args[1], "-p") == 0) {
+        vars_load();
+        for (size_t i = 0; i < shell_vars.cap; i++) {
+            struct var *v = &shell_vars.slots[i];
+            if (v->name && (v->flags & VAR_EXPORT)) {
+                printf("export %s%s%s\n", v->name, v->value ? "=" : "", v->value ? v->value : "");
+            }
+        }
+        return 1;
+    }
+    for (int i = 1; args[i] != NULL; i++) {
+        char *eq = strchr(args[i], '=');
+        size_t len = eq ? (size_t)(eq - args[i]) : strlen(args[i]);
+        if (!is_name(args[i], len)) {
+            fprintf(stderr, "mysh: export: %s: not a valid identifier\n", args[i]);
+            last_exit_status = 1;
+            continue;
+        }
+        if (eq) {
+            *eq = '\0';
+            var_set(args[i], eq + 1);
+        }
+        var_export(args[i]);
+        if (eq) *eq = '=';
+    }
+    return 1;
+}
+
+int mysh_unset(char **args) {
+    for (int i = 1; args[i] != NULL; i++) {
+        size_t len = strlen(args[i]), namelen = strcspn(args[i], "[");
+        if (namelen < len && args[i][len - 1] == ']' && is_name(args[i], namelen)) {
+            // unset name[subscript] removes one element
+            char *name = arena_strndup(&line_arena, args[i], namelen);
+            struct var *v = var_find(name);
+            if (v == NULL || v->array == NULL) continue;
+            var_touch(v, 1);
+            array_remove(v->array, arena_strndup(&line_arena, args[i] + namelen + 1, len - namelen - 2));
+            continue;
+        }
+        if (!is_name(args[i], len)) {
+            fprintf(stderr, "mysh: unset: %s: not a valid identifier\n", args[i]);
+            last_exit_status = 1;
+            continue;
+        }
+        var_unset(args[i]);
+    }
+    return 1;
+}
+
+// Performs one assignment word: NAME=value, NAME[sub]=value, NAME=(word...)
+// and the NAME+=... forms of each. Returns 0 on success.
+int assign_word(char *word) {
+    size_t lhs = assignment_lhs(word);
+    int append = word[lhs - 1] == '+';
+    size_t namelen = strcspn(word, "[+=");
+    char *name = arena_strndup(&line_arena, word, namelen);
+    char *value = word + lhs + 1;
+    size_t vlen = strlen(value);
+
+    if (word[namelen] == '[') {
+        char *sub = arena_strndup(&line_arena, word + namelen + 1, lhs - append - namelen - 2);
+        struct shell_array *a = array_declare(name, 0);
+        struct slice *old = append ? array_fetch(a, sub) : NULL;
+        if (old) {
+            char *joined = arena_alloc(&line_arena, old->len + vlen + 1);
+            memcpy(joined, old->ptr, old->len);
+            memcpy(joined + old->len, value, vlen + 1);
+            value = joined;
+        }
+        return array_store(a, sub, value);
+    }
+
+    if (value[0] == '(' && vlen >= 2 && value[vlen - 1] == ')') {
+        // The words inside get the full expansion a command line gets
+        struct var *v = var_find(name);
+        int assoc = v && v->array && (v->array->flags & ARRAY_ASSOC);
+        struct shell_array *a = append ? array_declare(name, assoc) : array_reset(name, assoc);
+        char **words = split_line(arena_strndup(&line_arena, value + 1, vlen - 2));
+        expand_words(&words);
+        int status = 0;
+        for (int i = 0; words[i] != NULL; i++) {
+            if (strcmp(words[i], "\n") == 0) continue; // The list may span lines
+            char *close = words[i][0] == '[' ? strstr(words[i], "]=") : NULL;
+            if (close) {
+                // [subscript]=value
+                *close = '\0';
+                if (array_store(a, words[i] + 1, close + 2) != 0) status = -1;
+            } else if (assoc) {
+                fprintf(stderr, "mysh: %s: %s: must use subscript when assigning associative array\n", name, words[i]);
+                status = -1;
+            } else {
+                array_append(a, words[i]);
+            }
+        }
+        free(words);
+        return status;
+    }
+
+    if (append) {
+        char *old = lookup_param(name);
+        if (old) {
+            size_t oldlen = strlen(old);
+            char *joined = arena_alloc(&line_arena, oldlen + vlen + 1);
+            memcpy(joined, old, oldlen);
+            memcpy(joined + oldlen, value, vlen + 1);
+            value = joined;
+        }
+    }
+    var_set(name, value);
+    return 0;
+}
+
+// break [n] and continue [n]: leave, or go on with, the nth enclosing loop.
+int mysh_break(char **args) {
+    int n = args[1] ? atoi(args[1]) : 1;
+    if (n < 1) {
+        fprintf(stderr, "mysh: %s: %s: loop count out of range\n", args[0], args[1]);
+        last_exit_status = 1;
+        return 1;
+    }
+    if (loop_depth == 0) {
+        fprintf(stderr, "mysh: %s: only meaningful in a `for', `while', or `until' loop\n", args[0]);
+        return 1;
+    }
+    jump_kind = args[0][0] == 'b' ? JUMP_BREAK : JUMP_CONTINUE;
+    jump_count = n < loop_depth ? n : loop_depth;
+    return 1;
+}
+
+// return [n]: leaves the running function with status n, or with the status
+// of the last command.
+int mysh_return(char **args) {
+    if (func_depth == 0 && source_depth == 0) {
+        fprintf(stderr, "mysh: return: can only `return' from a function or sourced script\n");
+        last_exit_status = 1;
+        return 1;
+    }
+    last_exit_status = args[1] ? atoi(args[1]) & 0xff : status_before_builtin;
+    jump_kind = JUMP_RETURN;
+    return 1;
+}
+
+// local name[=value]...: the variables get their old values back when the
+// running function returns.
+int mysh_local(char **args) {
+    if (func_depth == 0) {
+        fprintf(stderr, "mysh: local: can only be used in a function\n");
+        last_exit_status = 1;
+        return 1;
+    }
+    for (int i = 1; args[i] != NULL; i++) {
+        size_t lhs = assignment_lhs(args[i]);
+        size_t namelen = lhs ? strcspn(args[i], "[+=") : strlen(args[i]);
+        if (!is_name(args[i], namelen)) {
+            fprintf(stderr, "mysh: local: %s: not a valid identifier\n", args[i]);
+            last_exit_status = 1;
+            continue;
+        }
+        if (nlocals == locals_cap) {
+            locals_cap = locals_cap ? locals_cap * 2 : 16;
+            locals = realloc(locals, locals_cap * sizeof(*locals));
+            if (!locals) {
+                fprintf(stderr, "mysh: allocation error\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        struct var *v = var_intern(arena_strndup(&line_arena, args[i], namelen));
+        struct saved_var *sv = &locals[nlocals++];
+        sv->name = v->name;
+        sv->value = v->value ? strdup(v->value) : NULL;
+        sv->flags = v->flags;
+        if (lhs) {
+            if (assign_word(args[i]) != 0) last_exit_status = 1;
+        } else {
+            var_unset(sv->name);
+        }
+    }
+    return 1;
+}
+
+// true, false and : need no process.
+int mysh_true(char **args) {
+    (void)args;
+    return 1;
+}
+
+int mysh_false(char **args) {
+    (void)args;
+    last_exit_status = 1;
+    return 1;
+}
+
+// Prints a variable as a declare command that would recreate it.
+void declare_print(const char *name) {
+    struct var *v = var_find(name);
+    if (v == NULL) {
+        fprintf(stderr, "mysh: declare: %s: not found\n", name);
+        last_exit_status = 1;
+        return;
+    }
+    struct shell_array *a = v->array;
+    if (a == NULL) {
+        printf("declare -%s %s", (v->flags & VAR_EXPORT) ? "x" : "-", name);
+        if (v->value) printf("=\"%s\"", v->value);
+        printf("\n");
+        return;
+    }
+    struct argv_builder keys = {NULL, 0, 0}, values = {NULL, 0, 0};
+    argv_init(&keys);
+    argv_init(&values);
+    array_push_all(a, &keys, 1);
+    array_push_all(a, &values, 0);
+    printf("declare -%c %s=(", (a->flags & ARRAY_ASSOC) ? 'A' : 'a', name);
+    for (int i = 0; i < keys.n; i++) printf("%s[%s]=\"%s\"", i ? " " : "", keys.v[i], values.v[i]);
+    printf(")\n");
+    free(keys.v);
+    free(values.v);
+}
+
+// declare [-aAxp] [name[=value]...]: -a and -A make indexed and associative
+// arrays, -x exports, -p prints the named variables.
+int mysh_declare(char **args) {
+    int indexed = 0, assoc = 0, export = 0, print = 0;
+    int i = 1;
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        for (char *o = args[i] + 1; *o; o++) {
+            if (*o == 'a') indexed = 1;
+            else if (*o == 'A') assoc = 1;
+            else if (*o == 'x') export = 1;
+            else if (*o == 'p') print = 1;
+            else {
+                fprintf(stderr, "mysh: %s: -%c: invalid option\n", args[0], *o);
+                last_exit_status = 2;
+                return 1;
+            }
+        }
+    }
+
+    for (; args[i] != NULL; i++) {
+        char *word = args[i];
+        size_t lhs = assignment_lhs(word);
+        size_t namelen = lhs ? strcspn(word, "[+=") : strlen(word);
+        if (!is_name(word, namelen)) {
+            fprintf(stderr, "mysh: %s: %s: not a valid identifier\n", args[0], word);
+            last_exit_status = 1;
+            continue;
+        }
+        char *name = arena_strndup(&line_arena, word, namelen);
+        if (print) {
+            declare_print(name);
+            continue;
+        }
+        struct shell_array *a = array_lookup(name);
+        if (assoc && a && !(a->flags & ARRAY_ASSOC)) {
+            fprintf(stderr, "mysh: %s: %s: cannot convert indexed to associative array\n", args[0], name);
+            last_exit_status = 1;
+            continue;
+        }
+        if (assoc || indexed) array_declare(name, assoc);
+        else var_intern(name); // Declared but unset
+        if (lhs && assign_word(word) != 0) last_exit_status = 1;
+        if (export) var_export(name);
+    }
+    return 1;
+}
+
+// hash [-r]: lists the remembered command paths, or forgets them all.
+int mysh_hash(char **args) {
+    if (args[1] != NULL && strcmp(args[1], "-r") == 0) {
+        path_cache_clear();
+        return 1;
+    }
+    if (args[1] != NULL) {
+        fprintf(stderr, "mysh: hash: usage: hash [-r]\n");
+        last_exit_status = 2;
+        return 1;
+    }
+    for (int i = 0; i < PATH_CACHE_SIZE; i++) {
+        for (struct path_entry *e = path_cache[i]; e; e = e->next) {
+            printf("%s\t%s\n", e->name, e->path);
+        }
+    }
+    return 1;
+}
+
+// Shell patterns (*, ?, [...]). A pattern is compiled once into a list of
+// nodes and cached by its text; wildcard expansion and the ${var#pat}
+// family both match through pattern_match(). Patterns built from variables
+// can be new every time, so the cache is bounded like the arithmetic one:
+// at PATTERN_CACHE_MAX patterns they are retired together, and freed at the
+// next retirement. A pattern stays valid until then, which glob_walk()
+// relies on while it compiles the components below it.
 
-// Function prototypes
-void loop();
-char *read_line();
-char **split_line(char *);
-int execute(char **args);
-int launch(char **args);
-int execute_builtin(char **args);
-int cd(char **args);
-int pwd(char **args);
-int mysh_which(char **args);
-int mysh_exit(char **args);
-int setup_redirection(char **args);
-void expand_wildcards(char ***args);
-int single_command_execution(char **args);
+enum pat_type { PAT_LITERAL, PAT_ANY, PAT_STAR, PAT_CLASS };
 
-// List of builtin commands, followed by their corresponding functions.
-char *builtin_str[] = {
-    "cd",
-    "pwd",
-    "which",
-    "exit"
+struct pat_node {
+    int type;
+    size_t len;           // PAT_LITERAL: length of text
+    const char *text;     // PAT_LITERAL: bytes to compare
+    unsigned char set[32]; // PAT_CLASS: bitmap of accepted bytes
 };
 
-int (*builtin_func[]) (char **) = {
-    &cd,
-    &pwd,
-    &mysh_which,
-    &mysh_exit
+struct pattern {
+    char *src;
+    char *lits;           // Unescaped literal bytes the nodes point into
+    struct pat_node *nodes;
+    int nnodes;
+    int has_meta;         // False when the pattern is a plain string
+    long fixed_len;       // Length every match has, or -1 if it contains '*'
+    struct pattern *next; // Hash chain
 };
 
-int num_builtins() {
-  return sizeof(builtin_str) / sizeof(char *);
-}
-
+#define PATTERN_CACHE_SIZE 1024
+#define PATTERN_CACHE_MAX 4096
+struct pattern *pattern_cache[PATTERN_CACHE_SIZE];
+struct pattern *pattern_retired; // Chained by next
+int pattern_cached;
 
-void loop(void) {
-    char *line;
-    char **args;
-    int status;
+// Adds the bytes of the POSIX character class named by src[0..len), as in
+// [:alpha:], to set. Returns 0 if there is no class of that name.
+int pattern_named_class(const char *src, size_t len, unsigned char *set) {
+    static const struct {
+        const char *name;
+        int (*test)(int);
+    } classes[] = {
+        {"alnum", isalnum}, {"alpha", isalpha}, {"blank", isblank}, {"cntrl", iscntrl},
+        {"digit", isdigit}, {"graph", isgraph}, {"lower", islower}, {"print", isprint},
+        {"punct", ispunct}, {"space", isspace}, {"upper", isupper}, {"xdigit", isxdigit},
+    };
+    for (size_t k = 0; k < sizeof(classes) / sizeof(classes[0]); k++) {
+        if (strlen(classes[k].name) != len || memcmp(classes[k].name, src, len) != 0) continue;
+        for (int c = 0; c < 256; c++) {
+            if (classes[k].test(c)) set[c >> 3] |= 1 << (c & 7);
+        }
+        return 1;
+    }
+    return 0;
+}
 
-    do {
-        //printf("> ");
-        line = read_line();
-        args = split_line(line);
-        expand_wildcards(&args);
-        status = execute(args);
+// Parses a bracket expression starting at src[i] == '['. Fills set and
+// returns the index just past ']', or -1 if the bracket is not closed.
+int pattern_class(const char *src, int i, unsigned char *set) {
+    int negate = 0, first = 1;
+    memset(set, 0, 32);
+    i++;
+    if (src[i] == '!' || src[i] == '^') {
+        negate = 1;
+        i++;
+    }
+    for (; src[i] != '\0'; first = 0) {
+        if (src[i] == ']' && !first) {
+            if (negate) {
+                for (int k = 0; k < 32; k++) set[k] = ~set[k];
+            }
+            return i + 1;
+        }
+        if (src[i] == '[' && src[i + 1] == ':') {
+            const char *end = strstr(src + i + 2, ":]");
+            if (end && pattern_named_class(src + i + 2, end - (src + i + 2), set)) {
+                i = end - src + 2;
+                continue;
+            }
+        }
+        unsigned char lo = src[i] == '\\' && src[i + 1] ? src[++i] : src[i];
+        unsigned char hi = lo;
+        i++;
+        if (src[i] == '-' && src[i + 1] != ']' && src[i + 1] != '\0') {
+            hi = src[i + 1] == '\\' && src[i + 2] ? src[i + 2] : src[i + 1];
+            i += src[i + 1] == '\\' ? 3 : 2;
+        }
+        for (int c = lo; c <= hi; c++) set[c >> 3] |= 1 << (c & 7);
+    }
+    return -1;
+}
 
-        free(line);
-        free(args);
-    } while (status);
+void pattern_cache_retire(void) {
+    while (pattern_retired) {
+        struct pattern *next = pattern_retired->next;
+        free(pattern_retired->src);
+        free(pattern_retired->lits);
+        free(pattern_retired->nodes);
+        free(pattern_retired);
+        pattern_retired = next;
+    }
+    for (int i = 0; i < PATTERN_CACHE_SIZE; i++) {
+        while (pattern_cache[i]) {
+            struct pattern *p = pattern_cache[i];
+            pattern_cache[i] = p->next;
+            p->next = pattern_retired;
+            pattern_retired = p;
+        }
+    }
+    pattern_cached = 0;
 }
 
+struct pattern *pattern_compile(const char *src) {
+    size_t srclen = strlen(src);
+    uint64_t h = hash_bytes(src, srclen);
+    struct pattern **bucket = &pattern_cache[h % PATTERN_CACHE_SIZE];
+    for (struct pattern *p = *bucket; p; p = p->next) {
+        if (strcmp(p->src, src) == 0) return p;
+    }
 
-char *read_line(void) {
-    
-    char *line = NULL;
-    size_t bufsize = 0; // have getline allocate a buffer for us
-    ssize_t linelen = getline(&line, &bufsize, stdin);
+    struct pattern *p = calloc(1, sizeof(*p));
+    if (p) p->src = strdup(src);
+    if (p) p->lits = malloc(srclen + 1);
+    if (p) p->nodes = malloc((srclen + 1) * sizeof(struct pat_node));
+    if (!p || !p->src || !p->lits || !p->nodes) {
+        fprintf(stderr, "mysh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
 
-    if (linelen == -1) {
-        if (feof(stdin)) {
-            fprintf(stderr, "End of file reached. Exiting.\n");
-            exit(EXIT_SUCCESS); // Graceful exit at EOF
+    size_t nlit = 0;
+    p->fixed_len = 0;
+    for (int i = 0; src[i] != '\0'; ) {
+        struct pat_node *node = &p->nodes[p->nnodes];
+        int close;
+        if (src[i] == '*') {
+            while (src[i] == '*') i++; // Consecutive stars mean one star
+            node->type = PAT_STAR;
+            p->fixed_len = -1;
+            p->has_meta = 1;
+            p->nnodes++;
+            continue;
+        }
+        if (src[i] == '?') {
+            node->type = PAT_ANY;
+            i++;
+        } else if (src[i] == '[' && (close = pattern_class(src, i, node->set)) > 0) {
+            node->type = PAT_CLASS;
+            i = close;
         } else {
-            perror("getline");
-            exit(EXIT_FAILURE);
+            // A run of ordinary characters becomes one literal node
+            char c = src[i] == '\\' && src[i + 1] ? src[++i] : src[i];
+            i++;
+            if (p->nnodes > 0 && node[-1].type == PAT_LITERAL) {
+                p->lits[nlit++] = c;
+                node[-1].len++;
+                if (p->fixed_len >= 0) p->fixed_len++;
+                continue;
+            }
+            node->type = PAT_LITERAL;
+            node->text = p->lits + nlit;
+            node->len = 1;
+            p->lits[nlit++] = c;
+            if (p->fixed_len >= 0) p->fixed_len++;
+            p->nnodes++;
+            continue;
         }
+        p->has_meta = 1;
+        if (p->fixed_len >= 0) p->fixed_len++;
+        p->nnodes++;
     }
 
-    //fprintf(stderr, "Debug: read_line: %s", line); // Print the line read from stdin
-    return line;
+    if (pattern_cached == PATTERN_CACHE_MAX) pattern_cache_retire();
+    p->next = *bucket;
+    *bucket = p;
+    pattern_cached++;
+    return p;
 }
 
-char **split_line(char *line) {
-    int bufsize = MAX_ARGS, position = 0;
-    char **tokens = malloc(bufsize * sizeof(char*));
-    char *token;
-    //const char *delim = " \t\r\n\a";
-    int start = 0, end = 0;
-    int in_quote = 0;
-
-    if (!tokens) {
-        fprintf(stderr, "allocation error\n");
-        exit(EXIT_FAILURE);
-    }
-
-    while (line[end] != '\0') {
-        if (line[end] == '\"') in_quote = !in_quote; // Toggle in_quote on encountering a quote
-
-        if ((isspace(line[end]) && !in_quote) || line[end+1] == '\0') {
-            if (line[end+1] == '\0' && !isspace(line[end])) end++; // Include last word
-            if (end - start > 0) { // We have a token
-                token = strndup(line + start, end - start);
-                tokens[position++] = token;
-                if (position >= bufsize) {
-                    bufsize += MAX_ARGS;
-                    tokens = realloc(tokens, bufsize * sizeof(char*));
-                    if (!tokens) {
-                        fprintf(stderr, "allocation error\n");
-                        exit(EXIT_FAILURE);
-                    }
+// Matches the whole of s[0..len) against p. Stars are handled by the usual
+// greedy scan that backtracks only to the most recent star, so matching is
+// linear for typical patterns and O(n*m) at worst, never exponential.
+int pattern_match(struct pattern *p, const char *s, size_t len) {
+    if (p->fixed_len >= 0 && (size_t)p->fixed_len != len) return 0;
+
+    int n = 0, star_n = -1;
+    size_t i = 0, star_i = 0;
+    while (i < len || n < p->nnodes) {
+        if (n < p->nnodes) {
+            struct pat_node *node = &p->nodes[n];
+            unsigned char c = i < len ? s[i] : 0;
+            switch (node->type) {
+            case PAT_STAR:
+                star_n = n++;
+                star_i = i;
+                continue;
+            case PAT_LITERAL:
+                if (len - i >= node->len && memcmp(s + i, node->text, node->len) == 0) {
+                    i += node->len;
+                    n++;
+                    continue;
+                }
+                break;
+            case PAT_ANY:
+                if (i < len) {
+                    i++;
+                    n++;
+                    continue;
                 }
+                break;
+            case PAT_CLASS:
+                if (i < len && (node->set[c >> 3] & (1 << (c & 7)))) {
+                    i++;
+                    n++;
+                    continue;
+                }
+                break;
             }
-            start = end + 1; // Move start to the next character after current whitespace
         }
-        end++;
+        // Mismatch: let the last star swallow one more character and retry
+        if (star_n < 0 || star_i >= len) return 0;
+        n = star_n + 1;
+        i = ++star_i;
     }
+    return 1;
+}
 
-    tokens[position] = NULL; // Null-terminate the list of tokens
-    return tokens;
+int has_glob_meta(const char *s) {
+    return strpbrk(s, "*?[") != NULL;
 }
 
+// Parameter expansion: ${name}, ${#name}, ${name:-word} and friends,
+// ${name#pat} ${name##pat} ${name%pat} ${name%%pat}, ${name/pat/rep},
+// ${name//pat/rep} and ${name:off:len}.
 
-int execute(char **args) {
-    if (args[0] == NULL || args[0][0] == '#' || strlen(args[0]) == 0) {
-        return 1;
+// Returns the value of a variable or special parameter, or NULL if unset.
+char *lookup_param(const char *name) {
+    char num[32];
+    int n = -1;
+
+    if (isdigit((unsigned char)name[0])) {
+        long k = atol(name);
+        if (k == 0) return shell_name;
+        return k <= npositional ? positional[k - 1] : NULL;
     }
-    if (args[0] == NULL) {
-        //fprintf(stderr, "Debug: execute: No command entered.\n");
+    if (name[1] == '\0') {
+        switch (name[0]) {
+        case '?': n = snprintf(num, sizeof(num), "%d", last_exit_status); break;
+        case '$': n = snprintf(num, sizeof(num), "%ld", (long)shell_pid); break;
+        case '#': n = snprintf(num, sizeof(num), "%d", npositional); break;
+        case '!':
+            if (last_bg_pid < 0) return NULL;
+            n = snprintf(num, sizeof(num), "%ld", (long)last_bg_pid);
+            break;
+        case '-': return "";
+        case '@':
+        case '*': {
+            // All positional parameters joined by spaces; unquoted, field
+            // splitting turns them back into separate words.
+            struct strbuf sb = {NULL, 0, 0};
+            for (int i = 0; i < npositional; i++) {
+                if (i > 0) strbuf_add(&sb, " ", 1);
+                strbuf_add(&sb, positional[i], strlen(positional[i]));
+            }
+            char *all = arena_strndup(&line_arena, sb.data ? sb.data : "", sb.len);
+            free(sb.data);
+            return all;
+        }
+        }
+    }
+    if (n >= 0) return arena_strndup(&line_arena, num, n);
+    struct shell_array *a = array_lookup(name);
+    if (a) {
+        struct slice *e = array_fetch(a, "0"); // $name means ${name[0]}
+        return e ? arena_strndup(&line_arena, e->ptr, e->len) : NULL;
+    }
+    return var_get(name);
+}
+
+// Joins the elements (or subscripts) of a with spaces, for ${name[*]} and
+// ${name[@]} inside a larger word.
+char *array_join(struct shell_array *a, int keys) {
+    struct argv_builder all = {NULL, 0, 0};
+    argv_init(&all);
+    array_push_all(a, &all, keys);
+    struct strbuf sb = {NULL, 0, 0};
+    for (int i = 0; i < all.n; i++) {
+        if (i > 0) strbuf_add(&sb, " ", 1);
+        strbuf_add(&sb, all.v[i], strlen(all.v[i]));
+    }
+    char *joined = arena_strndup(&line_arena, sb.data ? sb.data : "", sb.len);
+    free(sb.data);
+    free(all.v);
+    return joined;
+}
+
+// Handles a word that is exactly ${name[@]}, ${name[*]} or ${!name[@]}:
+// each element becomes its own word (split further when split is set),
+// straight from the array with nothing joined in between. Returns 0 if the
+// word has some other form.
+int expand_array_word(char *word, struct argv_builder *out, int split) {
+    size_t wlen = strlen(word);
+    if (wlen < 7 || word[0] != '$' || word[1] != '{' || word[wlen - 1] != '}' ||
+        word[wlen - 2] != ']' || (word[wlen - 3] != '@' && word[wlen - 3] != '*') || word[wlen - 4] != '[') {
+        return 0;
+    }
+    int keys = word[2] == '!';
+    char *name = word + 2 + keys;
+    int namelen = param_name_len(name);
+    if (namelen == 0 || name + namelen != word + wlen - 4 || !(isalpha((unsigned char)*name) || *name == '_')) {
+        return 0;
+    }
+    struct shell_array *a = array_lookup(arena_strndup(&line_arena, name, namelen));
+    if (a == NULL) return 0; // Scalars and unset names take the general path
+
+    if (!split) {
+        argv_push(out, array_join(a, keys));
         return 1;
     }
+    struct argv_builder items = {NULL, 0, 0};
+    argv_init(&items);
+    array_push_all(a, &items, keys);
+    for (int i = 0; i < items.n; i++) split_fields_in_place(out, items.v[i], strlen(items.v[i]));
+    free(items.v);
+    return 1;
+}
 
-    for (int i = 0; i < num_builtins(); i++) {
-        if (strcmp(args[0], builtin_str[i]) == 0) {
-            //fprintf(stderr, "Debug: execute: Executing builtin: %s\n", args[0]); // Print the builtin being executed
-            return (*builtin_func[i])(args);
-        }
+void assign_param(const char *name, char *sub, const char *value) {
+    if (sub) array_store(array_declare(name, 0), sub, value);
+    else var_set(name, value);
+}
+
+// Expands a word to exactly one string, with the given expand_word() flags.
+char *expand_one(char *text, int flags) {
+    struct argv_builder out = {NULL, 0, 0};
+    argv_init(&out);
+    expand_word(text, &out, flags);
+    char *result = out.v[0] ? out.v[0] : arena_strndup(&line_arena, "", 0);
+    free(out.v);
+    return result;
+}
+
+// Expands a word without field splitting, for the operands of ${...}.
+char *expand_text(char *text) {
+    return expand_one(text, 0);
+}
+
+// Expands a pattern operand: quoted *, ? and [ stay literal.
+char *expand_pattern(char *text) {
+    return expand_one(text, EXPAND_PATTERN);
+}
+
+// Length of the shortest (longest) prefix of s matching pat, or -1.
+long match_prefix(struct pattern *pat, const char *s, size_t len, int longest) {
+    if (pat->fixed_len >= 0) {
+        if ((size_t)pat->fixed_len > len) return -1;
+        return pattern_match(pat, s, pat->fixed_len) ? pat->fixed_len : -1;
+    }
+    for (size_t k = 0; k <= len; k++) {
+        size_t n = longest ? len - k : k;
+        if (pattern_match(pat, s, n)) return n;
     }
+    return -1;
+}
 
-    return launch(args); // External command execution
+// Length of the shortest (longest) suffix of s matching pat, or -1.
+long match_suffix(struct pattern *pat, const char *s, size_t len, int longest) {
+    if (pat->fixed_len >= 0) {
+        if ((size_t)pat->fixed_len > len) return -1;
+        return pattern_match(pat, s + len - pat->fixed_len, pat->fixed_len) ? pat->fixed_len : -1;
+    }
+    for (size_t k = 0; k <= len; k++) {
+        size_t n = longest ? len - k : k;
+        if (pattern_match(pat, s + len - n, n)) return n;
+    }
+    return -1;
 }
 
+// ${name/pat/rep}: mode is '/' for the first match, 'a' for all matches,
+// '#' for a match at the start and '%' for a match at the end.
+char *replace_pattern(const char *value, struct pattern *pat, const char *rep, int mode) {
+    size_t len = strlen(value), replen = strlen(rep);
+    struct strbuf sb = {NULL, 0, 0};
+    long n;
 
-int cd(char **args) {
-    if (args[1] == NULL || strcmp(args[1], "~") == 0) {
-        char *home = getenv("HOME");
-        if (chdir(home) != 0) {
-            perror("cd");
+    if (mode == '#' || mode == '%') {
+        n = mode == '#' ? match_prefix(pat, value, len, 1) : match_suffix(pat, value, len, 1);
+        if (n < 0) return (char *)value;
+        if (mode == '#') {
+            strbuf_add(&sb, rep, replen);
+            strbuf_add(&sb, value + n, len - n);
+        } else {
+            strbuf_add(&sb, value, len - n);
+            strbuf_add(&sb, rep, replen);
         }
     } else {
-        if (chdir(args[1]) != 0) {
-            perror("cd");
+        size_t i = 0;
+        int done = 0;
+        while (i <= len) {
+            n = done ? -1 : match_prefix(pat, value + i, len - i, 1);
+            if (n > 0) {
+                strbuf_add(&sb, rep, replen);
+                i += n;
+                done = mode == '/';
+                continue;
+            }
+            if (i < len) strbuf_add(&sb, value + i, 1);
+            i++;
         }
     }
-    return 1;
+    char *result = arena_strndup(&line_arena, sb.data ? sb.data : "", sb.len);
+    free(sb.data);
+    return result;
 }
 
+// Evaluates an array subscript, offset or length. Most are a plain decimal
+// number once expanded, as in a[$i]; those are read directly, rather than
+// compiled and cached as a new expression for every value.
+int64_t param_arith(char *text, int *ok) {
+    return arith_value(expand_text(text), ok);
+}
 
-int pwd(char **args) {
-    char cwd[1024];
-    if (getcwd(cwd, sizeof(cwd)) != NULL) {
-        printf("%s\n", cwd);
-    } else {
-        perror("mysh");
+// Evaluates text that has already been expanded, such as an array subscript.
+int64_t arith_value(char *text, int *ok) {
+    size_t digits = strspn(text, "0123456789");
+    if (digits > 0 && digits <= 18 && text[digits] == '\0' && (text[0] != '0' || digits == 1)) {
+        *ok = 1;
+        return strtoll(text, NULL, 10);
     }
-    return 1;
+    struct arith_prog *pr = arith_compile(text);
+    int64_t v = 0;
+    *ok = pr != NULL && arith_run(pr, &v) == 0;
+    if (!*ok) expand_error = 1;
+    return v;
 }
 
-int mysh_which(char **args) {
-    if (args[1] == NULL || args[2] != NULL) {
-        fprintf(stderr, "mysh: expected one argument to \"which\"\n");
-        return 1;
+// Evaluates the text between "${" and "}". Returns NULL after printing a
+// message for a bad substitution or a failed ${name:?word}.
+char *param_expand(char *expr) {
+    int want_length = 0, want_keys = 0;
+    if (expr[0] == '#' && expr[1] != '\0') {
+        want_length = 1;
+        expr++;
+    } else if (expr[0] == '!' && (isalpha((unsigned char)expr[1]) || expr[1] == '_')) {
+        want_keys = 1; // ${!name[@]}
+        expr++;
     }
 
-    char *paths[] = {"/usr/local/bin", "/usr/bin", "/bin"};
-    char path[1024];
-    for (int i = 0; i < 3; i++) {
-        snprintf(path, sizeof(path), "%s/%s", paths[i], args[1]);
-        if (access(path, X_OK) == 0) {
-            printf("%s\n", path);
-            return 1;
+    char *p = expr, *sub = NULL;
+    if (isalpha((unsigned char)*p) || *p == '_') {
+        while (isalnum((unsigned char)*p) || *p == '_') p++;
+        if (*p == '[') {
+            // name[subscript]; the subscript itself may contain brackets
+            int depth = 0;
+            char *open = p;
+            for (; *p != '\0'; p++) {
+                if (*p == '[') depth++;
+                else if (*p == ']' && --depth == 0) break;
+            }
+            if (*p != ']') {
+                fprintf(stderr, "mysh: ${%s}: bad substitution\n", expr);
+                return NULL;
+            }
+            sub = arena_strndup(&line_arena, open + 1, p - open - 1);
+            p++;
         }
+    } else if (isdigit((unsigned char)*p)) {
+        while (isdigit((unsigned char)*p)) p++;
+    } else if (*p != '\0' && strchr("?$#!@*-", *p)) {
+        p++;
+    }
+    if (p == expr) {
+        fprintf(stderr, "mysh: ${%s}: bad substitution\n", expr);
+        return NULL;
     }
 
-    if (strcmp(args[1], "cd") == 0 || strcmp(args[1], "pwd") == 0 || 
-        strcmp(args[1], "which") == 0 || strcmp(args[1], "exit") == 0) {
-        printf("mysh: %s: shell built-in command\n", args[1]);
+    char *name = arena_strndup(&line_arena, expr, sub ? strcspn(expr, "[") : (size_t)(p - expr));
+    int all = sub && (strcmp(sub, "@") == 0 || strcmp(sub, "*") == 0);
+    if (sub && !all) sub = expand_text(sub); // Once, for the lookup and any assignment
+    struct shell_array *a = sub ? array_lookup(name) : NULL;
+    char *value, *empty = "";
+    if (want_keys && !all) {
+        fprintf(stderr, "mysh: ${!%s}: bad substitution\n", expr);
+        return NULL;
+    }
+    if (all) {
+        if (a) value = array_join(a, want_keys);
+        else value = want_keys ? (lookup_param(name) ? "0" : empty) : lookup_param(name);
+    } else if (a) {
+        struct slice *e = array_fetch(a, sub);
+        value = e ? arena_strndup(&line_arena, e->ptr, e->len) : NULL;
     } else {
-        fprintf(stderr, "mysh: %s: Command not found\n", args[1]);
+        int ok = 1;
+        value = lookup_param(name);
+        if (sub && arith_value(sub, &ok) != 0) value = NULL; // A scalar is element 0
+        if (!ok) return NULL;
     }
-    return 1;
+
+    if (want_length) {
+        if (*p != '\0') {
+            fprintf(stderr, "mysh: ${#%s}: bad substitution\n", expr);
+            return NULL;
+        }
+        char num[32];
+        size_t count = value ? strlen(value) : 0;
+        if (all) count = a ? a->nset : value != NULL; // Number of elements
+        int n = snprintf(num, sizeof(num), "%zu", count);
+        return arena_strndup(&line_arena, num, n);
+    }
+    if (*p == '\0') return value ? value : empty;
+
+    // Defaults and alternates: with ':' an empty value counts as unset
+    int colon = *p == ':' && p[1] != '\0' && strchr("-=+?", p[1]);
+    char op = colon ? p[1] : p[0];
+    if (strchr("-=+?", op) && (colon || p[0] == op)) {
+        char *word = p + 1 + colon;
+        int is_set = value != NULL && (!colon || *value != '\0');
+        switch (op) {
+        case '-':
+            return is_set ? value : expand_text(word);
+        case '=':
+            if (is_set) return value;
+            word = expand_text(word);
+            assign_param(name, sub, word);
+            return word;
+        case '+':
+            return is_set ? expand_text(word) : empty;
+        case '?':
+            // Fails the command, and a shell that is not interactive too
+            if (is_set) return value;
+            fprintf(stderr, "mysh: %s: %s\n", name, *word ? expand_text(word) : "parameter null or not set");
+            expand_error = 1;
+            if (!interactive) shell_exit(1);
+            last_exit_status = 1;
+            return NULL;
+        }
+    }
+    if (value == NULL) value = empty;
+    size_t len = strlen(value);
+
+    if (*p == ':') {
+        // ${name:offset} and ${name:offset:length}, both arithmetic
+        char *colon2 = strchr(p + 1, ':');
+        if (colon2) *colon2 = '\0';
+        int ok;
+        int64_t off = param_arith(p + 1, &ok);
+        if (!ok) return NULL;
+        if (off < 0) off = (int64_t)len + off < 0 ? 0 : (int64_t)len + off;
+        if ((size_t)off > len) off = len;
+        int64_t count = len - off;
+        if (colon2) {
+            count = param_arith(colon2 + 1, &ok);
+            if (!ok) return NULL;
+            if (count < 0) count = (int64_t)(len - off) + count;
+            if (count < 0) {
+                fprintf(stderr, "mysh: %s: substring expression < 0\n", colon2 + 1);
+                return NULL;
+            }
+            if ((size_t)count > len - off) count = len - off;
+        }
+        return arena_strndup(&line_arena, value + off, count);
+    }
+    if (*p == '#' || *p == '%') {
+        int longest = p[1] == p[0];
+        struct pattern *pat = pattern_compile(expand_pattern(p + 1 + longest));
+        long n = *p == '#' ? match_prefix(pat, value, len, longest)
+                           : match_suffix(pat, value, len, longest);
+        if (n < 0) return value;
+        return *p == '#' ? value + n : arena_strndup(&line_arena, value, len - n);
+    }
+    if (*p == '/') {
+        int mode = '/';
+        p++;
+        if (*p == '/' || *p == '#' || *p == '%') {
+            mode = *p == '/' ? 'a' : *p;
+            p++;
+        }
+        char *slash = p;
+        while (*slash && *slash != '/') slash += slash[0] == '\\' && slash[1] ? 2 : 1;
+        if (*slash) *slash = '\0';
+        else slash = NULL;
+        // The replacement first: it may run commands, which compile
+        // patterns of their own
+        char *rep = slash ? expand_text(slash + 1) : empty;
+        struct pattern *pat = pattern_compile(expand_pattern(p));
+        return replace_pattern(value, pat, rep, mode);
+    }
+
+    fprintf(stderr, "mysh: ${%s}: bad substitution\n", expr);
+    return NULL;
 }
 
-int mysh_exit(char **args) {
-    int i = 1;
-    while (args[i] != NULL) {
-        printf("%s ", args[i]);
-        i++;
+// Finds the '}' closing the "${" at word[open]. Returns its index, or -1.
+int find_brace_end(const char *word, int open) {
+    int depth = 0;
+    for (int i = open; word[i] != '\0'; i++) {
+        if (word[i] == '\\' && word[i + 1] != '\0') i++;
+        else if (word[i] == '{') depth++;
+        else if (word[i] == '}' && --depth == 0) return i;
     }
-    printf("\n");
-    exit(0);
+    return -1;
 }
 
-int main(int argc, char **argv) {
-    // Main entry point of the shell
+int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
 
-    // If batch mode
-    if (argc == 2) {
-        // Redirect standard input to read from the file
-        FILE *file = fopen(argv[1], "r");
-        if (!file) {
-            fprintf(stderr, "mysh: Cannot open file %s\n", argv[1]);
-            exit(EXIT_FAILURE);
+// Matches the pattern components in rest against the directory dir (a path
+// ending in '/', or "" for the current directory) and pushes every full
+// match. Only directories the pattern actually names are opened.
+void glob_walk(const char *dir, const char *rest, struct argv_builder *out) {
+    while (*rest == '/') rest++;
+    const char *slash = strchr(rest, '/');
+    size_t complen = slash ? (size_t)(slash - rest) : strlen(rest);
+    char *comp = arena_strndup(&line_arena, rest, complen);
+    size_t dirlen = strlen(dir);
+
+    if (!has_glob_meta(comp)) {
+        char *path = arena_alloc(&line_arena, dirlen + complen + 2);
+        size_t n = dirlen;
+        memcpy(path, dir, dirlen);
+        for (size_t k = 0; k < complen; k++) {
+            if (comp[k] == '\\' && comp[k + 1] != '\0') k++; // Drop the escapes of quoted characters
+            path[n++] = comp[k];
         }
-        dup2(fileno(file), STDIN_FILENO);
-        fclose(file);
+        if (slash) path[n++] = '/';
+        path[n] = '\0';
+        if (slash) glob_walk(path, slash + 1, out);
+        else if (access(path, F_OK) == 0) argv_push(out, path);
+        return;
     }
 
-    printf(isatty(STDIN_FILENO) ? "Welcome to my shell!\n" : "");
+    DIR *d = opendir(dirlen ? dir : ".");
+    if (d == NULL) return;
+    struct pattern *pat = pattern_compile(comp);
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        const char *name = ent->d_name;
+        if (name[0] == '.' && comp[0] != '.') continue; // Hidden unless asked for
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+        size_t namelen = strlen(name);
+        if (!pattern_match(pat, name, namelen)) continue;
 
-    // Run command loop.
-    loop();
+        char *path = arena_alloc(&line_arena, dirlen + namelen + 2);
+        if (slash) {
+            if (ent->d_type != DT_DIR && ent->d_type != DT_LNK && ent->d_type != DT_UNKNOWN) continue;
+            snprintf(path, dirlen + namelen + 2, "%s%s/", dir, name);
+            glob_walk(path, slash + 1, out);
+        } else {
+            snprintf(path, dirlen + namelen + 2, "%s%s", dir, name);
+            argv_push(out, path);
+        }
+    }
+    closedir(d);
+}
 
-    printf(isatty(STDIN_FILENO) ? "Exiting my shell.\n" : "");
+// Pushes the paths matching pattern in sorted order, or word itself if
+// nothing matches. pattern is word with its quoted characters escaped.
+void glob_push(struct argv_builder *out, char *word, char *pattern) {
+    int before = out->n;
+    char *home = var_get("HOME");
+    if (pattern[0] == '~' && (pattern[1] == '/' || pattern[1] == '\0') && home) {
+        char *path = arena_alloc(&line_arena, strlen(home) + strlen(pattern) + 1);
+        sprintf(path, "%s%s", home, pattern + 1);
+        pattern = path;
+    }
+    if (pattern[0] == '/') glob_walk("/", pattern + 1, out);
+    else glob_walk("", pattern, out);
 
-    // Perform any shutdown/cleanup.
+    if (out->n == before) {
+        argv_push(out, word);
+    } else {
+        qsort(out->v + before, out->n - before, sizeof(char *), compare_strings);
+    }
+}
 
-    return EXIT_SUCCESS;
+#include <fcntl.h> // For file control options
+
+// Recognises the text of a redirection operator: [n]<, [n]>, [n]>>, [n]>&,
+// [n]<< or [n]<<-. Returns '<', '>', 'a' (append), '&' (duplicate) or 'h'
+// (here-document), or 0 if word is not one, and sets *fd to the descriptor
+// it redirects. An n too long for a descriptor makes it an ordinary word.
+int redirect_kind(const char *word, int *fd) {
+    int n = 0, digits = 0;
+    while (isdigit((unsigned char)word[digits])) {
+        if (digits == REDIRECT_FD_DIGITS) return 0;
+        n = n * 10 + (word[digits++] - '0');
+    }
+    const char *op = word + digits;
+    int kind = 0;
+    if (strcmp(op, "<") == 0) kind = '<';
+    else if (strcmp(op, ">") == 0) kind = '>';
+    else if (strcmp(op, ">>") == 0) kind = 'a';
+    else if (strcmp(op, ">&") == 0) kind = '&';
+    else if (strcmp(op, "<<") == 0 || strcmp(op, "<<-") == 0) kind = 'h';
+    if (kind) *fd = digits ? n : (kind == '<' || kind == 'h' ? STDIN_FILENO : STDOUT_FILENO);
+    return kind;
 }
 
-void expand_wildcards(char ***args) {
-    glob_t glob_result;
-    for (int i = 0; (*args)[i] != NULL; i++) {
-        if (strchr((*args)[i], '*') != NULL) { // Check if argument contains a wildcard
-            if (glob((*args)[i], GLOB_TILDE | GLOB_NOCHECK, NULL, &glob_result) == 0) {
-                // Successfully found matches
-                // First, remove the wildcard argument
-                free((*args)[i]);
-                // Make space for the new arguments
-                *args = realloc(*args, sizeof(char *) * (glob_result.gl_pathc + 1));
-                for (unsigned j = 0; j < glob_result.gl_pathc; j++) {
-                    (*args)[i + j] = strdup(glob_result.gl_pathv[j]);
-                }
-                // Null-terminate the list of arguments
-                (*args)[i + glob_result.gl_pathc] = NULL;
-            }
-            globfree(&glob_result);
-        }
+// Operators the executor acts on (| and redirections) are stored in the tree
+// as interned pointers. Returns that pointer if w is the text of one, or w.
+const char *operator_word(const char *w) {
+    int fd;
+    if (w == NULL || (strcmp(w, "|") != 0 && !redirect_kind(w, &fd))) return w;
+    return intern_name(w, strlen(w));
+}
+
+// Like redirect_kind(), but only for the operator itself: a quoted ">" has
+// the same text once its quotes are removed, and is an ordinary word.
+int redirect_op(const char *word, int *fd) {
+    int kind = redirect_kind(word, fd);
+    return kind && operator_word(word) == word ? kind : 0;
+}
+
+int is_pipe(const char *word) {
+    return strcmp(word, "|") == 0 && operator_word(word) == word;
+}
+
+int has_pipe(char **args) {
+    for (int i = 0; args[i] != NULL; i++) {
+        if (is_pipe(args[i])) return 1;
     }
+    return 0;
 }
 
-#include <fcntl.h> // For file control options
+// Copies the words of one pipeline stage, which end at a NULL, and expands
+// them.
+char **stage_words(char **stage) {
+    int n = 0;
+    while (stage[n] != NULL) n++;
+    char **words = malloc((n + 1) * sizeof(char *));
+    if (!words) {
+        fprintf(stderr, "mysh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(words, stage, (n + 1) * sizeof(char *));
+    expand_words(&words);
+    return words;
+}
 
 int needs_redirection(char **args) {
+    int fd;
     for (int i = 0; args[i] != NULL; i++) {
-        if (strcmp(args[i], "<") == 0 || strcmp(args[i], ">") == 0 || strcmp(args[i], ">>") == 0) {
+        if (redirect_op(args[i], &fd)) {
             return 1; // Redirection symbols found
         }
     }
@@ -269,165 +8314,222 @@ int needs_redirection(char **args) {
 }
 
 
+// Applies the redirections in args from left to right and removes them,
+// leaving only the command's own words.
 int setup_redirection(char **args) {
-    //fprintf(stderr, "Debug: setup_redirection: Setting up redirection\n");
-    //int original_stdin = dup(STDIN_FILENO);
-    //int original_stdout = dup(STDOUT_FILENO);
-    int inRedirect = -1, outRedirect = -1;
-    char *inputFile = NULL, *outputFile = NULL;
+    int argc = 0;
 
-    //debug_fds()
     for (int i = 0; args[i] != NULL; i++) {
-        if (strcmp(args[i], "<") == 0) {
-            if(args[i + 1] != NULL){
-            inputFile = args[i + 1];
-            inRedirect = open(inputFile, O_RDONLY);
-            if (inRedirect < 0) {
-                perror("mysh: open input");
-                return -1;
-            }
-            args[i] = NULL; // Remove the '<' symbol from arguments
-            args[i + 1] = NULL; // Remove the filename from arguments
-            i++; // Skip next argument since it's been processed
-            }
-            else{
-                 fprintf(stderr, "mysh: expected file name after '<'\n");
+        int fd, kind = redirect_op(args[i], &fd);
+        if (kind == 0) {
+            args[argc++] = args[i]; // Keep ordinary words, dropping operators and file names
+            continue;
+        }
+        char *target = args[i + 1];
+        if (target == NULL) {
+            fprintf(stderr, "mysh: expected file name after '%s'\n", args[i]);
+            return -1;
+        }
+        i++; // Skip next argument since it's been processed
+        if (fd_private(fd)) {
+            fprintf(stderr, "mysh: %d: Bad file descriptor\n", fd);
+            return -1;
+        }
+
+        int src;
+        if (kind == '&') {
+            // n>&m makes n a copy of m
+            char *end;
+            long m = strtol(target, &end, 10);
+            if (*end != '\0' || end == target) {
+                fprintf(stderr, "mysh: %s: ambiguous redirect\n", target);
                 return -1;
             }
-        } else if (strcmp(args[i], ">") == 0) {
-            outputFile = args[i + 1];
-            if (outputFile == NULL) {
-                fprintf(stderr, "mysh: expected file name after '>'\n");
+            if (m < 0 || m > INT_MAX || fd_private((int)m)) {
+                fprintf(stderr, "mysh: %s: Bad file descriptor\n", target);
                 return -1;
             }
-            outRedirect = open(outputFile, O_WRONLY | O_CREAT | O_TRUNC, 0640);
-            if (outRedirect < 0) {
-                perror("mysh: open output");
+            if (dup2((int)m, fd) < 0) {
+                perror("mysh: dup2");
                 return -1;
             }
-            args[i] = NULL; // Remove the '>' symbol from arguments
-            args[i + 1] = NULL; // Also remove the filename from arguments
-            i++; // Skip next argument since it's been processed
+            continue;
         }
-        else if(strcmp(args[i], ">>") == 0){
-            outputFile = args[i + 1];
-            if (outputFile == NULL) {
-                fprintf(stderr, "mysh: expected file name after '>>'\n");
-                return -1;
+        if (kind == 'h') {
+            // Here-document: the body, already expanded, is read from memory
+            if (target[0] == HEREDOC_LITERAL) target++;
+            src = memfd_create("mysh-heredoc", MFD_CLOEXEC);
+            if (src < 0) src = open("/tmp", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+            if (src >= 0 && (write_all(src, target, strlen(target)) != 0 || lseek(src, 0, SEEK_SET) != 0)) {
+                close(src);
+                src = -1;
             }
-            outRedirect = open(outputFile, O_WRONLY | O_CREAT | O_APPEND, 0640);
-            if (outRedirect < 0) {
-                perror("mysh: open output");
+        } else if (kind == '<') {
+            src = open_long(cwd_dirfd(), target, O_RDONLY, 0);
+        } else {
+            src = open_long(cwd_dirfd(), target, O_WRONLY | O_CREAT | (kind == 'a' ? O_APPEND : O_TRUNC), 0640);
+        }
+        if (src < 0) {
+            perror(kind == 'h' ? "mysh: here-document" : kind == '<' ? "mysh: open input" : "mysh: open output");
+            return -1;
+        }
+        if (src != fd) {
+            if (dup2(src, fd) < 0) {
+                perror("mysh: dup2");
+                close(src);
                 return -1;
             }
-            args[i] = NULL;
-            args[i + 1] = NULL;
-            i++;
+            close(src);
         }
     }
+    args[argc] = NULL;
+    return 0; // Indicate success
+}
 
+// Runs one pipeline stage inside an already forked child. Builtins run
+// here directly and their output flows into the pipe like any other
+// program's; everything else is exec'd.
+void exec_stage(char **args) {
+    // Leading NAME=value words go into this process's environment only
+    args += apply_prefix(args, NULL);
 
-        // After successfully opening inRedirect file but before dup2
-    if (inRedirect != -1) {
-        //debug_fds(); // Debug statement here to see the file descriptor state after opening
-        if (dup2(inRedirect, STDIN_FILENO) < 0) {
-            perror("mysh: dup2 input");
-            close(inRedirect);
-            return -1;
+    if (needs_redirection(args)) {
+        if (setup_redirection(args) != 0) {
+            // Handle error
+            _exit(EXIT_FAILURE);
         }
-        //debug_fds(); // Debug statement here to see the state after successful dup2
-        close(inRedirect);
+    }
+    if (args[0] == NULL) {
+        _exit(EXIT_SUCCESS);
     }
 
-    // Similar adjustment for outRedirect
-    if (outRedirect != -1) {
-        //debug_fds(); // Debug after opening, before dup2
-        if (dup2(outRedirect, STDOUT_FILENO) < 0) {
-            perror("mysh: dup2 output");
-            close(outRedirect);
-            return -1;
-        }
-        //debug_fds(); // Debug after successful dup2
-        close(outRedirect);
+    child_reset();
+    struct func *f = func_lookup(args[0]);
+    if (f) {
+        call_function(f, args);
+        fflush(stdout);
+        _exit(last_exit_status);
+    }
+    int b = find_builtin(args[0]);
+    if (b >= 0) {
+        status_before_builtin = last_exit_status;
+        last_exit_status = 0;
+        stage_builtin = 1;
+        builtin_call(b, args);
+        // _exit, not exit: exit() would sync the shell's buffered stdin back
+        // to its logical offset, rewinding the script under the parent.
+        fflush(stdout);
+        _exit(last_exit_status);
+    }
+    struct sourced_script *s = mysh_script(args[0]);
+    if (s && run_frame(s, args) >= 0) {
+        fflush(stdout);
+        _exit(last_exit_status);
     }
 
-    return 0; // Indicate success
+    exec_command(args); // Execute the command
+    int err = errno;
+    perror("mysh");
+    _exit(err == ENOENT ? 127 : 126); // Not found / found but not runnable
 }
 
-int launch(char **args) {
+// Runs args, a command or a pipeline of them. A single command's words are
+// already expanded; a pipeline's are not, and each stage expands its own
+// where it runs, after it is connected to its pipes.
+int launch(char **args, int tail) {
     //fprintf(stderr, "Debug: launch: Preparing to execute: %s\n", args[0]);
-    int pipefd[2];
-    pid_t pid1, pid2;
-    int pipeIndex = -1;
+    char **stages[MAX_ARGS];
+    pid_t pids[MAX_ARGS];
+    int nstages = 1;
 
-    // Find the pipe in the arguments, if any
+    // Split args into stages at every pipe symbol
+    stages[0] = args;
     for (int i = 0; args[i] != NULL; i++) {
-        if (strcmp(args[i], "|") == 0) {
-            pipeIndex = i;
-            break;
+        if (is_pipe(args[i])) {
+            if (nstages == MAX_ARGS) {
+                fprintf(stderr, "mysh: too many pipeline stages\n");
+                return 1;
+            }
+            args[i] = NULL;
+            stages[nstages++] = &args[i + 1];
         }
     }
 
-    if (pipeIndex == -1) {
+    if (nstages == 1) {
         // No pipe found, handle as single command
         return single_command_execution(args);
-    } else {
-        // Pipe handling
-        if (pipe(pipefd) == -1) {
-            perror("pipe");
-            return -1;
-        }
+    }
 
-        // Split args into two parts
-        args[pipeIndex] = NULL; // Split the command into two parts at the pipe
-        char **args1 = args; // First part
-        char **args2 = &args[pipeIndex + 1]; // Second part
+    // The last stage needs no child of its own if it is a function, builtin
+    // or mysh script, or an external command the shell can become. A name
+    // that is still to be expanded is not known yet, so it gets a child.
+    struct plan p;
+    char **last = stages[nstages - 1];
+    int k = 0, in_shell = 0;
+    while (last[k] != NULL && is_assignment(last[k])) k++;
+    if (last[k] != NULL && strcmp(last[k], "exec") != 0 && !needs_expansion(last[k])) {
+        plan_command(last + k, tail, &p);
+        in_shell = p.kind != PLAN_SPAWN;
+    }
 
-        //fprintf(stderr, "Debug: launch: Setting up a pipe between %s and %s\n", args1[0], args2[0]);
+    fflush(stdout); // Don't let children inherit unflushed shell output
 
-        // Fork first process
-        if ((pid1 = fork()) == 0) {
-            // Child 1: executes command before the pipe
-            close(pipefd[0]); // Close unused read end
+    int prev_read = -1;
+    for (int s = 0; s < nstages; s++) {
+        if (s == nstages - 1 && in_shell) {
+            last_stage_run(-1, last, prev_read, tail);
+            prev_read = -1;
+            break;
+        }
+        int pipefd[2] = {-1, -1};
+        if (s < nstages - 1 && pipe(pipefd) == -1) {
+            perror("pipe");
+            nstages = s;
+            in_shell = 0;
+            break;
+        }
 
-            // Handle file redirection for the first command
-            if (needs_redirection(args1)) {
-                if (setup_redirection(args1) != 0) {
-                    // Handle error
-                    exit(EXIT_FAILURE);
-                }
+        path_prime(stages[s]);
+        pids[s] = fork();
+        if (pids[s] == 0) {
+            // Child: connect to the previous stage and to the next one, then
+            // let any file redirection of this stage override the pipe ends.
+            if (prev_read != -1) {
+                dup2(prev_read, STDIN_FILENO); // Connect stdin to previous pipe read
+                close(prev_read);
             }
-
-            dup2(pipefd[1], STDOUT_FILENO); // Connect stdout to pipe write
-            close(pipefd[1]);
-            execvp(args1[0], args1); // Execute the command
-            exit(EXIT_FAILURE);
+            if (pipefd[1] != -1) {
+                close(pipefd[0]); // Close unused read end
+                dup2(pipefd[1], STDOUT_FILENO); // Connect stdout to pipe write
+                close(pipefd[1]);
+            }
+            child_reset();
+            char **words = stage_words(stages[s]);
+            if (expand_failed()) _exit(last_exit_status);
+            exec_stage(words);
+        } else if (pids[s] < 0) {
+            perror("mysh");
         }
 
-        // Fork second process
-        if ((pid2 = fork()) == 0) {
-            // Child 2: executes command after the pipe
-            close(pipefd[1]); // Close unused write end
+        // Parent keeps only the read end the next stage needs
+        if (prev_read != -1) close(prev_read);
+        if (pipefd[1] != -1) close(pipefd[1]);
+        prev_read = pipefd[0];
+    }
+    if (prev_read != -1) close(prev_read);
 
-            // Handle file redirection for the second command
-            if (needs_redirection(args2)) {
-                if (setup_redirection(args2) != 0) {
-                    // Handle error
-                    exit(EXIT_FAILURE);
-                }
-            }
+    if (run_in_background) {
+        last_bg_pid = pids[nstages - 1];
+        last_exit_status = 0;
+        return 1;
+    }
 
-            dup2(pipefd[0], STDIN_FILENO); // Connect stdin to pipe read
-            close(pipefd[0]);
-            execvp(args2[0], args2); // Execute the command
-            exit(EXIT_FAILURE);
+    // The pipeline's status is that of its last stage
+    for (int s = 0; s < nstages; s++) {
+        int status;
+        if (pids[s] > 0 && waitpid(pids[s], &status, 0) > 0 && s == nstages - 1 && !in_shell) {
+            last_exit_status = wait_status(status);
         }
-
-        // Parent closes both ends and waits for children
-        close(pipefd[0]);
-        close(pipefd[1]);
-        waitpid(pid1, NULL, 0);
-        waitpid(pid2, NULL, 0);
     }
     return 1;
 }
@@ -438,33 +8540,25 @@ int single_command_execution(char **args) {
     pid_t pid,wpid;
     int status;
 
+    fflush(stdout); // Don't let the child inherit unflushed shell output
+    path_prime(args);
     pid = fork();
     if (pid == 0) {
-        // Child process
-        if (needs_redirection(args)) {
-            if (setup_redirection(args) != 0) {
-                // Handle error
-                exit(EXIT_FAILURE);
-            }
-        }
-
-        // Debug print to verify args before execvp call
-        for (int i = 0; args[i] != NULL; i++) {
-            //fprintf(stderr, "Debug: Arg[%d]: %s\n", i, args[i]);
-        }
-
-        if (execvp(args[0], args) == -1) {
-            perror("mysh");
-            exit(EXIT_FAILURE);
-        }
+        // Child process: redirections, prefix assignments and exec
+        exec_stage(args);
     } else if (pid < 0) {
         // Error forking
         perror("mysh");
+        last_exit_status = 1;
+    } else if (run_in_background) {
+        last_bg_pid = pid;
+        last_exit_status = 0;
     } else {
         // Parent process
         do {
             wpid = waitpid(pid, &status, WUNTRACED);
-        } while (!WIFEXITED(status) && !WIFSIGNALED(status));
+        } while (wpid > 0 && !WIFEXITED(status) && !WIFSIGNALED(status));
+        last_exit_status = wpid > 0 ? wait_status(status) : 1;
     }
 
     return 1; // Indicate successful execution (in the context of the shell loop)